@@ -0,0 +1,250 @@
+/**
+ * \file cmdlist.h
+ *
+ * \brief Contains a recorded command list implementation
+ */
+#ifndef CMDLIST_H
+#define CMDLIST_H
+
+#include "predef.h"
+#include "vector.h"
+
+/**
+ * \struct cmdlist
+ *
+ * \brief A sequence of recorded state changes and draw calls
+ *
+ * State changes that set a value that was already recorded are dropped.
+ * Consecutive draws that read adjacent ranges of the same buffers with the
+ * same state are merged into a single draw, if the topology was recorded
+ * as PRIM_TRIANGLES. Derived state like the normal matrix is computed
+ * while recording, so a command list can be recorded once and replayed
+ * cheaply every frame.
+ *
+ * The buffers, textures and shaders passed to a command list are
+ * referenced, not copied, and must stay valid while it is replayed.
+ */
+typedef struct cmdlist cmdlist;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Create an empty command list
+ *
+ * \memberof cmdlist
+ *
+ * \return A pointer to a command list on success, NULL on failure
+ */
+cmdlist *cmdlist_create(void);
+
+/**
+ * \brief Free a command list and all recorded commands
+ *
+ * \memberof cmdlist
+ *
+ * \param cl A pointer to a command list
+ */
+void cmdlist_destroy(cmdlist *cl);
+
+/**
+ * \brief Remove all recorded commands, keeping the allocated memory
+ *
+ * \memberof cmdlist
+ *
+ * \param cl A pointer to a command list
+ */
+void cmdlist_reset(cmdlist *cl);
+
+/**
+ * \brief Record setting the model view matrix
+ *
+ * \memberof cmdlist
+ *
+ * \param cl A pointer to a command list
+ * \param f  A pointer to an array of 16 float values, representing a 4x4
+ *           matrix, stored in column-major order
+ *
+ * \return Non-zero on success, zero if out of memory
+ */
+int cmdlist_set_modelview_matrix(cmdlist *cl, const float *f);
+
+/**
+ * \brief Record setting the projection matrix
+ *
+ * \memberof cmdlist
+ *
+ * \param cl A pointer to a command list
+ * \param f  A pointer to an array of 16 float values, representing a 4x4
+ *           matrix, stored in column-major order
+ *
+ * \return Non-zero on success, zero if out of memory
+ */
+int cmdlist_set_projection_matrix(cmdlist *cl, const float *f);
+
+/**
+ * \brief Record setting the context flags
+ *
+ * \memberof cmdlist
+ *
+ * \param cl    A pointer to a command list
+ * \param flags A set of CONTEXT_FLAGS
+ *
+ * \return Non-zero on success, zero if out of memory
+ */
+int cmdlist_set_flags(cmdlist *cl, int flags);
+
+/**
+ * \brief Record setting the depth test comparison function
+ *
+ * \memberof cmdlist
+ *
+ * \param cl   A pointer to a command list
+ * \param func A COMPARE_FUNCTION value
+ *
+ * \return Non-zero on success, zero if out of memory
+ */
+int cmdlist_set_depth_test(cmdlist *cl, int func);
+
+/**
+ * \brief Record setting the shader program
+ *
+ * \memberof cmdlist
+ *
+ * \param cl     A pointer to a command list
+ * \param shader A pointer to a shader program
+ *
+ * \return Non-zero on success, zero if out of memory
+ */
+int cmdlist_set_shader(cmdlist *cl, const shader_program *shader);
+
+/**
+ * \brief Record setting the texture of a texture layer
+ *
+ * \memberof cmdlist
+ *
+ * \param cl    A pointer to a command list
+ * \param layer The texture layer index
+ * \param tex   A pointer to a texture, or NULL to disable the layer
+ *
+ * \return Non-zero on success, zero if out of memory or the layer
+ *         index is invalid
+ */
+int cmdlist_set_texture(cmdlist *cl, int layer, texture *tex);
+
+/**
+ * \brief Record setting the surface material
+ *
+ * \memberof cmdlist
+ *
+ * \param cl        A pointer to a command list
+ * \param ambient   The ambient color of the material
+ * \param diffuse   The diffuse color of the material
+ * \param specular  The specular color of the material
+ * \param emission  The emissive color of the material
+ * \param shininess The specular exponent of the material
+ *
+ * \return Non-zero on success, zero if out of memory
+ */
+int cmdlist_set_material(cmdlist *cl, vec4 ambient, vec4 diffuse,
+			vec4 specular, vec4 emission, int shininess);
+
+/**
+ * \brief Record setting the vertex buffer and its format
+ *
+ * \memberof cmdlist
+ *
+ * \param cl     A pointer to a command list
+ * \param buffer A pointer to the vertex data
+ * \param format A set of VERTEX_FORMAT flags
+ *
+ * \return Non-zero on success, zero if out of memory or the format is
+ *         VF_LAYOUT, which command lists do not support
+ */
+int cmdlist_set_vertex_buffer(cmdlist *cl, void *buffer, int format);
+
+/**
+ * \brief Record setting the index buffer and its index type
+ *
+ * \memberof cmdlist
+ *
+ * \param cl     A pointer to a command list
+ * \param buffer A pointer to the index data
+ * \param type   A INDEX_TYPE value
+ *
+ * \return Non-zero on success, zero if out of memory
+ */
+int cmdlist_set_index_buffer(cmdlist *cl, void *buffer, int type);
+
+/**
+ * \brief Record setting the primitive topology
+ *
+ * \memberof cmdlist
+ *
+ * \param cl       A pointer to a command list
+ * \param topology A PRIMITIVE_TOPOLOGY value
+ *
+ * \return Non-zero on success, zero if out of memory
+ */
+int cmdlist_set_topology(cmdlist *cl, int topology);
+
+/**
+ * \brief Record setting the bounding box of the following draw calls
+ *
+ * \memberof cmdlist
+ *
+ * \param cl  A pointer to a command list
+ * \param min The minimum object space position of the vertices
+ * \param max The maximum object space position of the vertices
+ *
+ * \return Non-zero on success, zero if out of memory
+ */
+int cmdlist_set_bounds(cmdlist *cl, vec4 min, vec4 max);
+
+/**
+ * \brief Record a non-indexed draw call
+ *
+ * \memberof cmdlist
+ *
+ * \param cl    A pointer to a command list
+ * \param first The first vertex in the vertex buffer to draw
+ * \param count The number of vertices to draw
+ *
+ * \return Non-zero on success, zero if out of memory
+ */
+int cmdlist_draw(cmdlist *cl, unsigned int first, unsigned int count);
+
+/**
+ * \brief Record an indexed draw call
+ *
+ * \memberof cmdlist
+ *
+ * \param cl          A pointer to a command list
+ * \param vertexcount The number of vertices available (for bounds checking)
+ * \param first       The first index in the index buffer to draw
+ * \param count       The number of indices to draw
+ *
+ * \return Non-zero on success, zero if out of memory
+ */
+int cmdlist_draw_indexed(cmdlist *cl, unsigned int vertexcount,
+			unsigned int first, unsigned int count);
+
+/**
+ * \brief Execute all recorded commands on a context
+ *
+ * The state changes are applied to the context, i.e. the context is left
+ * in the state set by the last recorded commands.
+ *
+ * \memberof cmdlist
+ *
+ * \param cl  A pointer to a command list
+ * \param ctx A pointer to a context
+ */
+void cmdlist_replay(const cmdlist *cl, context *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CMDLIST_H */
@@ -10,7 +10,54 @@
 #define MAX_LIGHTS 8
 #define FB_BGRA
 
-#define MAX_INDEX_CACHE 31
+/* number of vertex streams that a vertex layout can read from */
+#define MAX_VERTEX_STREAMS 4
+
+/* maximum number of entries in the post transform vertex cache */
+#define MAX_VERTEX_CACHE 64
+
+/* indexed draws with at least this many indices per vertex shade all
+   vertices up front if the strategy is INDEXED_DRAW_AUTO */
+#define IA_PRETRANSFORM_RATIO 3
+
+/* maximum number of threads shading the vertices of an indexed draw */
+#define IA_MAX_THREADS 8
+
+/* minimum number of vertices to shade per thread for an indexed draw */
+#define IA_THREAD_VERTICES 4096
+
+/* maximum number of vertices buffered in immediate mode before the
+   triangles are drawn, must be a power of two */
+#define IA_IMMEDIATE_VERTICES 4096
+
+/* maximum number of vertices processed by a batched vertex shader call,
+   must be a multiple of 4 */
+#define SHADER_BATCH_SIZE 64
+
+/* maximum number of fragments processed by a span fragment shader call,
+   must be a multiple of 4 and at most 32 */
+#define SHADER_SPAN_SIZE 16
+
+/* number of registers, uniforms and instructions of a shadervm program */
+#define SHADERVM_REGISTERS 16
+#define SHADERVM_UNIFORMS 16
+#define SHADERVM_MAX_CODE 64
+
+/* triangles reaching further than this many pixels outside of the
+   viewport are clipped, smaller ones are left to the scissored rasterizer
+   which converts screen coordinates to int */
+#define GUARD_BAND 8192.0f
+
+/* triangles whose samples fit into a square block of this many pixels
+   are rasterized without per scanline setup */
+#define SMALL_TRIANGLE_SIZE 8
+
+/* smallest w coordinate that a vertex is clipped to */
+#define CLIP_MIN_W 1e-5f
+
+/* size of the tiles for frame buffer damage tracking, as a power of two */
+#define FB_TILE_SHIFT 5
+#define FB_TILE_SIZE (1 << FB_TILE_SHIFT)
 
 #ifdef FB_BGRA
 	#define RED 2
@@ -56,16 +56,133 @@ typedef enum {
 	/**
 	 * \brief 2 component float texture coordinates for texture channel 0
 	 */
-	VF_TEX0 = 0x1000
+	VF_TEX0 = 0x1000,
+
+	/**
+	 * \brief Only read the position, e.g. for a depth-only pass
+	 *
+	 * Can be combined with any of the other flags. The vertices keep
+	 * the size and layout given by the other flags, but no attribute
+	 * except the position is read, so the shaders get the position
+	 * only.
+	 */
+	VF_POSITION_ONLY = 0x4000,
+
+	/**
+	 * \brief Read the vertices as described by the vertex_layout of the
+	 *        context, all other flags except VF_POSITION_ONLY are
+	 *        ignored
+	 */
+	VF_LAYOUT = 0x8000
 } VERTEX_FORMAT;
 
+/**
+ * \enum ATTRIB_FORMAT
+ *
+ * \brief Data format of a single attribute in a vertex layout
+ */
+typedef enum {
+	/** \brief The attribute is not read and keeps its default value */
+	AF_NONE = 0,
+	/** \brief 2 component float */
+	AF_FLOAT2 = 1,
+	/** \brief 3 component float */
+	AF_FLOAT3 = 2,
+	/** \brief 4 component float */
+	AF_FLOAT4 = 3,
+	/** \brief 3 component unsigned byte, mapped to [0,1] */
+	AF_UBYTE3_NORM = 4,
+	/** \brief 4 component unsigned byte, mapped to [0,1] */
+	AF_UBYTE4_NORM = 5,
+	/** \brief 2 component half float */
+	AF_HALF2 = 6,
+	/** \brief 3 component half float */
+	AF_HALF3 = 7,
+	/** \brief 4 component half float */
+	AF_HALF4 = 8,
+	/** \brief 2 component signed short, mapped to [-1,1] */
+	AF_SHORT2_NORM = 9,
+	/** \brief 3 component signed short, mapped to [-1,1] */
+	AF_SHORT3_NORM = 10,
+	/** \brief 4 component signed short, mapped to [-1,1] */
+	AF_SHORT4_NORM = 11,
+	/** \brief 2 component unsigned short, mapped to [0,1] */
+	AF_USHORT2_NORM = 12,
+	/** \brief 4 component unsigned short, mapped to [0,1] */
+	AF_USHORT4_NORM = 13,
+	/**
+	 * \brief 32 bit integer with signed x, y and z in 10 bits each and
+	 *        w in 2 bits, starting at the least significant bit, mapped
+	 *        to [-1,1]
+	 */
+	AF_INT_10_10_10_2_NORM = 14
+} ATTRIB_FORMAT;
+
+/**
+ * \enum INDEX_TYPE
+ *
+ * \brief Data type of the entries in an index buffer
+ */
+typedef enum {
+	/** \brief 16 bit unsigned integer indices */
+	INDEX_U16 = 0,
+	/** \brief 8 bit unsigned integer indices */
+	INDEX_U8 = 1,
+	/** \brief 32 bit unsigned integer indices */
+	INDEX_U32 = 2
+} INDEX_TYPE;
+
+/**
+ * \enum PRIMITIVE_TOPOLOGY
+ *
+ * \brief How a sequence of vertices is assembled into triangles
+ */
+typedef enum {
+	/** \brief Every three vertices form an independent triangle */
+	PRIM_TRIANGLES = 0,
+
+	/**
+	 * \brief Every vertex forms a triangle with the two vertices
+	 *        before it, every other triangle has its winding flipped
+	 */
+	PRIM_TRIANGLE_STRIP = 1,
+
+	/**
+	 * \brief Every vertex forms a triangle with the vertex before it
+	 *        and the first vertex
+	 */
+	PRIM_TRIANGLE_FAN = 2
+} PRIMITIVE_TOPOLOGY;
+
+/**
+ * \enum INDEXED_DRAW_STRATEGY
+ *
+ * \brief How indexed draw calls shade the referenced vertices
+ */
+typedef enum {
+	/** \brief Choose a strategy from the vertex and index counts */
+	INDEXED_DRAW_AUTO = 0,
+
+	/** \brief Shade vertices on demand through the post transform cache */
+	INDEXED_DRAW_CACHE = 1,
+
+	/**
+	 * \brief Shade every referenced vertex exactly once into a scratch
+	 *        buffer before assembling triangles
+	 *
+	 * For large draws, the vertices are shaded by multiple threads, so
+	 * the vertex shader must not modify any shared state.
+	 */
+	INDEXED_DRAW_PRETRANSFORM = 2
+} INDEXED_DRAW_STRATEGY;
+
 /**
  * \enum CONTEXT_FLAGS
  *
  * \brief State flags for the rendering context
  */
 typedef enum {
-	/** \brief Clip out-of-bounds depth values */
+	/** \brief Clip triangles against the near and far plane */
 	DEPTH_CLIP = 0x0001,
 	/** \brief Enable write to depth buffer */
 	DEPTH_WRITE = 0x0002,
@@ -78,43 +195,125 @@ typedef enum {
 	/** \brief Cull back facing triangles */
 	CULL_BACK = 0x0020,
 	/** \brief Enable color blending */
-	BLEND_ENABLE = 0x0040
+	BLEND_ENABLE = 0x0040,
+	/**
+	 * \brief Start a new strip or fan when the index restart_index is
+	 *        encountered in an index buffer
+	 */
+	PRIMITIVE_RESTART = 0x0080,
+	/**
+	 * \brief Merge identical vertices specified in immediate mode, so
+	 *        that vertices shared by several triangles are shaded once
+	 */
+	IMMEDIATE_DEDUP = 0x0100,
+	/**
+	 * \brief Skip draw calls whose bounding box is outside the view
+	 *        frustum, see context::bounds
+	 */
+	BOUNDS_TEST = 0x0200,
+	/**
+	 * \brief Let the built in lighting trade precision for speed, i.e.
+	 *        use approximate reciprocal square roots and raise to the
+	 *        shininess by repeated squaring
+	 */
+	LIGHTING_FAST = 0x0400
 } CONTEXT_FLAGS;
 
+/**
+ * \enum DIRTY_FLAGS
+ *
+ * \brief Parts of the derived state of a context that are out of date
+ */
+typedef enum {
+	/** \brief The model-view or the projection matrix has changed */
+	DIRTY_TRANSFORM = 0x01,
+	/**
+	 * \brief A light or the material has changed, context_validate
+	 *        detects this on its own
+	 */
+	DIRTY_LIGHTING = 0x02,
+	/** \brief All of the above */
+	DIRTY_ALL = 0x03
+} DIRTY_FLAGS;
+
+/**
+ * \struct rs_instance
+ *
+ * \brief Per-instance attributes for instanced drawing
+ */
+struct rs_instance {
+	/** \brief Model-View matrix of the instance, column-major order */
+	float modelview[16];
+
+	/** \brief Multiplied with the color attribute of all vertices */
+	vec4 color;
+};
+
+/**
+ * \struct rs_light
+ *
+ * \brief The settings of a light
+ */
+struct rs_light {
+	vec4 ambient;
+	vec4 diffuse;
+	vec4 specular;
+	vec4 position;
+	float attenuation_constant;
+	float attenuation_linear;
+	float attenuation_quadratic;
+	int enable;
+};
+
+/**
+ * \struct rs_material
+ *
+ * \brief The surface material parameters for lighting calculations
+ */
+struct rs_material {
+	vec4 ambient;
+	vec4 diffuse;
+	vec4 specular;
+	vec4 emission;
+	int shininess;
+};
+
 /**
  * \struct context
  *
  * \brief A context encapsulates all global state of the rendering pipeline
  */
 struct context {
-	/** \brief Immediate mode rendering state */
+	/**
+	 * \brief Immediate mode rendering state
+	 *
+	 * Vertices are collected into a buffer that is grown on demand,
+	 * together with a triangle list indexing them. With IMMEDIATE_DEDUP,
+	 * a hash table with twice the capacity of the vertex buffer is used
+	 * for finding identical vertices. If a buffer cannot be grown, the
+	 * triangle being specified is dropped. The memory is released by
+	 * context_cleanup.
+	 */
 	struct {
-		rs_vertex vertex[3];
+		rs_vertex *vertices;
+		unsigned int *indices;
+		unsigned int *hash;
+		unsigned int vertex_count;
+		unsigned int index_count;
+		unsigned int vertex_max;
+		unsigned int index_max;
+		unsigned int hash_max;
+		unsigned int skip;      /* rest of a dropped triangle */
 		rs_vertex next;
-		int current;
+		int dedup;
 		int active;
 	} immediate;
 
-	/** \brief The settings of a light */
-	struct {
-		vec4 ambient;
-		vec4 diffuse;
-		vec4 specular;
-		vec4 position;
-		float attenuation_constant;
-		float attenuation_linear;
-		float attenuation_quadratic;
-		int enable;
-	} light[MAX_LIGHTS];
+	/** \brief The settings of the lights */
+	rs_light light[MAX_LIGHTS];
 
 	/** \brief The surface material parameters for lighting calculations */
-	struct {
-		vec4 ambient;
-		vec4 diffuse;
-		vec4 specular;
-		vec4 emission;
-		int shininess;
-	} material;
+	rs_material material;
 
 	/**
 	 * \brief Identifies the actual drawing area on the framebuffer
@@ -142,10 +341,57 @@ struct context {
 		int maxy;
 	} draw_area;
 
+	/**
+	 * \brief Post transform vertex cache used for indexed drawing
+	 *
+	 * The entries are split into size / ways sets. A vertex index is
+	 * mapped to a set by its value and the entries within a set are
+	 * replaced in FIFO order, i.e. ways == size gives a fully
+	 * associative FIFO cache like most GPUs use.
+	 *
+	 * Entries only hold the attributes in mask, packed into stride
+	 * vectors of a pool that is grown on demand and released by
+	 * context_cleanup. The mask is taken from the first vertex a draw
+	 * stores, vertices using other attributes are not cached.
+	 *
+	 * \note Do NOT set size or ways directly, use
+	 *       context_set_vertex_cache.
+	 */
 	struct {
-		int index;
-		rs_vertex vtx;
-	} post_tl_cache[MAX_INDEX_CACHE];
+		/** \brief Vertex index held by each entry, UINT_MAX if empty */
+		unsigned int index[MAX_VERTEX_CACHE]
+			__attribute__ ((aligned (16)));
+
+		/** \brief The used mask of the vertex held by each entry */
+		int used[MAX_VERTEX_CACHE];
+
+		/** \brief Packed attributes, stride vectors per entry */
+		vec4 *pool;
+
+		/** \brief The number of vectors the pool has room for */
+		unsigned int pool_max;
+
+		/** \brief Attributes stored per entry, zero if not laid out */
+		int mask;
+
+		/** \brief The attribute slots in mask, in ascending order */
+		int slot[ATTRIB_COUNT];
+
+		/** \brief The number of attributes in mask */
+		unsigned int stride;
+
+		/** \brief Next entry to replace in each set */
+		unsigned int next[MAX_VERTEX_CACHE];
+
+		unsigned int size;      /**< \brief Number of entries */
+		unsigned int ways;      /**< \brief Entries per set */
+
+		/** \brief Number of vertices found in the cache */
+		unsigned long hits;
+
+		/** \brief Number of vertices that had to be shaded */
+		unsigned long misses;
+	} vertex_cache;
 
 	int flags;      /**< \brief A set of CONTEXT_FLAGS */
 
@@ -158,10 +404,18 @@ struct context {
 	/** \brief Pointer to textures for different texture layers */
 	texture *textures[MAX_TEXTURES];
 
-	/** \brief Model-View matrix used by T&L stage */
+	/**
+	 * \brief Model-View matrix used by T&L stage
+	 *
+	 * \note Do NOT set this directly, use context_set_modelview_matrix.
+	 */
 	float modelview[16];
 
-	/** \brief Projection matrix used by T&L stage */
+	/**
+	 * \brief Projection matrix used by T&L stage
+	 *
+	 * \note Do NOT set this directly, use context_set_projection_matrix.
+	 */
 	float projection[16];
 
 	/** \brief Normal matrix computed from modelview matrix */
@@ -173,8 +427,90 @@ struct context {
 	/** \brief Vertex buffer for input assember */
 	void *vertexbuffer;
 
+	/**
+	 * \brief Vertex layout, used instead of vertexbuffer if the
+	 *        vertex_format is VF_LAYOUT
+	 *
+	 * Every attribute of vertex i is read from its stream at
+	 * offset + i * stride, so attributes can be interleaved, padded or
+	 * kept in separate arrays. With VF_POSITION_ONLY, only the stream
+	 * of the position is read.
+	 */
+	struct {
+		/** \brief Base pointers of the vertex streams */
+		const void *stream[MAX_VERTEX_STREAMS];
+
+		/** \brief Location of each attribute, indexed by ATTRIB_SLOT */
+		struct {
+			int format;             /**< \brief A ATTRIB_FORMAT */
+			unsigned int stream;    /**< \brief Stream index */
+			unsigned int offset;    /**< \brief Offset in bytes */
+			unsigned int stride;    /**< \brief Stride in bytes */
+		} attrib[ATTRIB_COUNT];
+	} vertex_layout;
+
+	/**
+	 * \brief Object space bounding box of the vertex positions of the
+	 *        next draw calls, ignored unless the BOUNDS_TEST flag is set
+	 *
+	 * Before any vertex is fetched, the box is transformed with the
+	 * projection and model-view matrices (per instance for instanced
+	 * draws) and the draw is skipped if the box is completely outside
+	 * the left, right, top or bottom plane of the view frustum or behind
+	 * the viewer, and with DEPTH_CLIP also if it is completely in front
+	 * of the near or behind the far plane. The w components are ignored.
+	 */
+	struct {
+		vec4 min;
+		vec4 max;
+	} bounds;
+
 	/** \brief Index buffer for input assembler */
-	unsigned short *indexbuffer;
+	void *indexbuffer;
+
+	/** \brief A INDEX_TYPE value, the data type of the index buffer */
+	int index_type;
+
+	/** \brief A PRIMITIVE_TOPOLOGY value used for drawing */
+	int topology;
+
+	/**
+	 * \brief Index value that restarts a primitive if the
+	 *        PRIMITIVE_RESTART flag is set
+	 */
+	unsigned int restart_index;
+
+	/**
+	 * \brief The instance currently drawn by an instanced draw call,
+	 *        NULL otherwise
+	 */
+	const rs_instance *instance;
+
+	/**
+	 * \brief Index of the instance currently drawn, can be read by the
+	 *        vertex shader
+	 */
+	unsigned int instance_id;
+
+	/** \brief A INDEXED_DRAW_STRATEGY value */
+	int indexed_strategy;
+
+	/**
+	 * \brief Scratch memory of the input assembler, grown on demand
+	 *        and released by context_cleanup
+	 */
+	struct {
+		rs_vertex *vertices;
+		unsigned int *remap;
+		unsigned int *triangles;
+		float *normals;
+		vec4 *positions;
+		unsigned int vertex_count;
+		unsigned int remap_count;
+		unsigned int triangle_count;
+		unsigned int normal_count;
+		unsigned int position_count;
+	} scratch;
 
 	/** \brief Which shader program to use */
 	const shader_program *shader;
@@ -190,28 +526,101 @@ struct context {
 
 	/** \brief Color mask determined from flags */
 	color4 colormask;
+
+	/** \brief A set of DIRTY_FLAGS, see context_invalidate */
+	int dirty;
+
+	/**
+	 * \brief State derived from the other fields by context_validate
+	 *
+	 * The input assembler validates the context at the start of every
+	 * draw call, so that shaders and the rasterizer can use this instead
+	 * of computing it again for every vertex or fragment.
+	 *
+	 * \note Do NOT set this directly.
+	 */
+	struct {
+		/** \brief The projection times the model-view matrix */
+		float mvp[16];
+
+		/** \brief Light colors multiplied with the material colors */
+		struct {
+			vec4 diffuse;
+			vec4 specular;
+		} light[MAX_LIGHTS];
+
+		/** \brief Indices of the enabled lights in ascending order */
+		int lights[MAX_LIGHTS];
+
+		/** \brief The number of enabled lights */
+		int light_count;
+
+		/**
+		 * \brief The ambient colors of all enabled lights multiplied
+		 *        with the material ambient color, plus the emission
+		 */
+		vec4 ambient;
+
+		/**
+		 * \brief The COMPARE_FUNCTION of the depth test, or
+		 *        COMPARE_ALWAYS if the DEPTH_TEST flag is not set
+		 */
+		int depth_func;
+
+		/**
+		 * \brief Writes a fragment that passed the depth test, chosen
+		 *        by the rasterizer for the blend, color mask and
+		 *        depth write state of the triangle it draws
+		 */
+		void (*write_fragment)(const context *ctx, const color4 color,
+					float depth, color4 *color_buffer,
+					float *depth_buffer);
+
+		/** \brief The lights the derived colors were computed from */
+		rs_light src_light[MAX_LIGHTS];
+
+		/** \brief The material the derived colors were computed from */
+		rs_material src_material;
+	} derived;
 };
 
+/* the depth comparison in effect for the flags of a context */
+static MATH_INLINE int depth_func(const context *ctx)
+{
+	return (ctx->flags & DEPTH_TEST) ? (int)ctx->depth_test :
+					COMPARE_ALWAYS;
+}
+
 static MATH_CONST int depth_test(const context* ctx,
 				const float z, const float ref)
 {
-	int depthtest[8];
-
-	if (ctx->flags & DEPTH_TEST) {
-		depthtest[COMPARE_ALWAYS] = 1;
-		depthtest[COMPARE_NEVER] = 0;
-		depthtest[COMPARE_LESS] = z < ref;
-		depthtest[COMPARE_GREATER] = z > ref;
-		depthtest[COMPARE_NOT_EQUAL] = depthtest[COMPARE_LESS] |
-						depthtest[COMPARE_GREATER];
-		depthtest[COMPARE_EQUAL] = !depthtest[COMPARE_NOT_EQUAL];
-		depthtest[COMPARE_LESS_EQUAL] = depthtest[COMPARE_EQUAL] |
-						depthtest[COMPARE_LESS];
-		depthtest[COMPARE_GREATER_EQUAL] = depthtest[COMPARE_EQUAL] |
-		depthtest[COMPARE_GREATER];
-
-		if( !depthtest[ctx->depth_test] )
+	switch (ctx->derived.depth_func) {
+	case COMPARE_NEVER:
+		return 0;
+	case COMPARE_EQUAL:
+		if (z < ref || z > ref)
+			return 0;
+		break;
+	case COMPARE_NOT_EQUAL:
+		if (!(z < ref || z > ref))
 			return 0;
+		break;
+	case COMPARE_LESS:
+		if (!(z < ref))
+			return 0;
+		break;
+	case COMPARE_LESS_EQUAL:
+		if (z > ref)
+			return 0;
+		break;
+	case COMPARE_GREATER:
+		if (!(z > ref))
+			return 0;
+		break;
+	case COMPARE_GREATER_EQUAL:
+		if (z < ref)
+			return 0;
+		break;
 	}
 
 	if ((ctx->flags & DEPTH_CLIP) &&
@@ -234,6 +643,15 @@ extern "C" {
  */
 void context_init(context *ctx);
 
+/**
+ * \brief Free all memory owned by a context object
+ *
+ * \memberof context
+ *
+ * \param ctx A pointer to a context
+ */
+void context_cleanup(context *ctx);
+
 /**
  * \brief Set the currently active model view matrix and update the
  *        normal matrix
@@ -257,6 +675,49 @@ void context_set_modelview_matrix(context *ctx, float *f);
  */
 void context_set_projection_matrix(context *ctx, float *f);
 
+/**
+ * \brief Compute the normal matrices for the model view matrices of an
+ *        array of instances
+ *
+ * \memberof context
+ *
+ * \param normal    Receives count 4x4 matrices in column-major order
+ * \param instances A pointer to an array of instances
+ * \param count     The number of instances
+ */
+void context_compute_normal_matrices(float *normal,
+				const rs_instance *instances,
+				unsigned int count);
+
+/**
+ * \brief Mark parts of the derived state of a context as out of date
+ *
+ * \memberof context
+ *
+ * Setting the matrices through the context functions does this
+ * automatically. Changes to the lights and the material are detected by
+ * context_validate, which compares them with the copies the derived
+ * state was computed from.
+ *
+ * \param ctx   A pointer to a context
+ * \param dirty A set of DIRTY_FLAGS
+ */
+void context_invalidate(context *ctx, int dirty);
+
+/**
+ * \brief Rebuild the derived state of a context
+ *
+ * \memberof context
+ *
+ * Recomputes the parts marked by context_invalidate or found to have
+ * changed, as well as the state derived from the flags and the depth
+ * test function, which is cheap enough to rebuild every time. The input
+ * assembler calls this at the start of every draw call.
+ *
+ * \param ctx A pointer to a context
+ */
+void context_validate(context *ctx);
+
 /**
  * \brief Configure viewport mapping
  *
@@ -273,6 +734,24 @@ void context_set_projection_matrix(context *ctx, float *f);
 void context_set_viewport(context *ctx, int x, int y,
 			unsigned int width, unsigned int height);
 
+/**
+ * \brief Configure the post transform vertex cache
+ *
+ * \memberof context
+ *
+ * The hit and miss counters are reset. By default, a fully associative
+ * FIFO cache with 32 entries is used.
+ *
+ * \param ctx  A pointer to a context
+ * \param size The number of cached vertices, at most MAX_VERTEX_CACHE.
+ *             Zero disables the cache.
+ * \param ways The number of entries per set. Must divide size.
+ *
+ * \return Non-zero on success, zero if the configuration is invalid
+ */
+int context_set_vertex_cache(context *ctx, unsigned int size,
+			unsigned int ways);
+
 #ifdef __cplusplus
 }
 #endif
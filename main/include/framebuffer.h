@@ -19,8 +19,29 @@ struct framebuffer {
 	float *depth;		/**< \brief Depth buffer scan line data */
 	int width;		/**< \brief Frame buffer width in pixels */
 	int height;		/**< \brief Frame buffer height in pixels */
+
+	/**
+	 * \brief One flag per FB_TILE_SIZE x FB_TILE_SIZE tile, non-zero if
+	 *        the color buffer in the tile was written to since the
+	 *        last call to framebuffer_reset_dirty
+	 */
+	unsigned char *dirty;
+	int tiles_x;		/**< \brief Number of tile columns */
+	int tiles_y;		/**< \brief Number of tile rows */
 };
 
+/**
+ * \struct fb_rect
+ *
+ * \brief A rectangular region of a frame buffer
+ */
+typedef struct {
+	int x;			/**< \brief Distance from left */
+	int y;			/**< \brief Distance from top */
+	int width;		/**< \brief Horizontal extents */
+	int height;		/**< \brief Vertical extents */
+} fb_rect;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -72,6 +93,47 @@ void framebuffer_clear(framebuffer *fb, int r, int g, int b, int a);
  */
 void framebuffer_clear_depth(framebuffer *fb, float value);
 
+/**
+ * \brief Flag a region of the color buffer as modified
+ *
+ * \memberof framebuffer
+ *
+ * \param fb   A pointer to a frame buffer structure
+ * \param minx The left most modified pixel column
+ * \param miny The top most modified pixel row
+ * \param maxx The right most modified pixel column
+ * \param maxy The bottom most modified pixel row
+ */
+void framebuffer_mark_dirty(framebuffer *fb, int minx, int miny,
+			int maxx, int maxy);
+
+/**
+ * \brief Flag the entire color buffer as not modified
+ *
+ * \memberof framebuffer
+ *
+ * \param fb A pointer to a frame buffer structure
+ */
+void framebuffer_reset_dirty(framebuffer *fb);
+
+/**
+ * \brief Get a list of rectangles covering the modified regions
+ *
+ * Adjacent modified tiles are merged into larger rectangles. If more
+ * than max rectangles would be required, a single rectangle enclosing
+ * all modified tiles is returned instead.
+ *
+ * \memberof framebuffer
+ *
+ * \param fb    A pointer to a frame buffer structure
+ * \param rects Returns the rectangles
+ * \param max   The maximum number of rectangles to return, at least 1
+ *
+ * \return The number of rectangles written to the array
+ */
+unsigned int framebuffer_get_dirty_rects(const framebuffer *fb,
+					fb_rect *rects, unsigned int max);
+
 #ifdef __cplusplus
 }
 #endif
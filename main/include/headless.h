@@ -0,0 +1,89 @@
+/**
+ * \file headless.h
+ *
+ * \brief Contains an offscreen frame output implementation
+ */
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <stddef.h>
+
+#include "framebuffer.h"
+
+/**
+ * \enum HEADLESS_FORMAT
+ *
+ * \brief Encoding of the frames written by a headless output
+ */
+typedef enum {
+	/** \brief Raw frame buffer contents, 4 bytes per pixel, BGRA order */
+	HEADLESS_RAW_BGRA = 0,
+
+	/** \brief A sequence of binary PPM (P6) images */
+	HEADLESS_PPM = 1,
+
+	/** \brief A YUV4MPEG2 stream with I420 (4:2:0) chroma subsampling */
+	HEADLESS_Y4M = 2
+} HEADLESS_FORMAT;
+
+typedef struct headless headless;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Create a headless output that writes frames from a background thread
+ *
+ * Submitted frames are copied into a bounded ring of frame slots, from
+ * which a writer thread encodes them and writes them out. Submitting a
+ * frame only blocks if all slots are still waiting to be written.
+ *
+ * \memberof headless
+ *
+ * \param path   The file, pipe or FIFO to write to. "-" writes to stdout.
+ * \param format A \ref HEADLESS_FORMAT value
+ * \param width  The width of the frames in pixels
+ * \param height The height of the frames in pixels
+ * \param fps    The frame rate stored in the stream header (Y4M only)
+ * \param frames The number of frame slots in the ring
+ *
+ * \return A pointer to a headless output on success, NULL on failure
+ *         (e.g. if the ring of frame slots does not fit into memory)
+ */
+headless *headless_create(const char *path, int format, size_t width,
+			size_t height, unsigned int fps, unsigned int frames);
+
+/**
+ * \brief Flush all pending frames, stop the writer thread and free
+ *        all resources
+ *
+ * \memberof headless
+ *
+ * \param out A pointer to a headless output
+ */
+void headless_destroy(headless *out);
+
+/**
+ * \brief Queue the color buffer of a frame buffer for output
+ *
+ * Only the regions flagged as modified in the frame buffer are copied,
+ * the rest of the frame is kept from the previously submitted frame.
+ * The modified flags of the frame buffer are reset afterwards.
+ *
+ * \memberof headless
+ *
+ * \param out A pointer to a headless output
+ * \param fb  A frame buffer with the same dimensions as the output
+ *
+ * \return Non-zero on success, zero if the frame could not be
+ *         written (e.g. a previous write failed or the reading end
+ *         of a pipe was closed)
+ */
+int headless_submit_framebuffer(headless *out, framebuffer *fb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HEADLESS_H */
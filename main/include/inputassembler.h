@@ -16,6 +16,9 @@ extern "C" {
  * \brief Read vertices from the currently set buffer and send them down the
  *        rendering pipeline
  *
+ * The vertices are assembled into triangles according to the topology set
+ * in the context.
+ *
  * \param ctx         A pointer to a context object
  * \param vertexcount The number of vertices to read from the input stream
  */
@@ -25,6 +28,12 @@ void ia_draw_triangles(context *ctx, unsigned int vertexcount);
  * \brief Read vertices from the currently vertex & index buffers and send
  *        them down the rendering pipeline
  *
+ * The index buffer is read using the index type of the context and the
+ * indices are assembled into triangles according to the topology set in
+ * the context. If the PRIMITIVE_RESTART flag is set, the restart index
+ * starts a new strip or fan. Triangles referencing vertices out of bounds
+ * are skipped.
+ *
  * \param ctx         A pointer to a context object
  * \param vertexcount The number of vertices available (for bounds checking)
  * \param indexcount  The number of indices to read from the index buffer
@@ -32,15 +41,69 @@ void ia_draw_triangles(context *ctx, unsigned int vertexcount);
 void ia_draw_triangles_indexed(context *ctx, unsigned int vertexcount,
 				unsigned int indexcount);
 
+/**
+ * \brief Draw multiple instances of the vertices in the currently set buffer
+ *
+ * The vertices are drawn once per instance, with the model view matrix of
+ * the instance and the vertex colors multiplied by the instance color.
+ * The normal matrices of all instances are computed up front. While an
+ * instance is drawn, its index is available to the vertex shader as
+ * instance_id in the context. The matrices of the context are restored
+ * afterwards.
+ *
+ * \param ctx           A pointer to a context object
+ * \param vertexcount   The number of vertices to read from the input stream
+ * \param instances     A pointer to an array of per-instance attributes
+ * \param instancecount The number of instances to draw
+ */
+void ia_draw_triangles_instanced(context *ctx, unsigned int vertexcount,
+				const rs_instance *instances,
+				unsigned int instancecount);
+
+/**
+ * \brief Draw multiple instances of the currently set vertex & index
+ *        buffers
+ *
+ * Works like ia_draw_triangles_instanced. If all vertices are shaded up
+ * front (see INDEXED_DRAW_STRATEGY), the triangles are assembled and the
+ * vertices are fetched only once for all instances.
+ *
+ * \param ctx           A pointer to a context object
+ * \param vertexcount   The number of vertices available (for bounds
+ *                      checking)
+ * \param indexcount    The number of indices to read from the index buffer
+ * \param instances     A pointer to an array of per-instance attributes
+ * \param instancecount The number of instances to draw
+ */
+void ia_draw_triangles_indexed_instanced(context *ctx,
+					unsigned int vertexcount,
+					unsigned int indexcount,
+					const rs_instance *instances,
+					unsigned int instancecount);
+
+/**
+ * \brief Get the size of a single vertex in a vertex buffer
+ *
+ * \param format A set of VERTEX_FORMAT flags
+ *
+ * \return The number of bytes per vertex
+ */
+unsigned int ia_vertex_size(int format);
+
 /**
  * \brief Begin immediate mode rendering
  *
  * In immediate mode rendering, vertices and vertex attributes can be
  * specified via the functions ia_vertex, ia_color, ia_normal and
  * ia_texcoord. The vertex attributes are stored in the context and used
- * for every vertex specified via ia_vertex until they are changed. When
- * enoguh vertices are specified to draw a prititive, the primitive is
- * rendered.
+ * for every vertex specified via ia_vertex until they are changed. Every
+ * three vertices form a triangle.
+ *
+ * The vertices are collected in a buffer and drawn in batches like an
+ * indexed draw, when the buffer is full or by ia_end. The context state
+ * must therefore not be changed between ia_begin and ia_end. If the
+ * IMMEDIATE_DEDUP flag is set, identical vertices are stored only once
+ * and shaded once for all triangles using them.
  *
  * \param ctx A pointer to a context object
  */
@@ -78,6 +141,9 @@ void ia_texcoord(context *ctx, int layer, float s, float t);
 /**
  * \brief Exit immediate mode rendering
  *
+ * Draws the triangles that are still buffered. Left over vertices that
+ * do not form a complete triangle are discarded.
+ *
  * \param ctx A pointer to a context object
  */
 void ia_end(context *ctx);
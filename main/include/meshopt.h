@@ -0,0 +1,116 @@
+/**
+ * \file meshopt.h
+ *
+ * \brief Contains offline optimizations for indexed triangle meshes
+ *
+ * The functions in this file operate on indexed triangle lists, with
+ * indices of any INDEX_TYPE and interleaved vertices in any VERTEX_FORMAT
+ * except VF_LAYOUT. They are meant to be run once after loading a mesh.
+ * A typical sequence is meshopt_optimize_vertex_cache, then
+ * meshopt_optimize_overdraw and finally meshopt_optimize_vertex_fetch.
+ */
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include "predef.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Reorder the triangles of a mesh for post transform cache reuse
+ *
+ * Implements the Tipsify algorithm by Sander et al., which emits all
+ * remaining triangles around one vertex at a time and then continues with
+ * a vertex that is likely to still be in a FIFO cache of the given size.
+ * The cache of the input assembler (see context_set_vertex_cache) replaces
+ * its entries in FIFO order as well.
+ *
+ * \param indices     A pointer to the index buffer, reordered in place
+ * \param type        A INDEX_TYPE value
+ * \param indexcount  The number of indices
+ * \param vertexcount The number of vertices referenced by the indices
+ * \param cachesize   The number of vertices the target cache can hold
+ *
+ * \return Non-zero on success, zero if out of memory or an index is out of
+ *         range
+ */
+int meshopt_optimize_vertex_cache(void *indices, int type,
+				unsigned int indexcount,
+				unsigned int vertexcount,
+				unsigned int cachesize);
+
+/**
+ * \brief Reorder clusters of triangles to reduce overdraw
+ *
+ * The index buffer should already be optimized for the vertex cache. It
+ * is split into clusters at points where the cache starts over, and
+ * further as long as the ACMR of the result stays within threshold times
+ * the one of the input. The clusters are then sorted by their occlusion
+ * potential, i.e. clusters facing away from the center of the mesh are
+ * drawn first, which is a good order from any view direction. If even
+ * sorting the unsplit clusters exceeds the threshold, the index buffer
+ * is left unchanged.
+ *
+ * \param indices     A pointer to the index buffer, reordered in place
+ * \param type        A INDEX_TYPE value
+ * \param indexcount  The number of indices
+ * \param vertices    A pointer to the vertex buffer
+ * \param format      A set of VERTEX_FORMAT flags
+ * \param vertexcount The number of vertices
+ * \param threshold   The acceptable increase of the ACMR, e.g. 1.05.
+ *                    1.0 keeps all of the gain of the vertex cache
+ *                    optimization.
+ *
+ * \return Non-zero on success, zero if out of memory or an index is out of
+ *         range
+ */
+int meshopt_optimize_overdraw(void *indices, int type,
+			unsigned int indexcount, const void *vertices,
+			int format, unsigned int vertexcount,
+			float threshold);
+
+/**
+ * \brief Reorder the vertices of a mesh in the order they are referenced
+ *
+ * Vertices are moved to the order in which the index buffer first
+ * references them and the indices are remapped. Unreferenced vertices
+ * are moved to the end.
+ *
+ * \param vertices    A pointer to the vertex buffer, reordered in place
+ * \param format      A set of VERTEX_FORMAT flags
+ * \param vertexcount The number of vertices
+ * \param indices     A pointer to the index buffer, remapped in place
+ * \param type        A INDEX_TYPE value
+ * \param indexcount  The number of indices
+ *
+ * \return The number of referenced vertices, zero if out of memory
+ */
+unsigned int meshopt_optimize_vertex_fetch(void *vertices, int format,
+					unsigned int vertexcount,
+					void *indices, int type,
+					unsigned int indexcount);
+
+/**
+ * \brief Compute the average cache miss ratio of an index buffer
+ *
+ * Simulates a FIFO post transform cache and returns the number of
+ * vertices that would have to be shaded per triangle. The optimum is
+ * around 0.5 for regular meshes, the worst case is 3.
+ *
+ * \param indices    A pointer to the index buffer
+ * \param type       A INDEX_TYPE value
+ * \param indexcount The number of indices
+ * \param cachesize  The number of entries of the simulated cache
+ *
+ * \return The ACMR of the index buffer
+ */
+double meshopt_compute_acmr(const void *indices, int type,
+			unsigned int indexcount, unsigned int cachesize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MESHOPT_H */
@@ -11,6 +11,12 @@ typedef struct framebuffer framebuffer;
 typedef struct context context;
 typedef struct shader_program shader_program;
 typedef struct rs_vertex rs_vertex;
+typedef struct rs_vertex_batch rs_vertex_batch;
+typedef struct rs_fragment_batch rs_fragment_batch;
+typedef struct rs_instance rs_instance;
+typedef struct rs_light rs_light;
+typedef struct rs_material rs_material;
+typedef struct shadervm shadervm;
 typedef struct vec4 vec4 __attribute__ ((aligned (16)));
 typedef union color4 color4 __attribute__ ((aligned (4)));
 
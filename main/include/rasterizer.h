@@ -52,10 +52,19 @@ extern "C" {
  * This function rasterizes to a frame buffer. No transformations are applied
  * to the triangle. Perspective division is performed by the function and
  * the w coordinate is used for perspective correct interpolation of vertex
- * attributes. Shading, depth test, texturing and blending are performed by
- * the function, depending on the context state. The function draws to the
+ * attributes. Triangles crossing the w = 0 plane, the near or far plane
+ * (if the DEPTH_CLIP flag is set) or reaching far outside the viewport
+ * (see GUARD_BAND) are clipped in clip space and drawn as a triangle fan.
+ * Shading, depth test, texturing and blending are performed by the
+ * function, depending on the context state. The function draws to the
  * currenlty bound target frame buffer of the context.
  *
+ * The depth test function is derived from the flags by the function
+ * itself. The fragment shader may use other derived state of the context,
+ * e.g. the lights, so call context_validate after changing the matrices,
+ * lights or material before calling this outside of a draw call of the
+ * input assembler.
+ *
  * \param ctx A pointer to a context object
  * \param v0  The first vertex of the triangle
  * \param v1  The second vertex of the triangle
@@ -64,6 +73,27 @@ extern "C" {
 void rasterizer_process_triangle(context *ctx, const rs_vertex *v0,
 				const rs_vertex *v1, const rs_vertex *v2);
 
+/**
+ * \brief Check whether a triangle would produce any fragments
+ *
+ * Performs the same rejection tests as rasterizer_process_triangle, i.e.
+ * triangles outside the clip volume or the drawing area and face culling,
+ * but only on the clip space positions of the vertices. This allows
+ * discarding a triangle before its vertex attributes are computed.
+ * Triangles that need to be clipped are only rejected if they are
+ * completely outside of one clip plane.
+ *
+ * \param ctx A pointer to a context object
+ * \param p0  The clip space position of the first vertex
+ * \param p1  The clip space position of the second vertex
+ * \param p2  The clip space position of the third vertex
+ *
+ * \return Zero if rasterizer_process_triangle would discard the triangle,
+ *         non-zero otherwise
+ */
+int rasterizer_triangle_visible(const context *ctx, vec4 p0, vec4 p1,
+				vec4 p2);
+
 #ifdef __cplusplus
 }
 #endif
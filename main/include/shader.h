@@ -7,6 +7,8 @@
 #define SHADER_H
 
 #include "predef.h"
+#include "config.h"
+#include "rasterizer.h"
 
 /**
  * \enum SHADER_PROGRAM
@@ -21,13 +23,72 @@ typedef enum {
 	SHADER_UNLIT = 0,
 
 	/** \brief Compute colors based on blinn-phong lighting model */
-	SHADER_PHONG = 1
+	SHADER_PHONG = 1,
+
+	/**
+	 * \brief Evaluate the same lighting model as SHADER_PHONG per
+	 *        vertex and only interpolate the resulting color
+	 *
+	 * The fragment stage costs the same as SHADER_UNLIT, which makes
+	 * this a good choice for densely tesselated meshes.
+	 */
+	SHADER_GOURAUD = 2
 } SHADER_PROGRAM;
 
+/**
+ * \struct rs_vertex_batch
+ *
+ * \brief A batch of vertices in structure-of-arrays layout
+ *
+ * Component c of attribute slot a of vertex i is stored in
+ * attribs[a][c][i]. The arrays are 16 byte aligned and can always be
+ * processed in groups of 4, lanes past count hold unspecified values.
+ */
+struct rs_vertex_batch {
+	/** \brief Attribute components, see \ref ATTRIB_SLOT */
+	float attribs[ATTRIB_COUNT][4][SHADER_BATCH_SIZE]
+		__attribute__ ((aligned (16)));
+
+	/** \brief \ref ATTRIB_FLAGS of each vertex */
+	int used[SHADER_BATCH_SIZE];
+
+	/** \brief Number of vertices in the batch */
+	unsigned int count;
+};
+
+/**
+ * \struct rs_fragment_batch
+ *
+ * \brief A span of fragments in structure-of-arrays layout
+ *
+ * Holds the interpolated, perspective corrected attributes of up to
+ * SHADER_SPAN_SIZE fragments of a triangle that passed the depth test.
+ * Component c of attribute slot a of fragment i is stored in
+ * attribs[a][c][i]. The arrays are 16 byte aligned and can always be
+ * processed in groups of 4, lanes past count hold unspecified values.
+ */
+struct rs_fragment_batch {
+	/** \brief Attribute components, see \ref ATTRIB_SLOT */
+	float attribs[ATTRIB_COUNT][4][SHADER_SPAN_SIZE]
+		__attribute__ ((aligned (16)));
+
+	/** \brief \ref ATTRIB_FLAGS, the same for all fragments */
+	int used;
+
+	/** \brief Number of fragments in the batch */
+	unsigned int count;
+};
+
 /**
  * \interface shader_program
  *
  * \brief Abstracts entry points of a shader program
+ *
+ * The entry points may use the derived state of the context (see
+ * context_validate) instead of the matrices, lights and material it is
+ * computed from. The input assembler validates the context at the start
+ * of every draw call, code calling the entry points directly has to call
+ * context_validate after changing that state.
  */
 struct shader_program {
 	/**
@@ -51,6 +112,62 @@ struct shader_program {
 	 */
 	vec4(* fragment )(const shader_program *prog,
 			const context *ctx, const rs_vertex *frag);
+
+	/**
+	 * \brief Optional: run the vertex shader on a batch of vertices
+	 *
+	 * If set, this must produce the same results as calling the vertex
+	 * function on every vertex in the batch. Both have to apply the
+	 * same matrices in the same order, e.g. the combined
+	 * projection * model-view matrix of the derived context state, so
+	 * that results at most differ by the rounding of the vectorized
+	 * arithmetic and shared edges of both paths rasterize alike.
+	 *
+	 * \param prog  A pointer to the program itself
+	 * \param ctx   A pointer to a context
+	 * \param batch A pointer to the vertices to process
+	 */
+	void(* vertex_batch )(const shader_program *prog,
+			const context *ctx, rs_vertex_batch *batch);
+
+	/**
+	 * \brief Optional: compute only the clip space position of a vertex
+	 *
+	 * If set, the input assembler uses it to discard triangles that are
+	 * culled or outside the drawing area before running the vertex
+	 * shader on their vertices. It must compute exactly the position
+	 * that the vertex function computes. Programs whose vertex shader
+	 * does little more than transforming the position gain nothing from
+	 * providing it.
+	 *
+	 * \param prog A pointer to the program itself
+	 * \param ctx  A pointer to a context
+	 * \param vert A pointer to an untransformed vertex
+	 *
+	 * \return The clip space position of the vertex
+	 */
+	vec4(* position )(const shader_program *prog,
+			const context *ctx, const rs_vertex *vert);
+
+	/**
+	 * \brief Optional: run the fragment shader on a span of fragments
+	 *
+	 * If set, the rasterizer calls this instead of the fragment
+	 * function, once for up to SHADER_SPAN_SIZE fragments. Fragment i
+	 * must get the color that the fragment function computes for it.
+	 *
+	 * \param prog  A pointer to the program itself
+	 * \param ctx   A pointer to a context
+	 * \param frags A pointer to the interpolated attributes
+	 * \param out   Receives a color for each of the fragments, may be
+	 *              written up to the next multiple of 4
+	 *
+	 * \return A mask with bit i set if fragment i is discarded, i.e.
+	 *         neither its color nor its depth are written
+	 */
+	unsigned int(* fragment_span )(const shader_program *prog,
+				const context *ctx,
+				const rs_fragment_batch *frags, color4 *out);
 };
 
 #ifdef __cplusplus
@@ -72,7 +189,9 @@ const shader_program *shader_internal(unsigned int id);
  * Computes the color resulting from the blinn-phong ilumination model for a
  * light index in the context.
  *
- * \param ctx The context to take the light and material parameters from
+ * \param ctx The context to take the light and material parameters from,
+ *            the light colors are taken from its derived state, see
+ *            context_validate
  * \param i   The light index, i.e. which light from the context to use
  * \param V   A vector pointing from the surface towards the viewer
  * \param N   The normal vector at the specified surface location
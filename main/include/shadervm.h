@@ -0,0 +1,148 @@
+/**
+ * \file shadervm.h
+ *
+ * \brief Contains a small interpreted shader language
+ *
+ * A shadervm holds a fragment program that is loaded from a text at run
+ * time and can be used like any other shader_program. The program is
+ * executed on four fragments at a time, with every register holding a
+ * four component vector per fragment.
+ *
+ * Every line of the text holds one instruction, everything after a '#'
+ * is a comment. Registers are named r0 to r(SHADERVM_REGISTERS - 1) and
+ * must be written before they are read. The instructions are:
+ *
+ * - load rD, SLOT: read an interpolated vertex attribute, SLOT is one of
+ *   pos, color, normal, tex0, tex1, usr0 or usr1
+ * - uniform rD, uN: read a uniform, see shadervm_set_uniform
+ * - sample rD, rT, N: sample texture layer N at the coordinates in rT,
+ *   white if the layer is disabled
+ * - mul rD, rA, rB: rD = rA * rB
+ * - add rD, rA, rB: rD = rA + rB
+ * - mad rD, rA, rB, rC: rD = rA * rB + rC
+ * - max rD, rA, rB: the larger of rA and rB
+ * - dot rD, rA, rB: the dot product of the x, y and z components,
+ *   written to all components of rD
+ * - rsqrt rD, rA: rD = 1 / sqrt(rA)
+ * - lerp rD, rA, rB, rC: rD = rA + (rB - rA) * rC
+ * - out rA: the color of the fragment, the last one is used
+ *
+ * All operations work per component. The vertex stage transforms the
+ * position with the projection and model-view matrix and the normal
+ * with the normal matrix, all other attributes are passed through.
+ */
+#ifndef SHADERVM_H
+#define SHADERVM_H
+
+#include "predef.h"
+#include "config.h"
+#include "shader.h"
+#include "vector.h"
+
+/**
+ * \struct shadervm
+ *
+ * \brief A fragment program of the shader language and its compiled form
+ */
+struct shadervm {
+	/**
+	 * \brief The entry points, a pointer to this can be used as the
+	 *        shader of a context
+	 */
+	shader_program program;
+
+	/** \brief The instructions as loaded */
+	struct {
+		int op;
+		int dst;
+		int src[3];
+	} code[SHADERVM_MAX_CODE];
+
+	/** \brief The number of loaded instructions */
+	unsigned int count;
+
+	/** \brief Uniform values, see shadervm_set_uniform */
+	vec4 uniform[SHADERVM_UNIFORMS];
+
+	/**
+	 * \brief The instructions that are executed per fragment, computed
+	 *        by shadervm_bind
+	 */
+	struct {
+		int op;
+		int dst;
+		int src[3];
+	} kernel[SHADERVM_MAX_CODE * 2];
+
+	/** \brief The number of instructions in the kernel */
+	unsigned int kernel_count;
+
+	/** \brief Values of the instructions folded by shadervm_bind */
+	vec4 constant[SHADERVM_MAX_CODE];
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Initialize a shadervm with an empty program
+ *
+ * \memberof shadervm
+ *
+ * An empty program outputs white and all uniforms are zero.
+ *
+ * \param vm A pointer to a shadervm
+ */
+void shadervm_init(shadervm *vm);
+
+/**
+ * \brief Load a program from a text
+ *
+ * \memberof shadervm
+ *
+ * The program replaces the previous one and is compiled with the
+ * current uniform values, i.e. shadervm_bind is not needed unless the
+ * uniforms change.
+ *
+ * \param vm     A pointer to a shadervm
+ * \param source A null-terminated string in the syntax described above
+ *
+ * \return Non-zero on success, zero if the text is not a valid program,
+ *         the program of the shadervm is left unchanged in that case
+ */
+int shadervm_load(shadervm *vm, const char *source);
+
+/**
+ * \brief Set the value of a uniform
+ *
+ * \memberof shadervm
+ *
+ * The value is used after the next call to shadervm_bind.
+ *
+ * \param vm    A pointer to a shadervm
+ * \param index The index of the uniform, less than SHADERVM_UNIFORMS
+ * \param value The new value
+ */
+void shadervm_set_uniform(shadervm *vm, unsigned int index, vec4 value);
+
+/**
+ * \brief Compile the program for the current uniforms and make it the
+ *        shader of a context
+ *
+ * \memberof shadervm
+ *
+ * All instructions that only depend on uniforms are evaluated once
+ * here, so that only the ones depending on the attributes of a fragment
+ * are executed per fragment.
+ *
+ * \param vm  A pointer to a shadervm
+ * \param ctx A pointer to a context, or NULL to only compile
+ */
+void shadervm_bind(shadervm *vm, context *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHADERVM_H */
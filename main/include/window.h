@@ -7,24 +7,63 @@
 
 typedef struct window window;
 
+/* Frame time statistics over the most recent frames, in seconds */
+typedef struct {
+	double min;
+	double avg;
+	double p99;
+	unsigned int frames;    /* number of frames the values are based on */
+} frame_stats;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 window *window_create(size_t width, size_t height);
 
+/*
+	Create a window with a swap chain of the given number of frame buffers.
+	With more than one buffer, presenting is done by a background thread,
+	so the next frame can be rendered while the previous one is copied out.
+ */
+window *window_create_swap_chain(size_t width, size_t height,
+				unsigned int buffers);
+
 void window_destroy(window *wnd);
 
 /* Return non-zero if the window is still active, zero if it got closed */
 int window_handle_events(window *wnd);
 
+/*
+	Get a frame buffer to render the next frame to. Blocks if all buffers
+	of the swap chain are still queued for presentation. Returns the same
+	buffer again if the last acquired one has not been presented yet.
+	The buffer holds the previously presented frame, so only the regions
+	that change have to be redrawn.
+ */
+framebuffer *window_acquire_framebuffer(window *wnd);
+
+/* Queue an acquired frame buffer for presentation and return immediately */
+void window_present_framebuffer(window *wnd, framebuffer *fb);
+
+/* Present the current frame buffer and wait until it is displayed */
 void window_display_framebuffer(window *wnd);
 
+/* Get the most recently acquired frame buffer */
 framebuffer *window_get_framebuffer(window *wnd);
 
+/*
+	Set the target frame rate (default 60). Presenting sleeps until the
+	next frame is due, measured from the previous present, using absolute
+	deadlines. Zero disables the limit.
+ */
+void window_set_frame_rate(window *wnd, unsigned int fps);
+
+/* Get the time between presents measured over the most recent frames */
+void window_get_frame_stats(window *wnd, frame_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
 
 #endif /* WINDOW_H */
-
@@ -0,0 +1,463 @@
+#include "inputassembler.h"
+#include "cmdlist.h"
+#include "context.h"
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* records start at multiples of this, large enough for vec4 members */
+#define CMD_ALIGN 16
+#define CMD_SIZE(x) ((sizeof(x) + CMD_ALIGN - 1) & ~(CMD_ALIGN - 1))
+
+#define NO_CMD ((size_t)-1)
+
+typedef enum {
+	CMD_MODELVIEW = 0,
+	CMD_PROJECTION = 1,
+	CMD_FLAGS = 2,
+	CMD_DEPTH_TEST = 3,
+	CMD_SHADER = 4,
+	CMD_MATERIAL = 5,
+	CMD_VERTEX_BUFFER = 6,
+	CMD_INDEX_BUFFER = 7,
+	CMD_TOPOLOGY = 8,
+	CMD_DRAW = 9,
+	CMD_DRAW_INDEXED = 10,
+	CMD_BOUNDS = 11,
+
+	/* must be last, uses one state slot per texture layer */
+	CMD_TEXTURE = 12
+} CMD_TYPE;
+
+#define STATE_SLOTS (CMD_TEXTURE + MAX_TEXTURES)
+
+typedef struct {
+	int type;                       /* CMD_TYPE */
+	unsigned int size;              /* record size including header */
+} cmd_header;
+
+typedef struct {
+	cmd_header hdr;
+	float m[16];
+	float normal[16];               /* only used for CMD_MODELVIEW */
+} cmd_matrix;
+
+typedef struct {
+	cmd_header hdr;
+	int value;
+} cmd_value;
+
+typedef struct {
+	cmd_header hdr;
+	const void *ptr;
+	int value;
+} cmd_pointer;
+
+typedef struct {
+	cmd_header hdr;
+	void *ptr;
+	int format;                     /* VERTEX_FORMAT or INDEX_TYPE */
+	unsigned int stride;            /* size of a vertex or index */
+} cmd_buffer;
+
+typedef struct {
+	cmd_header hdr;
+	vec4 ambient;
+	vec4 diffuse;
+	vec4 specular;
+	vec4 emission;
+	int shininess;
+} cmd_material;
+
+typedef struct {
+	cmd_header hdr;
+	vec4 min;
+	vec4 max;
+} cmd_bounds;
+
+typedef struct {
+	cmd_header hdr;
+	unsigned int vertexcount;
+	unsigned int first;
+	unsigned int count;
+} cmd_draw;
+
+struct cmdlist {
+	unsigned char *data;
+	size_t size;                    /* bytes recorded */
+	size_t capacity;                /* bytes allocated */
+
+	size_t state[STATE_SLOTS];      /* last record of each state */
+	size_t last;                    /* the last record */
+
+	int topology;                   /* recorded topology, -1 if unknown */
+};
+
+static unsigned int index_size(int type)
+{
+	switch (type) {
+	case INDEX_U8:
+		return 1;
+	case INDEX_U32:
+		return 4;
+	}
+
+	return 2;
+}
+
+/* append a record, unless it sets the value last recorded for its state */
+static int record(cmdlist *cl, int slot, const void *cmd, size_t size)
+{
+	size_t capacity, aligned = (size + CMD_ALIGN - 1) & ~(CMD_ALIGN - 1);
+	void *new;
+
+	if (slot >= 0 && cl->state[slot] != NO_CMD &&
+		!memcmp(cl->data + cl->state[slot], cmd, size)) {
+		return 1;
+	}
+
+	if ((cl->size + aligned) > cl->capacity) {
+		capacity = cl->capacity ? cl->capacity * 2 : 4096;
+
+		while (capacity < (cl->size + aligned))
+			capacity *= 2;
+
+		new = realloc(cl->data, capacity);
+		if (!new)
+			return 0;
+
+		cl->data = new;
+		cl->capacity = capacity;
+	}
+
+	memcpy(cl->data + cl->size, cmd, size);
+
+	if (slot >= 0)
+		cl->state[slot] = cl->size;
+
+	cl->last = cl->size;
+	cl->size += aligned;
+	return 1;
+}
+
+/* try to extend the last recorded draw call by an adjacent range */
+static int merge_draw(cmdlist *cl, int type, unsigned int vertexcount,
+			unsigned int first, unsigned int count)
+{
+	cmd_draw *prev;
+
+	if (cl->last == NO_CMD || cl->topology != PRIM_TRIANGLES)
+		return 0;
+
+	prev = (cmd_draw *)(cl->data + cl->last);
+
+	if (prev->hdr.type != type || prev->vertexcount != vertexcount)
+		return 0;
+
+	if ((prev->count % 3) || (prev->first + prev->count) != first)
+		return 0;
+
+	prev->count += count;
+	return 1;
+}
+
+static int record_value(cmdlist *cl, int type, int value)
+{
+	cmd_value cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.hdr.type = type;
+	cmd.hdr.size = CMD_SIZE(cmd);
+	cmd.value = value;
+
+	return record(cl, type, &cmd, sizeof(cmd));
+}
+
+static int record_draw(cmdlist *cl, int type, unsigned int vertexcount,
+			unsigned int first, unsigned int count)
+{
+	cmd_draw cmd;
+
+	if (merge_draw(cl, type, vertexcount, first, count))
+		return 1;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.hdr.type = type;
+	cmd.hdr.size = CMD_SIZE(cmd);
+	cmd.vertexcount = vertexcount;
+	cmd.first = first;
+	cmd.count = count;
+
+	return record(cl, -1, &cmd, sizeof(cmd));
+}
+
+/****************************************************************************/
+
+cmdlist *cmdlist_create(void)
+{
+	cmdlist *cl = calloc(1, sizeof(*cl));
+
+	if (cl)
+		cmdlist_reset(cl);
+
+	return cl;
+}
+
+void cmdlist_destroy(cmdlist *cl)
+{
+	free(cl->data);
+	free(cl);
+}
+
+void cmdlist_reset(cmdlist *cl)
+{
+	int i;
+
+	for (i = 0; i < STATE_SLOTS; ++i)
+		cl->state[i] = NO_CMD;
+
+	cl->last = NO_CMD;
+	cl->size = 0;
+	cl->topology = -1;
+}
+
+int cmdlist_set_modelview_matrix(cmdlist *cl, const float *f)
+{
+	rs_instance inst;
+	cmd_matrix cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.hdr.type = CMD_MODELVIEW;
+	cmd.hdr.size = CMD_SIZE(cmd);
+	memcpy(cmd.m, f, sizeof(cmd.m));
+
+	/* compute the normal matrix once, instead of on every replay */
+	memcpy(inst.modelview, f, sizeof(inst.modelview));
+	context_compute_normal_matrices(cmd.normal, &inst, 1);
+
+	return record(cl, CMD_MODELVIEW, &cmd, sizeof(cmd));
+}
+
+int cmdlist_set_projection_matrix(cmdlist *cl, const float *f)
+{
+	cmd_matrix cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.hdr.type = CMD_PROJECTION;
+	cmd.hdr.size = CMD_SIZE(cmd);
+	memcpy(cmd.m, f, sizeof(cmd.m));
+
+	return record(cl, CMD_PROJECTION, &cmd, sizeof(cmd));
+}
+
+int cmdlist_set_flags(cmdlist *cl, int flags)
+{
+	return record_value(cl, CMD_FLAGS, flags);
+}
+
+int cmdlist_set_depth_test(cmdlist *cl, int func)
+{
+	return record_value(cl, CMD_DEPTH_TEST, func);
+}
+
+int cmdlist_set_topology(cmdlist *cl, int topology)
+{
+	if (!record_value(cl, CMD_TOPOLOGY, topology))
+		return 0;
+
+	cl->topology = topology;
+	return 1;
+}
+
+int cmdlist_set_shader(cmdlist *cl, const shader_program *shader)
+{
+	cmd_pointer cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.hdr.type = CMD_SHADER;
+	cmd.hdr.size = CMD_SIZE(cmd);
+	cmd.ptr = shader;
+
+	return record(cl, CMD_SHADER, &cmd, sizeof(cmd));
+}
+
+int cmdlist_set_texture(cmdlist *cl, int layer, texture *tex)
+{
+	cmd_pointer cmd;
+
+	if (layer < 0 || layer >= MAX_TEXTURES)
+		return 0;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.hdr.type = CMD_TEXTURE;
+	cmd.hdr.size = CMD_SIZE(cmd);
+	cmd.ptr = tex;
+	cmd.value = layer;
+
+	return record(cl, CMD_TEXTURE + layer, &cmd, sizeof(cmd));
+}
+
+int cmdlist_set_material(cmdlist *cl, vec4 ambient, vec4 diffuse,
+			vec4 specular, vec4 emission, int shininess)
+{
+	cmd_material cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.hdr.type = CMD_MATERIAL;
+	cmd.hdr.size = CMD_SIZE(cmd);
+	cmd.ambient = ambient;
+	cmd.diffuse = diffuse;
+	cmd.specular = specular;
+	cmd.emission = emission;
+	cmd.shininess = shininess;
+
+	return record(cl, CMD_MATERIAL, &cmd, sizeof(cmd));
+}
+
+int cmdlist_set_vertex_buffer(cmdlist *cl, void *buffer, int format)
+{
+	cmd_buffer cmd;
+
+	if (format & VF_LAYOUT)
+		return 0;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.hdr.type = CMD_VERTEX_BUFFER;
+	cmd.hdr.size = CMD_SIZE(cmd);
+	cmd.ptr = buffer;
+	cmd.format = format;
+	cmd.stride = ia_vertex_size(format);
+
+	return record(cl, CMD_VERTEX_BUFFER, &cmd, sizeof(cmd));
+}
+
+int cmdlist_set_index_buffer(cmdlist *cl, void *buffer, int type)
+{
+	cmd_buffer cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.hdr.type = CMD_INDEX_BUFFER;
+	cmd.hdr.size = CMD_SIZE(cmd);
+	cmd.ptr = buffer;
+	cmd.format = type;
+	cmd.stride = index_size(type);
+
+	return record(cl, CMD_INDEX_BUFFER, &cmd, sizeof(cmd));
+}
+
+int cmdlist_set_bounds(cmdlist *cl, vec4 min, vec4 max)
+{
+	cmd_bounds cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.hdr.type = CMD_BOUNDS;
+	cmd.hdr.size = CMD_SIZE(cmd);
+	cmd.min = min;
+	cmd.max = max;
+
+	return record(cl, CMD_BOUNDS, &cmd, sizeof(cmd));
+}
+
+int cmdlist_draw(cmdlist *cl, unsigned int first, unsigned int count)
+{
+	return record_draw(cl, CMD_DRAW, 0, first, count);
+}
+
+int cmdlist_draw_indexed(cmdlist *cl, unsigned int vertexcount,
+			unsigned int first, unsigned int count)
+{
+	return record_draw(cl, CMD_DRAW_INDEXED, vertexcount, first, count);
+}
+
+void cmdlist_replay(const cmdlist *cl, context *ctx)
+{
+	const unsigned char *ptr = cl->data, *end = cl->data + cl->size;
+	unsigned int vstride, istride;
+	unsigned char *vb, *ib;
+	const cmd_header *hdr;
+	const cmd_material *mat;
+	const cmd_bounds *bounds;
+	const cmd_pointer *p;
+	const cmd_buffer *b;
+	const cmd_matrix *m;
+	const cmd_draw *d;
+
+	vb = ctx->vertexbuffer;
+	ib = ctx->indexbuffer;
+	vstride = ia_vertex_size(ctx->vertex_format);
+	istride = index_size(ctx->index_type);
+
+	for (; ptr < end; ptr += hdr->size) {
+		hdr = (const cmd_header *)ptr;
+
+		switch (hdr->type) {
+		case CMD_MODELVIEW:
+			m = (const cmd_matrix *)hdr;
+			memcpy(ctx->modelview, m->m, sizeof(m->m));
+			memcpy(ctx->normalmatrix, m->normal, sizeof(m->normal));
+			ctx->dirty |= DIRTY_TRANSFORM;
+			break;
+		case CMD_PROJECTION:
+			m = (const cmd_matrix *)hdr;
+			memcpy(ctx->projection, m->m, sizeof(m->m));
+			ctx->dirty |= DIRTY_TRANSFORM;
+			break;
+		case CMD_FLAGS:
+			ctx->flags = ((const cmd_value *)hdr)->value;
+			break;
+		case CMD_DEPTH_TEST:
+			ctx->depth_test = ((const cmd_value *)hdr)->value;
+			break;
+		case CMD_TOPOLOGY:
+			ctx->topology = ((const cmd_value *)hdr)->value;
+			break;
+		case CMD_SHADER:
+			ctx->shader = ((const cmd_pointer *)hdr)->ptr;
+			break;
+		case CMD_TEXTURE:
+			p = (const cmd_pointer *)hdr;
+			ctx->textures[p->value] = (texture *)p->ptr;
+			ctx->texture_enable[p->value] = p->ptr != NULL;
+			break;
+		case CMD_MATERIAL:
+			mat = (const cmd_material *)hdr;
+			ctx->material.ambient = mat->ambient;
+			ctx->material.diffuse = mat->diffuse;
+			ctx->material.specular = mat->specular;
+			ctx->material.emission = mat->emission;
+			ctx->material.shininess = mat->shininess;
+			break;
+		case CMD_VERTEX_BUFFER:
+			b = (const cmd_buffer *)hdr;
+			ctx->vertexbuffer = vb = b->ptr;
+			ctx->vertex_format = b->format;
+			vstride = b->stride;
+			break;
+		case CMD_INDEX_BUFFER:
+			b = (const cmd_buffer *)hdr;
+			ctx->indexbuffer = ib = b->ptr;
+			ctx->index_type = b->format;
+			istride = b->stride;
+			break;
+		case CMD_BOUNDS:
+			bounds = (const cmd_bounds *)hdr;
+			ctx->bounds.min = bounds->min;
+			ctx->bounds.max = bounds->max;
+			break;
+		case CMD_DRAW:
+			d = (const cmd_draw *)hdr;
+			ctx->vertexbuffer = vb + d->first * vstride;
+			ia_draw_triangles(ctx, d->count);
+			ctx->vertexbuffer = vb;
+			break;
+		case CMD_DRAW_INDEXED:
+			d = (const cmd_draw *)hdr;
+			ctx->indexbuffer = ib + d->first * istride;
+			ia_draw_triangles_indexed(ctx, d->vertexcount,
+						d->count);
+			ctx->indexbuffer = ib;
+			break;
+		}
+	}
+}
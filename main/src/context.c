@@ -1,17 +1,15 @@
 #include "framebuffer.h"
 #include "context.h"
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <float.h>
 
-static void recompute_normal_matrix(context *ctx)
+static void compute_normal_matrix(float *normal, const float *mv)
 {
-	float det, m[16], f[18], *mv, *normal;
+	float det, m[16], f[18];
 	int i, j;
 
-	mv = ctx->modelview;
-	normal = ctx->normalmatrix;
-
 	/* m = inverse( mv ) */
 	f[ 0] = mv[10] * mv[15] - mv[11] * mv[14];
 	f[ 1] = mv[ 7] * mv[14] - mv[ 6] * mv[15];
@@ -69,6 +67,53 @@ static void recompute_normal_matrix(context *ctx)
 	}
 }
 
+static void recompute_normal_matrix(context *ctx)
+{
+	compute_normal_matrix(ctx->normalmatrix, ctx->modelview);
+}
+
+/* out = a * b, column-major 4x4 matrices */
+static void mat4_mul(float *out, const float *a, const float *b)
+{
+	int r, c;
+
+	for (c = 0; c < 4; ++c) {
+		for (r = 0; r < 4; ++r) {
+			out[c*4 + r] = a[r] * b[c*4] + a[4 + r] * b[c*4 + 1] +
+					a[8 + r] * b[c*4 + 2] +
+					a[12 + r] * b[c*4 + 3];
+		}
+	}
+}
+
+static void validate_lighting(context *ctx)
+{
+	vec4 ambient = vec4_set(0.0f, 0.0f, 0.0f, 0.0f);
+	int i, n = 0;
+
+	for (i = 0; i < MAX_LIGHTS; ++i) {
+		ctx->derived.light[i].diffuse = vec4_mul(ctx->light[i].diffuse,
+							ctx->material.diffuse);
+		ctx->derived.light[i].specular =
+			vec4_mul(ctx->light[i].specular,
+				ctx->material.specular);
+
+		if (!ctx->light[i].enable)
+			continue;
+
+		ambient = vec4_add(ambient, vec4_mul(ctx->light[i].ambient,
+						ctx->material.ambient));
+		ctx->derived.lights[n++] = i;
+	}
+
+	ctx->derived.light_count = n;
+	ctx->derived.ambient = vec4_add(ambient, ctx->material.emission);
+
+	memcpy(ctx->derived.src_light, ctx->light, sizeof(ctx->light));
+	memcpy(&ctx->derived.src_material, &ctx->material,
+		sizeof(ctx->material));
+}
+
 void context_init(context *ctx)
 {
 	int i;
@@ -100,17 +145,97 @@ void context_init(context *ctx)
 	ctx->depth_test = COMPARE_ALWAYS;
 	ctx->depth_far = 1.0f;
 	ctx->flags = DEPTH_CLIP|DEPTH_WRITE|FRONT_CCW;
+	ctx->index_type = INDEX_U16;
+	ctx->topology = PRIM_TRIANGLES;
+	ctx->restart_index = 0xFFFF;
+	ctx->indexed_strategy = INDEXED_DRAW_AUTO;
+
+	context_set_vertex_cache(ctx, 32, 32);
+	context_invalidate(ctx, DIRTY_ALL);
+	context_validate(ctx);
+}
+
+void context_cleanup(context *ctx)
+{
+	free(ctx->scratch.vertices);
+	free(ctx->scratch.remap);
+	free(ctx->scratch.triangles);
+	free(ctx->scratch.normals);
+	free(ctx->scratch.positions);
+	free(ctx->immediate.vertices);
+	free(ctx->immediate.indices);
+	free(ctx->immediate.hash);
+	free(ctx->vertex_cache.pool);
+
+	ctx->scratch.vertices = NULL;
+	ctx->scratch.remap = NULL;
+	ctx->scratch.triangles = NULL;
+	ctx->scratch.normals = NULL;
+	ctx->scratch.positions = NULL;
+	ctx->immediate.vertices = NULL;
+	ctx->immediate.indices = NULL;
+	ctx->immediate.hash = NULL;
+	ctx->vertex_cache.pool = NULL;
+	ctx->scratch.vertex_count = 0;
+	ctx->scratch.remap_count = 0;
+	ctx->scratch.triangle_count = 0;
+	ctx->scratch.normal_count = 0;
+	ctx->scratch.position_count = 0;
+	ctx->immediate.vertex_count = 0;
+	ctx->immediate.index_count = 0;
+	ctx->immediate.vertex_max = 0;
+	ctx->immediate.index_max = 0;
+	ctx->immediate.hash_max = 0;
+	ctx->vertex_cache.pool_max = 0;
+	ctx->vertex_cache.mask = 0;
+	ctx->immediate.active = 0;
 }
 
 void context_set_modelview_matrix(context *ctx, float *f)
 {
 	memcpy(ctx->modelview, f, sizeof(float) * 16);
 	recompute_normal_matrix(ctx);
+	ctx->dirty |= DIRTY_TRANSFORM;
 }
 
 void context_set_projection_matrix(context *ctx, float *f)
 {
 	memcpy(ctx->projection, f, sizeof(float) * 16);
+	ctx->dirty |= DIRTY_TRANSFORM;
+}
+
+void context_invalidate(context *ctx, int dirty)
+{
+	ctx->dirty |= dirty;
+}
+
+void context_validate(context *ctx)
+{
+	/* applications set the lights and the material directly */
+	if (memcmp(ctx->derived.src_light, ctx->light, sizeof(ctx->light)) ||
+		memcmp(&ctx->derived.src_material, &ctx->material,
+			sizeof(ctx->material))) {
+		ctx->dirty |= DIRTY_LIGHTING;
+	}
+
+	if (ctx->dirty & DIRTY_TRANSFORM)
+		mat4_mul(ctx->derived.mvp, ctx->projection, ctx->modelview);
+
+	if (ctx->dirty & DIRTY_LIGHTING)
+		validate_lighting(ctx);
+
+	ctx->dirty = 0;
+	ctx->derived.depth_func = depth_func(ctx);
+}
+
+void context_compute_normal_matrices(float *normal,
+				const rs_instance *instances,
+				unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i)
+		compute_normal_matrix(normal + i * 16, instances[i].modelview);
 }
 
 void context_set_viewport(context *ctx, int x, int y,
@@ -142,3 +267,20 @@ void context_set_viewport(context *ctx, int x, int y,
 	if (ctx->draw_area.miny >= (int)ctx->target->height)
 		ctx->draw_area.miny = ctx->target->height - 1;
 }
+
+int context_set_vertex_cache(context *ctx, unsigned int size,
+			unsigned int ways)
+{
+	if (size > MAX_VERTEX_CACHE)
+		return 0;
+
+	if (size && (!ways || ways > size || (size % ways)))
+		return 0;
+
+	ctx->vertex_cache.size = size;
+	ctx->vertex_cache.ways = size ? ways : 0;
+	ctx->vertex_cache.mask = 0;
+	ctx->vertex_cache.hits = 0;
+	ctx->vertex_cache.misses = 0;
+	return 1;
+}
@@ -2,6 +2,7 @@
 #include "color.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 int framebuffer_init(framebuffer *fb, unsigned int width, unsigned int height)
 {
@@ -19,11 +20,25 @@ int framebuffer_init(framebuffer *fb, unsigned int width, unsigned int height)
 		free(fb->color);
 		return 0;
 	}
+
+	fb->tiles_x = (width + FB_TILE_SIZE - 1) >> FB_TILE_SHIFT;
+	fb->tiles_y = (height + FB_TILE_SIZE - 1) >> FB_TILE_SHIFT;
+	fb->dirty = malloc(fb->tiles_x * fb->tiles_y);
+
+	if (!fb->dirty) {
+		free(fb->depth);
+		free(fb->color);
+		return 0;
+	}
+
+	/* the initial contents are undefined, i.e. modified */
+	memset(fb->dirty, 1, fb->tiles_x * fb->tiles_y);
 	return 1;
 }
 
 void framebuffer_cleanup(framebuffer *fb)
 {
+	free(fb->dirty);
 	free(fb->depth);
 	free(fb->color);
 }
@@ -35,6 +50,8 @@ void framebuffer_clear(framebuffer *fb, int r, int g, int b, int a)
 
 	for (i = 0; i < count; ++i)
 		*(ptr++) = val;
+
+	memset(fb->dirty, 1, fb->tiles_x * fb->tiles_y);
 }
 
 void framebuffer_clear_depth(framebuffer *fb, float value)
@@ -47,3 +64,131 @@ void framebuffer_clear_depth(framebuffer *fb, float value)
 	for (ptr = fb->depth, i = 0; i < count; ++i, ++ptr)
 		*ptr = value;
 }
+
+void framebuffer_mark_dirty(framebuffer *fb, int minx, int miny,
+			int maxx, int maxy)
+{
+	unsigned char *row;
+	int x, y;
+
+	minx = minx < 0 ? 0 : minx;
+	miny = miny < 0 ? 0 : miny;
+	maxx = maxx >= fb->width ? fb->width - 1 : maxx;
+	maxy = maxy >= fb->height ? fb->height - 1 : maxy;
+
+	if (maxx < minx || maxy < miny)
+		return;
+
+	minx >>= FB_TILE_SHIFT;
+	miny >>= FB_TILE_SHIFT;
+	maxx >>= FB_TILE_SHIFT;
+	maxy >>= FB_TILE_SHIFT;
+
+	for (y = miny; y <= maxy; ++y) {
+		row = fb->dirty + y * fb->tiles_x;
+
+		for (x = minx; x <= maxx; ++x)
+			row[x] = 1;
+	}
+}
+
+void framebuffer_reset_dirty(framebuffer *fb)
+{
+	memset(fb->dirty, 0, fb->tiles_x * fb->tiles_y);
+}
+
+unsigned int framebuffer_get_dirty_rects(const framebuffer *fb,
+					fb_rect *rects, unsigned int max)
+{
+	unsigned int i, count = 0, prev_start = 0, prev_end = 0;
+	int x, x0, y, minx, miny, maxx, maxy;
+	const unsigned char *row;
+	fb_rect r;
+
+	minx = fb->tiles_x;
+	miny = fb->tiles_y;
+	maxx = maxy = -1;
+
+	for (y = 0; y < fb->tiles_y; ++y) {
+		row = fb->dirty + y * fb->tiles_x;
+
+		for (x = 0; x < fb->tiles_x; ) {
+			if (!row[x]) {
+				++x;
+				continue;
+			}
+
+			/* find a horizontal run of dirty tiles */
+			for (x0 = x; x < fb->tiles_x && row[x]; ++x)
+				;
+
+			minx = x0 < minx ? x0 : minx;
+			miny = y < miny ? y : miny;
+			maxx = x > maxx ? x : maxx;
+			maxy = y;
+
+			r.x = x0 << FB_TILE_SHIFT;
+			r.y = y << FB_TILE_SHIFT;
+			r.width = (x - x0) << FB_TILE_SHIFT;
+			r.height = FB_TILE_SIZE;
+
+			/* extend a matching run from the previous row */
+			for (i = prev_start; i < prev_end; ++i) {
+				if (rects[i].x == r.x &&
+					rects[i].width == r.width &&
+					rects[i].y + rects[i].height == r.y) {
+					rects[i].height += FB_TILE_SIZE;
+					break;
+				}
+			}
+
+			if (i < prev_end)
+				continue;
+
+			if (count == max)
+				goto bounds;
+
+			rects[count++] = r;
+		}
+
+		/* rectangles that can still be extended into the next row */
+		for (i = prev_start; i < count; ++i) {
+			if (rects[i].y + rects[i].height >
+				(y << FB_TILE_SHIFT)) {
+				break;
+			}
+		}
+
+		prev_start = i;
+		prev_end = count;
+	}
+
+	goto clip;
+bounds:
+	/* too many rectangles, fall back to a single bounding rectangle */
+	for (; y < fb->tiles_y; ++y) {
+		row = fb->dirty + y * fb->tiles_x;
+
+		for (x = 0; x < fb->tiles_x; ++x) {
+			if (row[x]) {
+				minx = x < minx ? x : minx;
+				maxx = x + 1 > maxx ? x + 1 : maxx;
+				maxy = y;
+			}
+		}
+	}
+
+	rects[0].x = minx << FB_TILE_SHIFT;
+	rects[0].y = miny << FB_TILE_SHIFT;
+	rects[0].width = (maxx - minx) << FB_TILE_SHIFT;
+	rects[0].height = (maxy + 1 - miny) << FB_TILE_SHIFT;
+	count = 1;
+clip:
+	for (i = 0; i < count; ++i) {
+		if (rects[i].x + rects[i].width > fb->width)
+			rects[i].width = fb->width - rects[i].x;
+		if (rects[i].y + rects[i].height > fb->height)
+			rects[i].height = fb->height - rects[i].y;
+	}
+	return count;
+}
@@ -0,0 +1,546 @@
+#include "headless.h"
+#include "color.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+/* maximum number of modified regions copied per frame */
+#define MAX_FRAME_RECTS 64
+
+#define MAX_SIZE ((size_t)-1)
+
+struct headless {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;       /* signaled when a frame is queued */
+	pthread_cond_t not_full;        /* signaled when a slot is freed */
+	pthread_t thread;
+
+	unsigned char *slots;           /* ring of frame slots */
+	fb_rect *rects;                 /* modified regions stored per slot */
+	unsigned int *rect_count;       /* number of regions per slot */
+	unsigned char *frame;           /* the last complete frame */
+	unsigned char *encoded;         /* scratch buffer for encoded frames */
+	size_t slotsize;                /* size of a slot in bytes */
+	unsigned int frames;            /* number of slots in the ring */
+	unsigned int head;              /* next slot to fill */
+	unsigned int tail;              /* next slot to write */
+	unsigned int count;             /* number of queued slots */
+
+	int quit;
+	int error;
+
+	int fd;
+	int close_fd;
+	int format;
+	unsigned int fps;
+	size_t width;
+	size_t height;
+};
+
+/****************************************************************************/
+
+/* BT.601 studio swing coefficients, 8 bit fixed point */
+#define Y_R 66
+#define Y_G 129
+#define Y_B 25
+#define U_R -38
+#define U_G -74
+#define U_B 112
+#define V_R 112
+#define V_G -94
+#define V_B -18
+
+static unsigned char rgb_to_y(const unsigned char *p)
+{
+	return ((Y_R * p[RED] + Y_G * p[GREEN] + Y_B * p[BLUE] + 128) >> 8) +
+		16;
+}
+
+static unsigned char rgb_to_u(int r, int g, int b)
+{
+	return ((U_R * r + U_G * g + U_B * b + 128) >> 8) + 128;
+}
+
+static unsigned char rgb_to_v(int r, int g, int b)
+{
+	return ((V_R * r + V_G * g + V_B * b + 128) >> 8) + 128;
+}
+
+#ifdef __SSE2__
+static __m128i color_coef(int r, int g, int b)
+{
+	short c[8];
+
+	c[RED] = c[RED + 4] = r;
+	c[GREEN] = c[GREEN + 4] = g;
+	c[BLUE] = c[BLUE + 4] = b;
+	c[ALPHA] = c[ALPHA + 4] = 0;
+
+	return _mm_loadu_si128((const __m128i *)c);
+}
+
+/* weighted sum of the color components of 4 packed pixels */
+static __m128i dot_color4(__m128i px, __m128i coef)
+{
+	__m128i lo, hi, zero = _mm_setzero_si128();
+	__m128 even, odd;
+
+	lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), coef);
+	hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), coef);
+
+	even = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi),
+				_MM_SHUFFLE(2, 0, 2, 0));
+	odd = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi),
+				_MM_SHUFFLE(3, 1, 3, 1));
+
+	return _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+}
+
+static __m128i scale_offset(__m128i v, int offset)
+{
+	v = _mm_srai_epi32(_mm_add_epi32(v, _mm_set1_epi32(128)), 8);
+	return _mm_add_epi32(v, _mm_set1_epi32(offset));
+}
+#endif
+
+static void convert_luma_row(unsigned char *dst, const unsigned char *src,
+				size_t count)
+{
+#ifdef __SSE2__
+	__m128i coef = color_coef(Y_R, Y_G, Y_B), a, b;
+
+	for (; count >= 8; count -= 8, src += 32, dst += 8) {
+		a = dot_color4(_mm_loadu_si128((const __m128i *)src), coef);
+		b = dot_color4(_mm_loadu_si128((const __m128i *)(src + 16)),
+				coef);
+
+		a = _mm_packs_epi32(scale_offset(a, 16), scale_offset(b, 16));
+		_mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(a, a));
+	}
+#endif
+	for (; count > 0; --count, src += 4)
+		*(dst++) = rgb_to_y(src);
+}
+
+/* average a block of up to 2x2 pixels and write one chroma sample */
+static void convert_chroma_block(unsigned char *u, unsigned char *v,
+				const unsigned char *row0,
+				const unsigned char *row1, int pixels)
+{
+	int r, g, b, n = pixels * (row1 ? 2 : 1);
+
+	r = row0[RED]; g = row0[GREEN]; b = row0[BLUE];
+
+	if (pixels > 1) {
+		r += row0[4 + RED]; g += row0[4 + GREEN]; b += row0[4 + BLUE];
+	}
+	if (row1) {
+		r += row1[RED]; g += row1[GREEN]; b += row1[BLUE];
+
+		if (pixels > 1) {
+			r += row1[4 + RED];
+			g += row1[4 + GREEN];
+			b += row1[4 + BLUE];
+		}
+	}
+
+	r = (r + n / 2) / n;
+	g = (g + n / 2) / n;
+	b = (b + n / 2) / n;
+
+	*u = rgb_to_u(r, g, b);
+	*v = rgb_to_v(r, g, b);
+}
+
+/* convert two rows (row1 may be NULL) into one row of U and V samples */
+static void convert_chroma_row(unsigned char *u, unsigned char *v,
+				const unsigned char *row0,
+				const unsigned char *row1, size_t width)
+{
+#ifdef __SSE2__
+	__m128i ucoef = color_coef(U_R, U_G, U_B);
+	__m128i vcoef = color_coef(V_R, V_G, V_B);
+	__m128i a, b, c;
+	__m128 e, o;
+	int i;
+
+	if (row1) {
+		for (; width >= 8; width -= 8, row0 += 32, row1 += 32,
+				u += 4, v += 4) {
+			/* average vertically, then horizontal pairs */
+			a = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)row0),
+				_mm_loadu_si128((const __m128i *)row1));
+			b = _mm_avg_epu8(
+				_mm_loadu_si128((const __m128i *)(row0 + 16)),
+				_mm_loadu_si128((const __m128i *)(row1 + 16)));
+
+			e = _mm_shuffle_ps(_mm_castsi128_ps(a),
+					_mm_castsi128_ps(b),
+					_MM_SHUFFLE(2, 0, 2, 0));
+			o = _mm_shuffle_ps(_mm_castsi128_ps(a),
+					_mm_castsi128_ps(b),
+					_MM_SHUFFLE(3, 1, 3, 1));
+			c = _mm_avg_epu8(_mm_castps_si128(e),
+					_mm_castps_si128(o));
+
+			a = scale_offset(dot_color4(c, ucoef), 128);
+			b = scale_offset(dot_color4(c, vcoef), 128);
+
+			a = _mm_packs_epi32(a, b);
+			a = _mm_packus_epi16(a, a);
+
+			i = _mm_cvtsi128_si32(a);
+			memcpy(u, &i, 4);
+			i = _mm_cvtsi128_si32(_mm_srli_si128(a, 4));
+			memcpy(v, &i, 4);
+		}
+	}
+#endif
+	for (; width >= 2; width -= 2, row0 += 8, row1 = row1 ? row1 + 8 : NULL)
+		convert_chroma_block(u++, v++, row0, row1, 2);
+
+	if (width)
+		convert_chroma_block(u, v, row0, row1, 1);
+}
+
+/****************************************************************************/
+
+static size_t encode_ppm(headless *out, const unsigned char *src)
+{
+	unsigned char *dst = out->encoded;
+	size_t i, count = out->width * out->height;
+
+	dst += sprintf((char *)dst, "P6\n%lu %lu\n255\n",
+			(unsigned long)out->width,
+			(unsigned long)out->height);
+
+	for (i = 0; i < count; ++i, src += 4) {
+		*(dst++) = src[RED];
+		*(dst++) = src[GREEN];
+		*(dst++) = src[BLUE];
+	}
+
+	return dst - out->encoded;
+}
+
+static size_t encode_y4m(headless *out, const unsigned char *src)
+{
+	size_t y, pitch = out->width * 4, cw = (out->width + 1) / 2;
+	unsigned char *Y, *U, *V;
+
+	memcpy(out->encoded, "FRAME\n", 6);
+
+	Y = out->encoded + 6;
+	U = Y + out->width * out->height;
+	V = U + cw * ((out->height + 1) / 2);
+
+	for (y = 0; y < out->height; ++y, Y += out->width)
+		convert_luma_row(Y, src + y * pitch, out->width);
+
+	for (y = 0; y < out->height; y += 2, U += cw, V += cw) {
+		convert_chroma_row(U, V, src + y * pitch,
+				(y + 1) < out->height ?
+					src + (y + 1) * pitch : NULL,
+				out->width);
+	}
+
+	return V - out->encoded;
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+	const unsigned char *ptr = data;
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = write(fd, ptr, size);
+
+		/* EPIPE if the reading end was closed */
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+
+		ptr += ret;
+		size -= ret;
+	}
+	return 1;
+}
+
+/* patch the modified regions stored in a slot into the complete frame */
+static void apply_slot(headless *out, unsigned int i)
+{
+	const unsigned char *src = out->slots + i * out->slotsize;
+	const fb_rect *r = out->rects + i * MAX_FRAME_RECTS;
+	unsigned int j, count = out->rect_count[i];
+	size_t y, rowsize;
+	unsigned char *dst;
+
+	for (j = 0; j < count; ++j, ++r) {
+		dst = out->frame + (r->y * out->width + r->x) * 4;
+		rowsize = r->width * 4;
+
+		for (y = 0; y < (size_t)r->height; ++y) {
+			memcpy(dst, src, rowsize);
+			dst += out->width * 4;
+			src += rowsize;
+		}
+	}
+}
+
+static void *writer_thread(void *arg)
+{
+	headless *out = arg;
+	char header[128];
+	sigset_t set;
+	unsigned int i;
+	int ok = 1;
+
+	/* a closed pipe must fail the write instead of killing the process,
+	   SIGPIPE is delivered to the writing thread, so block it here */
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (out->format == HEADLESS_Y4M) {
+		sprintf(header, "YUV4MPEG2 W%lu H%lu F%u:1 Ip A1:1 C420jpeg\n",
+			(unsigned long)out->width,
+			(unsigned long)out->height, out->fps);
+
+		ok = write_all(out->fd, header, strlen(header));
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&out->lock);
+
+		/* on error, wake up a blocked producer and stop */
+		if (!ok) {
+			out->error = 1;
+			pthread_cond_broadcast(&out->not_full);
+			pthread_mutex_unlock(&out->lock);
+			break;
+		}
+
+		while (out->count == 0 && !out->quit)
+			pthread_cond_wait(&out->not_empty, &out->lock);
+
+		if (out->count == 0) {
+			pthread_mutex_unlock(&out->lock);
+			break;
+		}
+
+		i = out->tail;
+		pthread_mutex_unlock(&out->lock);
+
+		/* update the frame and release the slot */
+		apply_slot(out, i);
+
+		pthread_mutex_lock(&out->lock);
+		out->tail = (out->tail + 1) % out->frames;
+		out->count -= 1;
+		pthread_cond_signal(&out->not_full);
+		pthread_mutex_unlock(&out->lock);
+
+		/* encode and write the frame */
+		switch (out->format) {
+		case HEADLESS_PPM:
+			ok = write_all(out->fd, out->encoded,
+					encode_ppm(out, out->frame));
+			break;
+		case HEADLESS_Y4M:
+			ok = write_all(out->fd, out->encoded,
+					encode_y4m(out, out->frame));
+			break;
+		default:
+			ok = write_all(out->fd, out->frame, out->slotsize);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/****************************************************************************/
+
+headless *headless_create(const char *path, int format, size_t width,
+			size_t height, unsigned int fps, unsigned int frames)
+{
+	headless *out;
+	size_t size;
+
+	if (!path || !width || !height || !frames)
+		return NULL;
+
+	/* the ring holds width * height * 4 * frames bytes */
+	if (width > MAX_SIZE / 4 / height ||
+		frames > MAX_SIZE / (width * height * 4)) {
+		return NULL;
+	}
+
+	out = calloc(1, sizeof(*out));
+	if (!out)
+		return NULL;
+
+	out->format = format;
+	out->width = width;
+	out->height = height;
+	out->fps = fps ? fps : 60;
+	out->frames = frames;
+	out->slotsize = width * height * 4;
+
+	switch (format) {
+	case HEADLESS_PPM:
+		size = 64 + width * height * 3;
+		break;
+	case HEADLESS_Y4M:
+		size = 6 + width * height +
+			2 * ((width + 1) / 2) * ((height + 1) / 2);
+		break;
+	case HEADLESS_RAW_BGRA:
+		size = 0;
+		break;
+	default:
+		goto fail;
+	}
+
+	out->slots = malloc(out->slotsize * frames);
+	out->rects = malloc(sizeof(out->rects[0]) * MAX_FRAME_RECTS * frames);
+	out->rect_count = calloc(frames, sizeof(out->rect_count[0]));
+	out->frame = calloc(1, out->slotsize);
+
+	if (!out->slots || !out->rects || !out->rect_count || !out->frame)
+		goto fail_slots;
+
+	if (size) {
+		out->encoded = malloc(size);
+		if (!out->encoded)
+			goto fail_slots;
+	}
+
+	if (!strcmp(path, "-")) {
+		out->fd = STDOUT_FILENO;
+	} else {
+		out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out->fd < 0)
+			goto fail_encoded;
+		out->close_fd = 1;
+	}
+
+	if (pthread_mutex_init(&out->lock, NULL))
+		goto fail_fd;
+	if (pthread_cond_init(&out->not_empty, NULL))
+		goto fail_mutex;
+	if (pthread_cond_init(&out->not_full, NULL))
+		goto fail_empty;
+	if (pthread_create(&out->thread, NULL, writer_thread, out))
+		goto fail_full;
+
+	return out;
+fail_full:
+	pthread_cond_destroy(&out->not_full);
+fail_empty:
+	pthread_cond_destroy(&out->not_empty);
+fail_mutex:
+	pthread_mutex_destroy(&out->lock);
+fail_fd:
+	if (out->close_fd)
+		close(out->fd);
+fail_encoded:
+	free(out->encoded);
+fail_slots:
+	free(out->frame);
+	free(out->rect_count);
+	free(out->rects);
+	free(out->slots);
+fail:
+	free(out);
+	return NULL;
+}
+
+void headless_destroy(headless *out)
+{
+	pthread_mutex_lock(&out->lock);
+	out->quit = 1;
+	pthread_cond_signal(&out->not_empty);
+	pthread_mutex_unlock(&out->lock);
+
+	pthread_join(out->thread, NULL);
+
+	pthread_cond_destroy(&out->not_full);
+	pthread_cond_destroy(&out->not_empty);
+	pthread_mutex_destroy(&out->lock);
+
+	if (out->close_fd)
+		close(out->fd);
+
+	free(out->encoded);
+	free(out->frame);
+	free(out->rect_count);
+	free(out->rects);
+	free(out->slots);
+	free(out);
+}
+
+int headless_submit_framebuffer(headless *out, framebuffer *fb)
+{
+	unsigned int i, j, count;
+	unsigned char *slot;
+	const color4 *src;
+	fb_rect *r;
+	int y;
+
+	if ((size_t)fb->width != out->width ||
+		(size_t)fb->height != out->height) {
+		return 0;
+	}
+
+	/* wait for a free slot */
+	pthread_mutex_lock(&out->lock);
+
+	while (out->count == out->frames && !out->error)
+		pthread_cond_wait(&out->not_full, &out->lock);
+
+	if (out->error) {
+		pthread_mutex_unlock(&out->lock);
+		return 0;
+	}
+
+	i = out->head;
+	pthread_mutex_unlock(&out->lock);
+
+	/* the slot is owned by the caller until it is queued,
+	   only copy the modified regions */
+	slot = out->slots + i * out->slotsize;
+	r = out->rects + i * MAX_FRAME_RECTS;
+	count = framebuffer_get_dirty_rects(fb, r, MAX_FRAME_RECTS);
+
+	for (j = 0; j < count; ++j, ++r) {
+		src = fb->color + r->y * fb->width + r->x;
+
+		for (y = 0; y < r->height; ++y, src += fb->width) {
+			memcpy(slot, src, r->width * 4);
+			slot += r->width * 4;
+		}
+	}
+
+	out->rect_count[i] = count;
+	framebuffer_reset_dirty(fb);
+
+	pthread_mutex_lock(&out->lock);
+	out->head = (out->head + 1) % out->frames;
+	out->count += 1;
+	pthread_cond_signal(&out->not_empty);
+	pthread_mutex_unlock(&out->lock);
+	return 1;
+}
@@ -4,234 +4,1780 @@
 #include "config.h"
 #include "shader.h"
 #include "vector.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <math.h>
 
-static MATH_CONST vec4 decode_f2(void *ptr)
+#ifdef __SSE__
+	#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+/* vertices fetched and shaded at once, a multiple of 3 */
+#define IA_BATCH_SIZE (SHADER_BATCH_SIZE - SHADER_BATCH_SIZE % 3)
+
+/* triangles assembled at once for indexed drawing through the cache */
+#define IA_ASSEMBLE_SIZE 64
+
+typedef struct vertex_fetch vertex_fetch;
+
+typedef struct {
+	context *ctx;
+	rs_vertex *v;
+	unsigned int count;
+} shade_job;
+
+typedef struct {
+	const void *ib;
+	int type;                   /* INDEX_TYPE */
+	int topology;               /* PRIMITIVE_TOPOLOGY */
+	int restart;                /* non-zero if restart_index is used */
+	unsigned int restart_index;
+	unsigned int vertexcount;
+	unsigned int pos;           /* next index to read */
+	unsigned int end;
+	unsigned int count;         /* indices since the primitive started */
+	unsigned int a, b;          /* indices kept for the next triangle */
+} index_assembler;
+
+typedef void (* fetch_fn )(const vertex_fetch *vf, rs_vertex *v,
+			unsigned int i);
+
+typedef enum {
+	DECODE_F2 = 0,
+	DECODE_F3 = 1,
+	DECODE_F4 = 2,
+	DECODE_UB3 = 3,
+	DECODE_UB4 = 4,
+	DECODE_H2 = 5,
+	DECODE_H3 = 6,
+	DECODE_H4 = 7,
+	DECODE_S16_2 = 8,
+	DECODE_S16_3 = 9,
+	DECODE_S16_4 = 10,
+	DECODE_U16_2 = 11,
+	DECODE_U16_4 = 12,
+	DECODE_I1010102 = 13
+} DECODE_TYPE;
+
+/* a vertex decoding routine, resolved once per draw call */
+struct vertex_fetch {
+	fetch_fn fetch;             /* decodes a single vertex */
+	const unsigned char *vb;    /* first vertex for specialized fetches */
+	unsigned int vsize;         /* size of a vertex in bytes */
+	int used;                   /* ATTRIB_FLAGS set by the decoder */
+
+	/* attribute decoding steps for formats without a specialized fetch */
+	unsigned int count;
+	struct {
+		const unsigned char *ptr; /* attribute of the first vertex */
+		unsigned int stride;    /* distance between two vertices */
+		unsigned int offset;    /* offset in an interleaved vertex */
+		unsigned char slot;     /* ATTRIB_SLOT to write */
+		unsigned char type;     /* DECODE_TYPE */
+	} step[ATTRIB_COUNT];
+};
+
+static MATH_INLINE vec4 decode_f2(const void *ptr)
+{
+	const float *f = (const float *)ptr;
+
+	return vec4_set(f[0], f[1], 0.0f, 1.0f);
+}
+
+static MATH_INLINE vec4 decode_f3(const void *ptr)
+{
+	return vec4_set(((const float *)ptr)[0], ((const float *)ptr)[1],
+			((const float *)ptr)[2], 1.0f);
+}
+
+static MATH_INLINE vec4 decode_f4(const void *ptr)
+{
+	return vec4_set(((const float *)ptr)[0], ((const float *)ptr)[1],
+			((const float *)ptr)[2], ((const float *)ptr)[3]);
+}
+
+static MATH_INLINE vec4 decode_ub3(const unsigned char *ptr)
+{
+	return vec4_set(((float)ptr[0])/255.0f, ((float)ptr[1])/255.0f,
+			((float)ptr[2])/255.0f, 1.0f);
+}
+
+static MATH_INLINE vec4 decode_ub4(const unsigned char *ptr)
+{
+	return vec4_set(((float)ptr[0])/255.0f, ((float)ptr[1])/255.0f,
+			((float)ptr[2])/255.0f, ((float)ptr[3])/255.0f);
+}
+
+/*
+	Decoders for quantized formats. Attributes with less than four
+	components are padded with the defaults z = 0 and w = 1 before they
+	are converted, so all four lanes are converted at once.
+ */
+#ifdef __SSE2__
+/* convert halfs in the low 16 bits of each lane, denormals become zero */
+static __m128 half_to_float(__m128i h)
+{
+	__m128i sign, em, inf;
+	__m128 f;
+
+	sign = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16);
+	em = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x7FFF)), 13);
+	inf = _mm_cmpgt_epi32(em, _mm_set1_epi32(0x0F7FFFFF));
+
+	/* rebias the exponent from 15 to 127 */
+	f = _mm_mul_ps(_mm_castsi128_ps(em),
+			_mm_castsi128_ps(_mm_set1_epi32(0x77800000)));
+
+	f = _mm_or_ps(f, _mm_castsi128_ps(_mm_and_si128(inf,
+					_mm_set1_epi32(0x7F800000))));
+	return _mm_or_ps(f, _mm_castsi128_ps(sign));
+}
+#else
+static float half_to_float(unsigned short h)
 {
-	return vec4_set(((float *)ptr)[0], ((float *)ptr)[1], 0.0f, 1.0f);
+	union {
+		unsigned int ui;
+		float f;
+	} v;
+
+	v.ui = (unsigned int)(h & 0x7FFF) << 13;
+	v.f *= 5.192296858534828e33f;
+
+	if ((h & 0x7C00) == 0x7C00)
+		v.ui |= 0x7F800000;
+
+	v.ui |= (unsigned int)(h & 0x8000) << 16;
+	return v.f;
+}
+#endif
+
+static vec4 decode_half(const unsigned char *ptr, unsigned int n)
+{
+	unsigned short h[4] = { 0x0000, 0x0000, 0x0000, 0x3C00 };
+	vec4 v;
+
+	memcpy(h, ptr, n * sizeof(h[0]));
+#ifdef __SSE2__
+	_mm_store_ps(&v.x, half_to_float(_mm_unpacklo_epi16(
+			_mm_loadl_epi64((const __m128i *)h),
+			_mm_setzero_si128())));
+#else
+	v = vec4_set(half_to_float(h[0]), half_to_float(h[1]),
+			half_to_float(h[2]), half_to_float(h[3]));
+#endif
+	return v;
 }
 
-static MATH_CONST vec4 decode_f3(void *ptr)
+static vec4 decode_snorm16(const unsigned char *ptr, unsigned int n)
 {
-	return vec4_set(((float *)ptr)[0], ((float *)ptr)[1],
-			((float *)ptr)[2], 1.0f);
+	short i[4] = { 0, 0, 0, 32767 };
+	vec4 v;
+#ifdef __SSE2__
+	__m128i x;
+	__m128 f;
+
+	memcpy(i, ptr, n * sizeof(i[0]));
+	x = _mm_loadl_epi64((const __m128i *)i);
+	x = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+
+	f = _mm_mul_ps(_mm_cvtepi32_ps(x), _mm_set1_ps(1.0f / 32767.0f));
+	_mm_store_ps(&v.x, _mm_max_ps(f, _mm_set1_ps(-1.0f)));
+#else
+	memcpy(i, ptr, n * sizeof(i[0]));
+	v = vec4_set(i[0] / 32767.0f, i[1] / 32767.0f,
+			i[2] / 32767.0f, i[3] / 32767.0f);
+	v.x = v.x < -1.0f ? -1.0f : v.x;
+	v.y = v.y < -1.0f ? -1.0f : v.y;
+	v.z = v.z < -1.0f ? -1.0f : v.z;
+#endif
+	return v;
 }
 
-static MATH_CONST vec4 decode_f4(void *ptr)
+static vec4 decode_unorm16(const unsigned char *ptr, unsigned int n)
 {
-	return vec4_set(((float *)ptr)[0], ((float *)ptr)[1],
-			((float *)ptr)[2], ((float *)ptr)[3]);
+	unsigned short i[4] = { 0, 0, 0, 65535 };
+	vec4 v;
+#ifdef __SSE2__
+	__m128i x;
+
+	memcpy(i, ptr, n * sizeof(i[0]));
+	x = _mm_loadl_epi64((const __m128i *)i);
+	x = _mm_unpacklo_epi16(x, _mm_setzero_si128());
+
+	_mm_store_ps(&v.x, _mm_mul_ps(_mm_cvtepi32_ps(x),
+				_mm_set1_ps(1.0f / 65535.0f)));
+#else
+	memcpy(i, ptr, n * sizeof(i[0]));
+	v = vec4_set(i[0] / 65535.0f, i[1] / 65535.0f,
+			i[2] / 65535.0f, i[3] / 65535.0f);
+#endif
+	return v;
 }
 
-static unsigned char *read_vertex(rs_vertex *v, unsigned char *ptr,
-				int vertex_format)
+/* signed normalized x, y, z in the low 30 bits, w in the top 2 bits */
+static vec4 decode_i1010102(const unsigned char *ptr)
 {
+	unsigned int i;
+	vec4 v;
+#ifdef __SSE2__
+	__m128i x;
+	__m128 f;
+
+	memcpy(&i, ptr, sizeof(i));
+
+	/* move every field to the top and shift it back with sign,
+	   w ends up scaled by 256 */
+	x = _mm_set_epi32((int)(i & 0xC0000000), (int)(i << 2),
+			(int)(i << 12), (int)(i << 22));
+	x = _mm_srai_epi32(x, 22);
+
+	f = _mm_mul_ps(_mm_cvtepi32_ps(x), _mm_set_ps(1.0f / 256.0f,
+			1.0f / 511.0f, 1.0f / 511.0f, 1.0f / 511.0f));
+	_mm_store_ps(&v.x, _mm_max_ps(f, _mm_set1_ps(-1.0f)));
+#else
+	int c[4];
+
+	memcpy(&i, ptr, sizeof(i));
+
+	c[0] = (int)(i & 0x3FF) - ((i & 0x200) ? 0x400 : 0);
+	c[1] = (int)((i >> 10) & 0x3FF) - ((i & 0x80000) ? 0x400 : 0);
+	c[2] = (int)((i >> 20) & 0x3FF) - ((i & 0x20000000) ? 0x400 : 0);
+	c[3] = (int)(i >> 30) - ((i & 0x80000000) ? 4 : 0);
+
+	v = vec4_set(c[0] / 511.0f, c[1] / 511.0f, c[2] / 511.0f,
+			(float)c[3]);
+	v.x = v.x < -1.0f ? -1.0f : v.x;
+	v.y = v.y < -1.0f ? -1.0f : v.y;
+	v.z = v.z < -1.0f ? -1.0f : v.z;
+	v.w = v.w < -1.0f ? -1.0f : v.w;
+#endif
+	return v;
+}
+
+/****************************************************************************/
+
+static void fetch_generic(const vertex_fetch *vf, rs_vertex *v,
+			unsigned int idx)
+{
+	const unsigned char *src;
+	unsigned int i;
+	vec4 *dst;
+
 	/* initialize vertex structure */
 	v->attribs[ATTRIB_POS] = vec4_set(0.0f, 0.0f, 0.0f, 1.0f);
 	v->attribs[ATTRIB_COLOR] = vec4_set(1.0f, 1.0f, 1.0f, 1.0f);
 	v->attribs[ATTRIB_NORMAL] = vec4_set(0.0f, 0.0f, 0.0f, 0.0f);
 	v->attribs[ATTRIB_TEX0] = vec4_set(0.0f, 0.0f, 0.0f, 1.0f);
 	v->attribs[ATTRIB_TEX1] = vec4_set(0.0f, 0.0f, 0.0f, 1.0f);
-	v->used = 0;
+	v->used = vf->used;
 
-	/* decode position */
-	if (vertex_format & (VF_POSITION_F2|VF_POSITION_F3|VF_POSITION_F4))
-		v->used |= ATTRIB_FLAG_POS;
+	for (i = 0; i < vf->count; ++i) {
+		dst = v->attribs + vf->step[i].slot;
+		src = vf->step[i].ptr + vf->step[i].stride * idx;
 
-	if (vertex_format & VF_POSITION_F2) {
-		v->attribs[ATTRIB_POS] = decode_f2(ptr);
-		ptr += 2 * sizeof(float);
-	} else if (vertex_format & VF_POSITION_F3) {
-		v->attribs[ATTRIB_POS] = decode_f3(ptr);
-		ptr += 3 * sizeof(float);
-	} else if (vertex_format & VF_POSITION_F4) {
-		v->attribs[ATTRIB_POS] = decode_f4(ptr);
-		ptr += 4 * sizeof(float);
+		switch (vf->step[i].type) {
+		case DECODE_F2:  *dst = decode_f2(src);  break;
+		case DECODE_F3:  *dst = decode_f3(src);  break;
+		case DECODE_F4:  *dst = decode_f4(src);  break;
+		case DECODE_UB3: *dst = decode_ub3(src); break;
+		case DECODE_UB4: *dst = decode_ub4(src); break;
+		case DECODE_H2: *dst = decode_half(src, 2); break;
+		case DECODE_H3: *dst = decode_half(src, 3); break;
+		case DECODE_H4: *dst = decode_half(src, 4); break;
+		case DECODE_S16_2: *dst = decode_snorm16(src, 2); break;
+		case DECODE_S16_3: *dst = decode_snorm16(src, 3); break;
+		case DECODE_S16_4: *dst = decode_snorm16(src, 4); break;
+		case DECODE_U16_2: *dst = decode_unorm16(src, 2); break;
+		case DECODE_U16_4: *dst = decode_unorm16(src, 4); break;
+		case DECODE_I1010102: *dst = decode_i1010102(src); break;
+		}
 	}
+}
+
+/*
+	Specialized decoders for common formats. Every attribute is written
+	exactly once, either decoded or set to its default value.
+ */
+#define DEFAULT_COLOR vec4_set(1.0f, 1.0f, 1.0f, 1.0f)
+#define DEFAULT_NORMAL vec4_set(0.0f, 0.0f, 0.0f, 0.0f)
+#define DEFAULT_TEX vec4_set(0.0f, 0.0f, 0.0f, 1.0f)
+
+static void fetch_p3(const vertex_fetch *vf, rs_vertex *v,
+			unsigned int i)
+{
+	const unsigned char *ptr = vf->vb + vf->vsize * i;
+
+	v->attribs[ATTRIB_POS] = decode_f3(ptr);
+	v->attribs[ATTRIB_COLOR] = DEFAULT_COLOR;
+	v->attribs[ATTRIB_NORMAL] = DEFAULT_NORMAL;
+	v->attribs[ATTRIB_TEX0] = DEFAULT_TEX;
+	v->attribs[ATTRIB_TEX1] = DEFAULT_TEX;
+	v->used = ATTRIB_FLAG_POS;
+}
+
+static void fetch_p3n3(const vertex_fetch *vf, rs_vertex *v,
+			unsigned int i)
+{
+	const unsigned char *ptr = vf->vb + vf->vsize * i;
+
+	v->attribs[ATTRIB_POS] = decode_f3(ptr);
+	v->attribs[ATTRIB_COLOR] = DEFAULT_COLOR;
+	v->attribs[ATTRIB_NORMAL] = decode_f3(ptr + 12);
+	v->attribs[ATTRIB_TEX0] = DEFAULT_TEX;
+	v->attribs[ATTRIB_TEX1] = DEFAULT_TEX;
+	v->used = ATTRIB_FLAG_POS | ATTRIB_FLAG_NORMAL;
+}
+
+static void fetch_p3n3t2(const vertex_fetch *vf, rs_vertex *v,
+			unsigned int i)
+{
+	const unsigned char *ptr = vf->vb + vf->vsize * i;
+
+	v->attribs[ATTRIB_POS] = decode_f3(ptr);
+	v->attribs[ATTRIB_COLOR] = DEFAULT_COLOR;
+	v->attribs[ATTRIB_NORMAL] = decode_f3(ptr + 12);
+	v->attribs[ATTRIB_TEX0] = decode_f2(ptr + 24);
+	v->attribs[ATTRIB_TEX1] = DEFAULT_TEX;
+	v->used = ATTRIB_FLAG_POS | ATTRIB_FLAG_NORMAL | ATTRIB_FLAG_TEX0;
+}
+
+static void fetch_p3t2(const vertex_fetch *vf, rs_vertex *v,
+			unsigned int i)
+{
+	const unsigned char *ptr = vf->vb + vf->vsize * i;
+
+	v->attribs[ATTRIB_POS] = decode_f3(ptr);
+	v->attribs[ATTRIB_COLOR] = DEFAULT_COLOR;
+	v->attribs[ATTRIB_NORMAL] = DEFAULT_NORMAL;
+	v->attribs[ATTRIB_TEX0] = decode_f2(ptr + 12);
+	v->attribs[ATTRIB_TEX1] = DEFAULT_TEX;
+	v->used = ATTRIB_FLAG_POS | ATTRIB_FLAG_TEX0;
+}
+
+static void fetch_p3c4ub(const vertex_fetch *vf, rs_vertex *v,
+			unsigned int i)
+{
+	const unsigned char *ptr = vf->vb + vf->vsize * i;
+
+	v->attribs[ATTRIB_POS] = decode_f3(ptr);
+	v->attribs[ATTRIB_COLOR] = decode_ub4(ptr + 12);
+	v->attribs[ATTRIB_NORMAL] = DEFAULT_NORMAL;
+	v->attribs[ATTRIB_TEX0] = DEFAULT_TEX;
+	v->attribs[ATTRIB_TEX1] = DEFAULT_TEX;
+	v->used = ATTRIB_FLAG_POS | ATTRIB_FLAG_COLOR;
+}
+
+static void fetch_p3n3c4ub(const vertex_fetch *vf, rs_vertex *v,
+			unsigned int i)
+{
+	const unsigned char *ptr = vf->vb + vf->vsize * i;
+
+	v->attribs[ATTRIB_POS] = decode_f3(ptr);
+	v->attribs[ATTRIB_COLOR] = decode_ub4(ptr + 24);
+	v->attribs[ATTRIB_NORMAL] = decode_f3(ptr + 12);
+	v->attribs[ATTRIB_TEX0] = DEFAULT_TEX;
+	v->attribs[ATTRIB_TEX1] = DEFAULT_TEX;
+	v->used = ATTRIB_FLAG_POS | ATTRIB_FLAG_NORMAL | ATTRIB_FLAG_COLOR;
+}
+
+static void fetch_p3c4f(const vertex_fetch *vf, rs_vertex *v,
+			unsigned int i)
+{
+	const unsigned char *ptr = vf->vb + vf->vsize * i;
+
+	v->attribs[ATTRIB_POS] = decode_f3(ptr);
+	v->attribs[ATTRIB_COLOR] = decode_f4(ptr + 12);
+	v->attribs[ATTRIB_NORMAL] = DEFAULT_NORMAL;
+	v->attribs[ATTRIB_TEX0] = DEFAULT_TEX;
+	v->attribs[ATTRIB_TEX1] = DEFAULT_TEX;
+	v->used = ATTRIB_FLAG_POS | ATTRIB_FLAG_COLOR;
+}
+
+static void fetch_p4c4f(const vertex_fetch *vf, rs_vertex *v,
+			unsigned int i)
+{
+	const unsigned char *ptr = vf->vb + vf->vsize * i;
+
+	v->attribs[ATTRIB_POS] = decode_f4(ptr);
+	v->attribs[ATTRIB_COLOR] = decode_f4(ptr + 16);
+	v->attribs[ATTRIB_NORMAL] = DEFAULT_NORMAL;
+	v->attribs[ATTRIB_TEX0] = DEFAULT_TEX;
+	v->attribs[ATTRIB_TEX1] = DEFAULT_TEX;
+	v->used = ATTRIB_FLAG_POS | ATTRIB_FLAG_COLOR;
+}
+
+static const struct {
+	int format;
+	fetch_fn fetch;
+} specialized_fetch[] = {
+	{ VF_POSITION_F3, fetch_p3 },
+	{ VF_POSITION_F3 | VF_NORMAL_F3, fetch_p3n3 },
+	{ VF_POSITION_F3 | VF_NORMAL_F3 | VF_TEX0, fetch_p3n3t2 },
+	{ VF_POSITION_F3 | VF_TEX0, fetch_p3t2 },
+	{ VF_POSITION_F3 | VF_COLOR_UB4, fetch_p3c4ub },
+	{ VF_POSITION_F3 | VF_NORMAL_F3 | VF_COLOR_UB4, fetch_p3n3c4ub },
+	{ VF_POSITION_F3 | VF_COLOR_F4, fetch_p3c4f },
+	{ VF_POSITION_F4 | VF_COLOR_F4, fetch_p4c4f },
+};
+
+/* DECODE_TYPE of each ATTRIB_FORMAT */
+static const unsigned char attrib_decode[] = {
+	0, DECODE_F2, DECODE_F3, DECODE_F4, DECODE_UB3, DECODE_UB4,
+	DECODE_H2, DECODE_H3, DECODE_H4, DECODE_S16_2, DECODE_S16_3,
+	DECODE_S16_4, DECODE_U16_2, DECODE_U16_4, DECODE_I1010102
+};
+
+static void add_step(vertex_fetch *vf, int slot, int type, unsigned int size)
+{
+	vf->step[vf->count].slot = slot;
+	vf->step[vf->count].type = type;
+	vf->step[vf->count].offset = vf->vsize;
+	vf->count += 1;
+	vf->vsize += size;
+	vf->used |= 1 << slot;
+}
+
+/* resolve a VERTEX_FORMAT into decoding steps for interleaved vertices */
+static void resolve_format(vertex_fetch *vf, int format)
+{
+	vf->vsize = 0;
+	vf->count = 0;
+	vf->used = 0;
 
-	/* decode surface normal */
-	if (vertex_format & VF_NORMAL_F3) {
-		v->used |= ATTRIB_FLAG_NORMAL;
-		v->attribs[ATTRIB_NORMAL] = decode_f3(ptr);
-		ptr += 3 * sizeof(float);
+	if (format & VF_POSITION_F2) {
+		add_step(vf, ATTRIB_POS, DECODE_F2, 2 * sizeof(float));
+	} else if (format & VF_POSITION_F3) {
+		add_step(vf, ATTRIB_POS, DECODE_F3, 3 * sizeof(float));
+	} else if (format & VF_POSITION_F4) {
+		add_step(vf, ATTRIB_POS, DECODE_F4, 4 * sizeof(float));
 	}
 
-	/* decode color */
-	if (vertex_format & (VF_COLOR_F3|VF_COLOR_F4|VF_COLOR_UB3|VF_COLOR_UB4))
-		v->used |= ATTRIB_FLAG_COLOR;
+	if (format & VF_NORMAL_F3)
+		add_step(vf, ATTRIB_NORMAL, DECODE_F3, 3 * sizeof(float));
 
-	if (vertex_format & VF_COLOR_F3) {
-		v->attribs[ATTRIB_COLOR] = decode_f3(ptr);
-		ptr += 3 * sizeof(float);
-	} else if (vertex_format & VF_COLOR_F4) {
-		v->attribs[ATTRIB_COLOR] = decode_f4(ptr);
-		ptr += 4 * sizeof(float);
-	} else if (vertex_format & VF_COLOR_UB3) {
-		v->attribs[ATTRIB_COLOR] = vec4_set(((float)ptr[0])/255.0f,
-						((float)ptr[1])/255.0f,
-						((float)ptr[2])/255.0f,
-						1.0f);
-		ptr += 3;
-	} else if (vertex_format & VF_COLOR_UB4) {
-		v->attribs[ATTRIB_COLOR] = vec4_set(((float)ptr[0])/255.0f,
-						((float)ptr[1])/255.0f,
-						((float)ptr[2])/255.0f,
-						((float)ptr[3])/255.0f);
-		ptr += 4;
+	if (format & VF_COLOR_F3) {
+		add_step(vf, ATTRIB_COLOR, DECODE_F3, 3 * sizeof(float));
+	} else if (format & VF_COLOR_F4) {
+		add_step(vf, ATTRIB_COLOR, DECODE_F4, 4 * sizeof(float));
+	} else if (format & VF_COLOR_UB3) {
+		add_step(vf, ATTRIB_COLOR, DECODE_UB3, 3);
+	} else if (format & VF_COLOR_UB4) {
+		add_step(vf, ATTRIB_COLOR, DECODE_UB4, 4);
 	}
 
-	/* decode texture coordinates */
-	if (vertex_format & VF_TEX0) {
-		v->used |= ATTRIB_FLAG_TEX0;
-		v->attribs[ATTRIB_TEX0] = decode_f2(ptr);
-		ptr += 2*sizeof(float);
+	if (format & VF_TEX0)
+		add_step(vf, ATTRIB_TEX0, DECODE_F2, 2 * sizeof(float));
+}
+
+/* resolve the vertex layout of a context into decoding steps */
+static void resolve_layout(vertex_fetch *vf, const context *ctx)
+{
+	const unsigned char *base;
+	unsigned int i, s;
+	int format;
+
+	vf->vsize = 0;
+	vf->count = 0;
+	vf->used = 0;
+
+	for (i = 0; i < ATTRIB_COUNT; ++i) {
+		format = ctx->vertex_layout.attrib[i].format;
+		s = ctx->vertex_layout.attrib[i].stream;
+
+		if (format <= AF_NONE || format > AF_INT_10_10_10_2_NORM)
+			continue;
+
+		if (s >= MAX_VERTEX_STREAMS || !ctx->vertex_layout.stream[s])
+			continue;
+
+		base = ctx->vertex_layout.stream[s];
+
+		vf->step[vf->count].ptr = base +
+					ctx->vertex_layout.attrib[i].offset;
+		vf->step[vf->count].stride =
+					ctx->vertex_layout.attrib[i].stride;
+		vf->step[vf->count].slot = i;
+		vf->step[vf->count].type = attrib_decode[format];
+		vf->count += 1;
+		vf->used |= 1 << i;
 	}
-	return ptr;
 }
 
-static void draw_triangle(context *ctx, rs_vertex *v0, rs_vertex *v1,
-			rs_vertex *v2)
+/* resolve the vertex input of a context into a decoding routine */
+static void resolve_fetch(vertex_fetch *vf, const context *ctx)
 {
-	ctx->shader->vertex(ctx->shader, ctx, v0);
-	ctx->shader->vertex(ctx->shader, ctx, v1);
-	ctx->shader->vertex(ctx->shader, ctx, v2);
+	int format = ctx->vertex_format;
+	unsigned int i;
+
+	if (format & VF_LAYOUT) {
+		resolve_layout(vf, ctx);
+		format = 0;
+	} else {
+		resolve_format(vf, format);
 
-	rasterizer_process_triangle(ctx, v0, v1, v2);
+		for (i = 0; i < vf->count; ++i) {
+			vf->step[i].ptr = (const unsigned char *)
+					ctx->vertexbuffer + vf->step[i].offset;
+			vf->step[i].stride = vf->vsize;
+		}
+	}
+
+	/* the other attributes are not read at all */
+	if (ctx->vertex_format & VF_POSITION_ONLY) {
+		vf->count = vf->count && vf->step[0].slot == ATTRIB_POS;
+		vf->used = vf->count ? ATTRIB_FLAG_POS : 0;
+		format = (vf->count && vf->step[0].type == DECODE_F3) ?
+				VF_POSITION_F3 : 0;
+	}
+
+	/* specialized fetches read interleaved attributes relative to
+	   the position */
+	vf->vb = vf->count ? vf->step[0].ptr : ctx->vertexbuffer;
+	vf->vsize = vf->count ? vf->step[0].stride : 0;
+	vf->fetch = fetch_generic;
+
+	for (i = 0; i < sizeof(specialized_fetch) /
+			sizeof(specialized_fetch[0]); ++i) {
+		if (specialized_fetch[i].format == format) {
+			vf->fetch = specialized_fetch[i].fetch;
+			break;
+		}
+	}
 }
 
-static void invalidate_tl_cache(context *ctx)
+/* modulate the color of fetched vertices with the current instance */
+static void apply_instance(const context *ctx, rs_vertex *v,
+			unsigned int count)
 {
-	int i;
+	vec4 color = ctx->instance->color;
+	unsigned int i;
 
-	for (i = 0; i < MAX_INDEX_CACHE; ++i)
-		ctx->post_tl_cache[i].index = -1;
+	for (i = 0; i < count; ++i) {
+		v[i].attribs[ATTRIB_COLOR] =
+			vec4_mul(v[i].attribs[ATTRIB_COLOR], color);
+		v[i].used |= ATTRIB_FLAG_COLOR;
+	}
+}
+
+/****************************************************************************/
+
+/* transpose the attributes in mask of count vertices into a batch */
+static void batch_load(rs_vertex_batch *b, const rs_vertex *v,
+			unsigned int count, int mask)
+{
+	unsigned int i, j, a;
+#ifdef __SSE__
+	__m128 r0, r1, r2, r3;
+#endif
+
+	b->count = count;
+
+	for (i = 0; i < count; ++i)
+		b->used[i] = v[i].used;
+
+	for (a = 0; a < ATTRIB_COUNT; ++a) {
+		if (!(mask & (1 << a)))
+			continue;
+
+		i = 0;
+#ifdef __SSE__
+		for (; (i + 4) <= count; i += 4) {
+			r0 = _mm_load_ps(&v[i    ].attribs[a].x);
+			r1 = _mm_load_ps(&v[i + 1].attribs[a].x);
+			r2 = _mm_load_ps(&v[i + 2].attribs[a].x);
+			r3 = _mm_load_ps(&v[i + 3].attribs[a].x);
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+			_mm_store_ps(b->attribs[a][0] + i, r0);
+			_mm_store_ps(b->attribs[a][1] + i, r1);
+			_mm_store_ps(b->attribs[a][2] + i, r2);
+			_mm_store_ps(b->attribs[a][3] + i, r3);
+		}
+#endif
+		for (; i < count; ++i) {
+			b->attribs[a][0][i] = v[i].attribs[a].x;
+			b->attribs[a][1][i] = v[i].attribs[a].y;
+			b->attribs[a][2][i] = v[i].attribs[a].z;
+			b->attribs[a][3][i] = v[i].attribs[a].w;
+		}
+
+		/* keep the padding lanes well defined */
+		for (j = i; j & 3; ++j) {
+			b->attribs[a][0][j] = b->attribs[a][1][j] = 0.0f;
+			b->attribs[a][2][j] = b->attribs[a][3][j] = 0.0f;
+		}
+	}
+}
+
+/* transpose the used attributes of a batch back into vertices */
+static void batch_store(const rs_vertex_batch *b, rs_vertex *v)
+{
+	unsigned int i, a, count = b->count;
+	int mask = ATTRIB_FLAG_POS;
+#ifdef __SSE__
+	__m128 r0, r1, r2, r3;
+#endif
+
+	for (i = 0; i < count; ++i) {
+		v[i].used = b->used[i];
+		mask |= b->used[i];
+	}
+
+	for (a = 0; a < ATTRIB_COUNT; ++a) {
+		if (!(mask & (1 << a)))
+			continue;
+
+		i = 0;
+#ifdef __SSE__
+		for (; (i + 4) <= count; i += 4) {
+			r0 = _mm_load_ps(b->attribs[a][0] + i);
+			r1 = _mm_load_ps(b->attribs[a][1] + i);
+			r2 = _mm_load_ps(b->attribs[a][2] + i);
+			r3 = _mm_load_ps(b->attribs[a][3] + i);
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+			_mm_store_ps(&v[i    ].attribs[a].x, r0);
+			_mm_store_ps(&v[i + 1].attribs[a].x, r1);
+			_mm_store_ps(&v[i + 2].attribs[a].x, r2);
+			_mm_store_ps(&v[i + 3].attribs[a].x, r3);
+		}
+#endif
+		for (; i < count; ++i) {
+			v[i].attribs[a] = vec4_set(b->attribs[a][0][i],
+						b->attribs[a][1][i],
+						b->attribs[a][2][i],
+						b->attribs[a][3][i]);
+		}
+	}
+}
+
+/* run the vertex shader on an array of vertices, batched if possible */
+static void shade_vertices(context *ctx, rs_vertex *v, unsigned int count)
+{
+	const shader_program *prog = ctx->shader;
+	rs_vertex_batch batch;
+	unsigned int i, n;
+	int mask;
+
+	if (!prog->vertex_batch) {
+		for (i = 0; i < count; ++i)
+			prog->vertex(prog, ctx, v + i);
+		return;
+	}
+
+	for (; count > 0; count -= n, v += n) {
+		n = count < SHADER_BATCH_SIZE ? count : SHADER_BATCH_SIZE;
+
+		/* position and normal are always read by the vertex stage */
+		mask = ATTRIB_FLAG_POS | ATTRIB_FLAG_NORMAL;
+
+		for (i = 0; i < n; ++i)
+			mask |= v[i].used;
+
+		batch_load(&batch, v, n, mask);
+		prog->vertex_batch(prog, ctx, &batch);
+		batch_store(&batch, v);
+	}
+}
+
+static void *shade_thread(void *arg)
+{
+	shade_job *job = arg;
+
+	shade_vertices(job->ctx, job->v, job->count);
+	return NULL;
+}
+
+/* run the vertex shader on an array of vertices, split across threads
+   if there are enough of them */
+static void shade_vertices_parallel(context *ctx, rs_vertex *v,
+				unsigned int count)
+{
+	pthread_t thread[IA_MAX_THREADS];
+	shade_job job[IA_MAX_THREADS];
+	unsigned int i, n, started;
+	long cpus;
+
+	n = count / IA_THREAD_VERTICES;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus > 0 && n > (unsigned long)cpus)
+		n = cpus;
+	if (n > IA_MAX_THREADS)
+		n = IA_MAX_THREADS;
+
+	if (n < 2) {
+		shade_vertices(ctx, v, count);
+		return;
+	}
+
+	for (i = 0; i < n; ++i) {
+		job[i].ctx = ctx;
+		job[i].v = v + i * (count / n);
+		job[i].count = count / n;
+	}
+
+	job[n - 1].count += count % n;
+
+	/* the calling thread shades the first part */
+	for (started = 1; started < n; ++started) {
+		if (pthread_create(thread + started, NULL,
+				shade_thread, job + started)) {
+			break;
+		}
+	}
+
+	for (i = started; i < n; ++i)
+		shade_vertices(ctx, job[i].v, job[i].count);
+
+	shade_vertices(ctx, job[0].v, job[0].count);
+
+	for (i = 1; i < started; ++i)
+		pthread_join(thread[i], NULL);
+}
+
+static void invalidate_vertex_cache(context *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->vertex_cache.size; ++i) {
+		ctx->vertex_cache.index[i] = UINT_MAX;
+		ctx->vertex_cache.next[i] = 0;
+	}
+
+	ctx->vertex_cache.mask = 0;
+}
+
+/* lay out the entries of the vertex cache for the attributes in mask,
+   zero if the pool cannot be grown to hold them */
+static int layout_vertex_cache(context *ctx, int mask)
+{
+	unsigned int a, n = 0;
+	void *new;
+
+	for (a = 0; a < ATTRIB_COUNT; ++a) {
+		if (mask & (1 << a))
+			ctx->vertex_cache.slot[n++] = a;
+	}
+
+	if (ctx->vertex_cache.size * n > ctx->vertex_cache.pool_max) {
+		new = realloc(ctx->vertex_cache.pool,
+				ctx->vertex_cache.size * n * sizeof(vec4));
+		if (!new)
+			return 0;
+
+		ctx->vertex_cache.pool = new;
+		ctx->vertex_cache.pool_max = ctx->vertex_cache.size * n;
+	}
+
+	ctx->vertex_cache.mask = mask;
+	ctx->vertex_cache.stride = n;
+	return 1;
+}
+
+static void fetch_and_shade(context *ctx, rs_vertex *v,
+			const vertex_fetch *vf, unsigned int i)
+{
+	vf->fetch(vf, v, i);
+
+	if (ctx->instance)
+		apply_instance(ctx, v, 1);
+
+	ctx->shader->vertex(ctx->shader, ctx, v);
+}
+
+/* find the entry of a set holding a vertex index, -1 if not cached */
+static int find_cached(const unsigned int *tag, unsigned int ways,
+			unsigned int i)
+{
+	unsigned int j = 0;
+#ifdef __SSE2__
+	static const unsigned char debruijn[32] = {
+		0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+		31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+	};
+	unsigned int k, hit;
+	__m128i key, eq;
+
+	/* compare up to 32 tags without branching on the position of a
+	   hit, which is hard to predict */
+	if (!(ways & 3)) {
+		key = _mm_set1_epi32((int)i);
+
+		for (; j < ways; j += 32) {
+			for (k = 0, hit = 0; k < 32 && (j + k) < ways; k += 4) {
+				eq = _mm_cmpeq_epi32(key, _mm_load_si128(
+					(const __m128i *)(tag + j + k)));
+				hit |= (unsigned int)_mm_movemask_ps(
+						_mm_castsi128_ps(eq)) << k;
+			}
+
+			if (hit) {
+				hit &= -hit;
+				return j + debruijn[(hit * 0x077CB531U) >> 27];
+			}
+		}
+
+		return -1;
+	}
+#endif
+	for (; j < ways; ++j) {
+		if (tag[j] == i)
+			return j;
+	}
+
+	return -1;
 }
 
 static void get_cached_index(context *ctx, rs_vertex *v,
-				unsigned int vsize, unsigned int i)
+				const vertex_fetch *vf, unsigned int i)
 {
-	int idx, slot = i % MAX_INDEX_CACHE;
+	unsigned int j, n, set, ways = ctx->vertex_cache.ways, *tag;
+	const int *slot = ctx->vertex_cache.slot;
+	int hit, mask;
+	vec4 *attr;
+
+	if (!ctx->vertex_cache.size) {
+		fetch_and_shade(ctx, v, vf, i);
+		return;
+	}
 
-	idx = ctx->post_tl_cache[slot].index;
+	set = (i % (ctx->vertex_cache.size / ways)) * ways;
+	tag = ctx->vertex_cache.index + set;
 
-	if (idx > 0 && (unsigned int)idx == i) {
-		*v = ctx->post_tl_cache[slot].vtx;
-	} else {
-		read_vertex(v,
-			((unsigned char *)ctx->vertexbuffer) + vsize * i,
-			ctx->vertex_format);
+	hit = find_cached(tag, ways, i);
+
+	if (hit >= 0) {
+		attr = ctx->vertex_cache.pool +
+			(set + hit) * ctx->vertex_cache.stride;
+		v->used = ctx->vertex_cache.used[set + hit];
 
-		ctx->shader->vertex(ctx->shader, ctx, v);
+		for (n = 0; n < ctx->vertex_cache.stride; ++n)
+			v->attribs[slot[n]] = attr[n];
 
-		ctx->post_tl_cache[slot].vtx = *v;
-		ctx->post_tl_cache[slot].index = i;
+		++ctx->vertex_cache.hits;
+		return;
 	}
+
+	++ctx->vertex_cache.misses;
+	fetch_and_shade(ctx, v, vf, i);
+
+	mask = v->used | ATTRIB_FLAG_POS;
+
+	if (!ctx->vertex_cache.mask && !layout_vertex_cache(ctx, mask))
+		return;
+
+	if (mask & ~ctx->vertex_cache.mask)
+		return;
+
+	/* replace the oldest entry of the set, the FIFO position is kept
+	   in the slot of the first entry */
+	j = ctx->vertex_cache.next[set];
+	ctx->vertex_cache.next[set] = (j + 1) % ways;
+
+	tag[j] = i;
+	ctx->vertex_cache.used[set + j] = v->used;
+	attr = ctx->vertex_cache.pool + (set + j) * ctx->vertex_cache.stride;
+
+	for (n = 0; n < ctx->vertex_cache.stride; ++n)
+		attr[n] = v->attribs[slot[n]];
 }
 
-static void draw_triangle_indexed(context *ctx, unsigned int vsize,
+static void draw_triangle_indexed(context *ctx, const vertex_fetch *vf,
 				unsigned int i0, unsigned int i1,
 				unsigned int i2)
 {
 	rs_vertex v0, v1, v2;
 
-	get_cached_index(ctx, &v0, vsize, i0);
-	get_cached_index(ctx, &v1, vsize, i1);
-	get_cached_index(ctx, &v2, vsize, i2);
+	get_cached_index(ctx, &v0, vf, i0);
+	get_cached_index(ctx, &v1, vf, i1);
+	get_cached_index(ctx, &v2, vf, i2);
 
 	rasterizer_process_triangle(ctx, &v0, &v1, &v2);
 }
 
+/* draw a non-indexed strip or fan, keeping the shaded vertices that are
+   shared with the triangles of the next batch */
+static void draw_strip_or_fan(context *ctx, const vertex_fetch *vf,
+			unsigned int vertexcount)
+{
+	unsigned int i, n = 0, keep = 2, count, tris = 0, next = 0;
+	rs_vertex v[IA_BATCH_SIZE], first;
+	int fan = ctx->topology == PRIM_TRIANGLE_FAN;
+
+	if (vertexcount < 3)
+		return;
+
+	if (fan) {
+		vf->fetch(vf, &first, next++);
+
+		if (ctx->instance)
+			apply_instance(ctx, &first, 1);
+
+		shade_vertices(ctx, &first, 1);
+		--vertexcount;
+		keep = 1;
+	}
+
+	for (; vertexcount > 0; vertexcount -= count) {
+		count = IA_BATCH_SIZE - n;
+		count = vertexcount < count ? vertexcount : count;
+
+		for (i = 0; i < count; ++i)
+			vf->fetch(vf, v + n + i, next++);
+
+		if (ctx->instance)
+			apply_instance(ctx, v + n, count);
+
+		shade_vertices(ctx, v + n, count);
+		n += count;
+
+		for (i = 0; (i + keep) < n; ++i, ++tris) {
+			if (fan) {
+				rasterizer_process_triangle(ctx, &first, v + i,
+							v + i + 1);
+			} else if (tris & 1) {
+				rasterizer_process_triangle(ctx, v + i + 1,
+							v + i, v + i + 2);
+			} else {
+				rasterizer_process_triangle(ctx, v + i,
+							v + i + 1, v + i + 2);
+			}
+		}
+
+		if (n > keep) {
+			memmove(v, v + n - keep, keep * sizeof(v[0]));
+			n = keep;
+		}
+	}
+}
+
+/* zero if the BOUNDS_TEST is enabled and the bounding box of a draw is
+   outside the view frustum */
+static int bounds_visible(const context *ctx)
+{
+	const float *m = ctx->derived.mvp;
+	vec4 x, y, z, w, c, e, plane[7];
+	int i, n = 0;
+	float d, r;
+
+	if (!(ctx->flags & BOUNDS_TEST))
+		return 1;
+
+	/* the clip space planes x = -w, x = w, y = -w, y = w, w = 0 and, if
+	   the rasterizer clips against them, z = -w and z = w in object
+	   space, with the normals pointing inwards */
+	x = vec4_set(m[0], m[4], m[ 8], m[12]);
+	y = vec4_set(m[1], m[5], m[ 9], m[13]);
+	z = vec4_set(m[2], m[6], m[10], m[14]);
+	w = vec4_set(m[3], m[7], m[11], m[15]);
+
+	plane[n++] = w;
+	plane[n++] = vec4_add(w, x);
+	plane[n++] = vec4_sub(w, x);
+	plane[n++] = vec4_add(w, y);
+	plane[n++] = vec4_sub(w, y);
+
+	if (ctx->flags & DEPTH_CLIP) {
+		plane[n++] = vec4_add(w, z);
+		plane[n++] = vec4_sub(w, z);
+	}
+
+	c = vec4_scale(vec4_add(ctx->bounds.min, ctx->bounds.max), 0.5f);
+	e = vec4_scale(vec4_sub(ctx->bounds.max, ctx->bounds.min), 0.5f);
+	c.w = 1.0f;
+
+	/* the box is outside if the corner furthest along the normal is,
+	   the rasterizer also clips away everything at w <= 0 */
+	for (i = 0; i < n; ++i) {
+		d = vec4_dot(plane[i], c);
+		r = fabs(plane[i].x) * e.x + fabs(plane[i].y) * e.y +
+			fabs(plane[i].z) * e.z;
+
+		if ((d + r) < 0.0f || (i == 0 && (d + r) <= 0.0f))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* drop the triangles of a non-indexed batch that the rasterizer would
+   discard, using only the position stage of the shader, and move the
+   remaining ones to the front. Returns the number of vertices left. */
+static unsigned int cull_batch(const context *ctx, rs_vertex *v,
+				unsigned int count)
+{
+	const shader_program *prog = ctx->shader;
+	unsigned int i, n = 0;
+	vec4 p0, p1, p2;
+
+	for (i = 0; i < count; i += 3) {
+		p0 = prog->position(prog, ctx, v + i);
+		p1 = prog->position(prog, ctx, v + i + 1);
+		p2 = prog->position(prog, ctx, v + i + 2);
+
+		if (!rasterizer_triangle_visible(ctx, p0, p1, p2))
+			continue;
+
+		if (n != i)
+			memcpy(v + n, v + i, 3 * sizeof(v[0]));
+
+		n += 3;
+	}
+
+	return n;
+}
+
+static void draw_vertices(context *ctx, const vertex_fetch *vf,
+			unsigned int vertexcount)
+{
+	unsigned int i, n, count, next = 0;
+	rs_vertex v[IA_BATCH_SIZE];
+
+	if (ctx->topology != PRIM_TRIANGLES) {
+		draw_strip_or_fan(ctx, vf, vertexcount);
+		return;
+	}
+
+	vertexcount -= vertexcount % 3;
+
+	/* fetch and shade a batch of triangles, then rasterize them */
+	for (; vertexcount > 0; vertexcount -= count) {
+		count = vertexcount < IA_BATCH_SIZE ?
+			vertexcount : IA_BATCH_SIZE;
+
+		for (i = 0; i < count; ++i)
+			vf->fetch(vf, v + i, next++);
+
+		if (ctx->instance)
+			apply_instance(ctx, v, count);
+
+		n = ctx->shader->position ? cull_batch(ctx, v, count) : count;
+
+		shade_vertices(ctx, v, n);
+
+		for (i = 0; i < n; i += 3)
+			rasterizer_process_triangle(ctx, v + i, v + i + 1,
+						v + i + 2);
+	}
+}
+
 void ia_draw_triangles(context *ctx, unsigned int vertexcount)
 {
-	void *ptr = ctx->vertexbuffer;
-	rs_vertex v0, v1, v2;
-	unsigned int i;
+	vertex_fetch vf;
 
 	if (ctx->immediate.active)
 		return;
 
-	vertexcount -= vertexcount % 3;
+	context_validate(ctx);
+
+	if (!bounds_visible(ctx))
+		return;
+
+	resolve_fetch(&vf, ctx);
+	draw_vertices(ctx, &vf, vertexcount);
+}
+
+static int reserve_scratch(context *ctx, unsigned int vertices,
+			unsigned int remap, unsigned int triangles)
+{
+	void *new;
+
+	if (vertices > ctx->scratch.vertex_count) {
+		new = realloc(ctx->scratch.vertices,
+				vertices * sizeof(rs_vertex));
+		if (!new)
+			return 0;
+
+		ctx->scratch.vertices = new;
+		ctx->scratch.vertex_count = vertices;
+	}
+
+	if (remap > ctx->scratch.remap_count) {
+		new = realloc(ctx->scratch.remap,
+				remap * sizeof(unsigned int));
+		if (!new)
+			return 0;
+
+		ctx->scratch.remap = new;
+		ctx->scratch.remap_count = remap;
+	}
+
+	if (triangles > ctx->scratch.triangle_count) {
+		new = realloc(ctx->scratch.triangles,
+				triangles * 3 * sizeof(unsigned int));
+		if (!new)
+			return 0;
+
+		ctx->scratch.triangles = new;
+		ctx->scratch.triangle_count = triangles;
+	}
+
+	return 1;
+}
+
+static int reserve_normals(context *ctx, unsigned int count)
+{
+	void *new;
+
+	if (count > ctx->scratch.normal_count) {
+		new = realloc(ctx->scratch.normals, count * 16 * sizeof(float));
+		if (!new)
+			return 0;
+
+		ctx->scratch.normals = new;
+		ctx->scratch.normal_count = count;
+	}
+
+	return 1;
+}
+
+static int reserve_positions(context *ctx, unsigned int count)
+{
+	void *new;
+
+	if (count > ctx->scratch.position_count) {
+		new = realloc(ctx->scratch.positions, count * sizeof(vec4));
+		if (!new)
+			return 0;
+
+		ctx->scratch.positions = new;
+		ctx->scratch.position_count = count;
+	}
+
+	return 1;
+}
+
+/* make an instance current, the caller saves and restores the matrices */
+static void set_instance(context *ctx, const rs_instance *instances,
+			unsigned int id)
+{
+	memcpy(ctx->modelview, instances[id].modelview, sizeof(float) * 16);
+	memcpy(ctx->normalmatrix, ctx->scratch.normals + id * 16,
+		sizeof(float) * 16);
+
+	ctx->instance = instances + id;
+	ctx->instance_id = id;
+	ctx->dirty |= DIRTY_TRANSFORM;
+	context_validate(ctx);
+}
+
+static void restore_matrices(context *ctx, const float *modelview,
+			const float *normalmatrix)
+{
+	memcpy(ctx->modelview, modelview, sizeof(float) * 16);
+	memcpy(ctx->normalmatrix, normalmatrix, sizeof(float) * 16);
+
+	ctx->instance = NULL;
+	ctx->instance_id = 0;
+	ctx->dirty |= DIRTY_TRANSFORM;
+}
+
+static unsigned int read_index(const void *ib, int type, unsigned int i)
+{
+	switch (type) {
+	case INDEX_U8:
+		return ((const unsigned char *)ib)[i];
+	case INDEX_U32:
+		return ((const unsigned int *)ib)[i];
+	}
+
+	return ((const unsigned short *)ib)[i];
+}
+
+static void assembler_init(index_assembler *as, const context *ctx,
+			unsigned int vertexcount, unsigned int indexcount)
+{
+	as->ib = ctx->indexbuffer;
+	as->type = ctx->index_type;
+	as->topology = ctx->topology;
+	as->restart = (ctx->flags & PRIMITIVE_RESTART) != 0;
+	as->restart_index = ctx->restart_index;
+	as->vertexcount = vertexcount;
+	as->pos = 0;
+	as->end = indexcount;
+	as->count = 0;
+	as->a = as->b = 0;
+}
+
+/* assemble up to max triangles from the index buffer, skipping triangles
+   that reference vertices out of bounds */
+static unsigned int assemble_triangles(index_assembler *as,
+				unsigned int *out, unsigned int max)
+{
+	unsigned int i, n = 0, i0 = 0, i1 = 0;
+	int emit;
+
+	while (n < max && as->pos < as->end) {
+		i = read_index(as->ib, as->type, as->pos++);
+
+		if (as->restart && i == as->restart_index) {
+			as->count = 0;
+			continue;
+		}
+
+		emit = 0;
+
+		switch (as->topology) {
+		case PRIM_TRIANGLE_STRIP:
+			/* every other triangle is flipped to keep winding */
+			if (as->count >= 2) {
+				i0 = (as->count & 1) ? as->b : as->a;
+				i1 = (as->count & 1) ? as->a : as->b;
+				emit = 1;
+			}
+			as->a = as->b;
+			as->b = i;
+			break;
+		case PRIM_TRIANGLE_FAN:
+			if (as->count >= 2) {
+				i0 = as->a;
+				i1 = as->b;
+				emit = 1;
+			}
+			if (as->count == 0)
+				as->a = i;
+			as->b = i;
+			break;
+		default:
+			if ((as->count % 3) == 2) {
+				i0 = as->a;
+				i1 = as->b;
+				emit = 1;
+			}
+			as->a = as->b;
+			as->b = i;
+			break;
+		}
+
+		++as->count;
+
+		if (emit && i0 < as->vertexcount && i1 < as->vertexcount &&
+			i < as->vertexcount) {
+			out[n * 3    ] = i0;
+			out[n * 3 + 1] = i1;
+			out[n * 3 + 2] = i;
+			++n;
+		}
+	}
+
+	return n;
+}
+
+/* assemble the triangles of an indexed draw into the scratch memory,
+   remap them to the referenced vertices only and fetch those vertices.
+   Space for copies times the fetched vertices and triangles is reserved. */
+static int pretransform_fetch(context *ctx, const vertex_fetch *vf,
+			unsigned int vertexcount, unsigned int indexcount,
+			unsigned int copies, unsigned int *tris,
+			unsigned int *count)
+{
+	unsigned int i, idx, min = UINT_MAX, max = 0, n;
+	unsigned int *remap, *tri;
+	index_assembler as;
+	rs_vertex *v;
+
+	n = ctx->topology == PRIM_TRIANGLES ? indexcount / 3 : indexcount;
+
+	if (!reserve_scratch(ctx, 0, 0, n * copies))
+		return 0;
+
+	tri = ctx->scratch.triangles;
+
+	assembler_init(&as, ctx, vertexcount, indexcount);
+	*tris = assemble_triangles(&as, tri, n);
+	*count = 0;
+
+	for (i = 0; i < *tris * 3; ++i) {
+		min = tri[i] < min ? tri[i] : min;
+		max = tri[i] > max ? tri[i] : max;
+	}
+
+	if (min > max)
+		return 1;
+
+	if (!reserve_scratch(ctx, (max - min + 1) * copies, max - min + 1, 0))
+		return 0;
+
+	v = ctx->scratch.vertices;
+	remap = ctx->scratch.remap;
+	memset(remap, 0xFF, (max - min + 1) * sizeof(unsigned int));
+
+	for (i = 0, n = 0; i < *tris * 3; ++i) {
+		idx = tri[i] - min;
+
+		if (remap[idx] == UINT_MAX) {
+			vf->fetch(vf, v + n, tri[i]);
+			remap[idx] = n++;
+		}
+
+		tri[i] = remap[idx];
+	}
+
+	*count = n;
+	return 1;
+}
+
+/* write the triangles of a pretransform draw that the rasterizer would not
+   discard to out, which may alias tri, using only the position stage of
+   the shader. The vertices they reference are moved to the front and the
+   triangles remapped. Returns the number of vertices left. */
+static unsigned int cull_triangles(context *ctx, rs_vertex *v,
+				unsigned int count, const unsigned int *tri,
+				unsigned int *out, unsigned int *tris)
+{
+	const shader_program *prog = ctx->shader;
+	unsigned int i, n, *live;
+	vec4 *pos;
+
+	if (!reserve_positions(ctx, count)) {
+		memmove(out, tri, *tris * 3 * sizeof(tri[0]));
+		return count;
+	}
+
+	pos = ctx->scratch.positions;
+	live = ctx->scratch.remap;
+
+	for (i = 0; i < count; ++i) {
+		pos[i] = prog->position(prog, ctx, v + i);
+		live[i] = UINT_MAX;
+	}
+
+	for (i = 0, n = 0; i < *tris * 3; i += 3) {
+		if (!rasterizer_triangle_visible(ctx, pos[tri[i]],
+						pos[tri[i + 1]],
+						pos[tri[i + 2]])) {
+			continue;
+		}
+
+		out[n++] = tri[i];
+		out[n++] = tri[i + 1];
+		out[n++] = tri[i + 2];
+
+		live[tri[i]] = live[tri[i + 1]] = live[tri[i + 2]] = 0;
+	}
+
+	*tris = n / 3;
+
+	for (i = 0, n = 0; i < count; ++i) {
+		if (live[i] == UINT_MAX)
+			continue;
+
+		if (n != i)
+			v[n] = v[i];
+
+		live[i] = n++;
+	}
+
+	for (i = 0; i < *tris * 3; ++i)
+		out[i] = live[out[i]];
+
+	return n;
+}
+
+static void draw_triangle_list(context *ctx, const rs_vertex *v,
+			const unsigned int *tri, unsigned int tris)
+{
+	unsigned int i;
+
+	for (i = 0; i < tris * 3; i += 3) {
+		rasterizer_process_triangle(ctx, v + tri[i], v + tri[i + 1],
+					v + tri[i + 2]);
+	}
+}
+
+/* decide whether an indexed draw shades all vertices up front */
+static int use_pretransform(const context *ctx, unsigned int vertexcount,
+			unsigned int indexcount)
+{
+	unsigned long refs = indexcount;
 
-	for (i = 0; i < vertexcount; i += 3) {
-		ptr = read_vertex(&v0, ptr, ctx->vertex_format);
-		ptr = read_vertex(&v1, ptr, ctx->vertex_format);
-		ptr = read_vertex(&v2, ptr, ctx->vertex_format);
+	switch (ctx->indexed_strategy) {
+	case INDEXED_DRAW_CACHE:
+		return 0;
+	case INDEXED_DRAW_PRETRANSFORM:
+		return 1;
+	}
+
+	/* strips and fans reference most vertices three times */
+	if (ctx->topology != PRIM_TRIANGLES)
+		refs *= 3;
+
+	return (unsigned long)vertexcount * IA_PRETRANSFORM_RATIO <= refs;
+}
 
-		draw_triangle(ctx, &v0, &v1, &v2);
+static void draw_indexed_cached(context *ctx, const vertex_fetch *vf,
+			unsigned int vertexcount, unsigned int indexcount)
+{
+	unsigned int i, n, tri[3 * IA_ASSEMBLE_SIZE];
+	index_assembler as;
+
+	invalidate_vertex_cache(ctx);
+	assembler_init(&as, ctx, vertexcount, indexcount);
+
+	while ((n = assemble_triangles(&as, tri, IA_ASSEMBLE_SIZE)) > 0) {
+		for (i = 0; i < n * 3; i += 3) {
+			draw_triangle_indexed(ctx, vf, tri[i], tri[i + 1],
+						tri[i + 2]);
+		}
 	}
 }
 
 void ia_draw_triangles_indexed(context *ctx, unsigned int vertexcount,
 				unsigned int indexcount)
 {
-	unsigned int i0, i1, i2, i = 0, vsize = 0;
+	unsigned int tris, count;
+	vertex_fetch vf;
 
 	if (ctx->immediate.active)
 		return;
 
-	/* determine vertex size in bytes */
-	if (ctx->vertex_format & VF_POSITION_F2) {
-		vsize += 2 * sizeof(float);
-	} else if (ctx->vertex_format & VF_POSITION_F3) {
-		vsize += 3 * sizeof(float);
-	} else if (ctx->vertex_format & VF_POSITION_F4) {
-		vsize += 4 * sizeof(float);
+	context_validate(ctx);
+
+	if (!bounds_visible(ctx))
+		return;
+
+	resolve_fetch(&vf, ctx);
+
+	if (use_pretransform(ctx, vertexcount, indexcount) &&
+		pretransform_fetch(ctx, &vf, vertexcount, indexcount, 1,
+					&tris, &count)) {
+		if (ctx->shader->position) {
+			count = cull_triangles(ctx, ctx->scratch.vertices,
+						count, ctx->scratch.triangles,
+						ctx->scratch.triangles, &tris);
+		}
+
+		shade_vertices_parallel(ctx, ctx->scratch.vertices, count);
+		draw_triangle_list(ctx, ctx->scratch.vertices,
+				ctx->scratch.triangles, tris);
+		return;
 	}
 
-	if (ctx->vertex_format & VF_NORMAL_F3)
-		vsize += 3 * sizeof(float);
+	draw_indexed_cached(ctx, &vf, vertexcount, indexcount);
+}
+
+void ia_draw_triangles_instanced(context *ctx, unsigned int vertexcount,
+				const rs_instance *instances,
+				unsigned int instancecount)
+{
+	float modelview[16], normalmatrix[16];
+	vertex_fetch vf;
+	unsigned int i;
+
+	if (ctx->immediate.active || !reserve_normals(ctx, instancecount))
+		return;
+
+	resolve_fetch(&vf, ctx);
+
+	context_compute_normal_matrices(ctx->scratch.normals, instances,
+					instancecount);
+
+	memcpy(modelview, ctx->modelview, sizeof(modelview));
+	memcpy(normalmatrix, ctx->normalmatrix, sizeof(normalmatrix));
+
+	for (i = 0; i < instancecount; ++i) {
+		set_instance(ctx, instances, i);
+
+		if (bounds_visible(ctx))
+			draw_vertices(ctx, &vf, vertexcount);
+	}
+
+	restore_matrices(ctx, modelview, normalmatrix);
+}
+
+void ia_draw_triangles_indexed_instanced(context *ctx,
+					unsigned int vertexcount,
+					unsigned int indexcount,
+					const rs_instance *instances,
+					unsigned int instancecount)
+{
+	unsigned int i, tris, count = 0, n, drawn, *tri;
+	float modelview[16], normalmatrix[16];
+	int pretransform;
+	vertex_fetch vf;
+	rs_vertex *v;
+
+	if (ctx->immediate.active || !reserve_normals(ctx, instancecount))
+		return;
+
+	resolve_fetch(&vf, ctx);
+
+	context_compute_normal_matrices(ctx->scratch.normals, instances,
+					instancecount);
+
+	/* the triangles are assembled and the vertices fetched only once,
+	   every instance shades a copy of them */
+	pretransform = use_pretransform(ctx, vertexcount, indexcount) &&
+			pretransform_fetch(ctx, &vf, vertexcount, indexcount,
+					2, &tris, &count);
+
+	memcpy(modelview, ctx->modelview, sizeof(modelview));
+	memcpy(normalmatrix, ctx->normalmatrix, sizeof(normalmatrix));
+
+	for (i = 0; i < instancecount; ++i) {
+		set_instance(ctx, instances, i);
+
+		if (!bounds_visible(ctx))
+			continue;
+
+		if (!pretransform) {
+			draw_indexed_cached(ctx, &vf, vertexcount, indexcount);
+			continue;
+		}
+
+		v = ctx->scratch.vertices;
+		tri = ctx->scratch.triangles;
+		memcpy(v + count, v, count * sizeof(rs_vertex));
 
-	if (ctx->vertex_format & VF_COLOR_F3) {
-		vsize += 3 * sizeof(float);
-	} else if (ctx->vertex_format & VF_COLOR_F4) {
-		vsize += 4 * sizeof(float);
-	} else if (ctx->vertex_format & VF_COLOR_UB3) {
-		vsize += 3;
-	} else if (ctx->vertex_format & VF_COLOR_UB4) {
-		vsize += 4;
+		apply_instance(ctx, v + count, count);
+
+		n = count;
+		drawn = tris;
+
+		/* the culled triangles of an instance go to the second half
+		   of the scratch triangles, the first half is kept intact */
+		if (ctx->shader->position) {
+			n = cull_triangles(ctx, v + count, count, tri,
+					tri + tris * 3, &drawn);
+			tri += tris * 3;
+		}
+
+		shade_vertices_parallel(ctx, v + count, n);
+		draw_triangle_list(ctx, v + count, tri, drawn);
 	}
 
-	if (ctx->vertex_format & VF_TEX0)
-		vsize += 2 * sizeof(float);
+	restore_matrices(ctx, modelview, normalmatrix);
+}
+
+unsigned int ia_vertex_size(int format)
+{
+	vertex_fetch vf;
 
-	/* for each triangle */
-	invalidate_tl_cache(ctx);
+	if (format & VF_LAYOUT)
+		return 0;
 
-	indexcount -= indexcount % 3;
+	resolve_format(&vf, format);
+	return vf.vsize;
+}
 
-	while (i < indexcount) {
-		i0 = ctx->indexbuffer[i++];
-		i1 = ctx->indexbuffer[i++];
-		i2 = ctx->indexbuffer[i++];
+/****************************************************************************/
 
-		if (i0 < vertexcount && i1 < vertexcount && i2 < vertexcount)
-			draw_triangle_indexed(ctx, vsize, i0, i1, i2);
+static unsigned int vertex_hash(const rs_vertex *v)
+{
+	unsigned int i, j, w[4], h = 0x811C9DC5;
+
+	for (i = 0; i < ATTRIB_COUNT; ++i) {
+		if (!(v->used & (1 << i)))
+			continue;
+
+		memcpy(w, v->attribs + i, sizeof(w));
+
+		for (j = 0; j < 4; ++j)
+			h = (h ^ w[j]) * 0x01000193;
 	}
+
+	return h ^ (unsigned int)v->used;
+}
+
+static int vertex_equal(const rs_vertex *a, const rs_vertex *b)
+{
+	int i;
+
+	if (a->used != b->used)
+		return 0;
+
+	for (i = 0; i < ATTRIB_COUNT; ++i) {
+		if ((a->used & (1 << i)) &&
+			memcmp(a->attribs + i, b->attribs + i, sizeof(vec4))) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* find the hash table slot of a vertex, or the free slot to insert it */
+static unsigned int hash_slot(const context *ctx, const rs_vertex *v)
+{
+	unsigned int i, mask = ctx->immediate.hash_max - 1;
+
+	i = vertex_hash(v) & mask;
+
+	while (ctx->immediate.hash[i] != UINT_MAX) {
+		if (vertex_equal(ctx->immediate.vertices +
+				ctx->immediate.hash[i], v)) {
+			break;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	return i;
+}
+
+static void immediate_reset(context *ctx)
+{
+	ctx->immediate.vertex_count = 0;
+	ctx->immediate.index_count = 0;
+
+	if (ctx->immediate.dedup && ctx->immediate.hash) {
+		memset(ctx->immediate.hash, 0xFF,
+			ctx->immediate.hash_max * sizeof(unsigned int));
+	}
+}
+
+/* make room for one more vertex and index in the immediate mode buffer */
+static int immediate_reserve(context *ctx)
+{
+	unsigned int i, count;
+	void *new;
+
+	if (ctx->immediate.index_count == ctx->immediate.index_max) {
+		count = ctx->immediate.index_max ?
+			ctx->immediate.index_max * 2 : 3 * 64;
+
+		new = realloc(ctx->immediate.indices,
+				count * sizeof(unsigned int));
+		if (!new)
+			return 0;
+
+		ctx->immediate.indices = new;
+		ctx->immediate.index_max = count;
+	}
+
+	if (ctx->immediate.vertex_count == ctx->immediate.vertex_max) {
+		count = ctx->immediate.vertex_max ?
+			ctx->immediate.vertex_max * 2 : 64;
+
+		new = realloc(ctx->immediate.vertices,
+				count * sizeof(rs_vertex));
+		if (!new)
+			return 0;
+
+		ctx->immediate.vertices = new;
+		ctx->immediate.vertex_max = count;
+	}
+
+	if (!ctx->immediate.dedup ||
+		ctx->immediate.hash_max >= ctx->immediate.vertex_max * 2) {
+		return 1;
+	}
+
+	count = ctx->immediate.vertex_max * 2;
+
+	new = realloc(ctx->immediate.hash, count * sizeof(unsigned int));
+	if (!new)
+		return 0;
+
+	ctx->immediate.hash = new;
+	ctx->immediate.hash_max = count;
+
+	/* rebuild the hash table for the new size */
+	memset(ctx->immediate.hash, 0xFF, count * sizeof(unsigned int));
+
+	for (i = 0; i < ctx->immediate.vertex_count; ++i) {
+		ctx->immediate.hash[hash_slot(ctx,
+			ctx->immediate.vertices + i)] = i;
+	}
+
+	return 1;
+}
+
+/* draw the completed triangles of the immediate mode buffer like a
+   pretransformed indexed draw and start over */
+static void immediate_flush(context *ctx)
+{
+	unsigned int count = ctx->immediate.vertex_count;
+	unsigned int tris = ctx->immediate.index_count / 3;
+	unsigned int *tri = ctx->immediate.indices;
+	rs_vertex *v = ctx->immediate.vertices;
+
+	if (tris > 0) {
+		context_validate(ctx);
+
+		if (ctx->shader->position && reserve_scratch(ctx, 0, count, 0))
+			count = cull_triangles(ctx, v, count, tri, tri, &tris);
+
+		shade_vertices_parallel(ctx, v, count);
+		draw_triangle_list(ctx, v, tri, tris);
+	}
+
+	immediate_reset(ctx);
 }
 
 void ia_begin(context *ctx)
 {
+	if (ctx->immediate.active)
+		ia_end(ctx);
+
 	ctx->immediate.next.used = 0;
-	ctx->immediate.current = 0;
+	ctx->immediate.dedup = (ctx->flags & IMMEDIATE_DEDUP) != 0;
 	ctx->immediate.active = 1;
+	ctx->immediate.skip = 0;
+
+	immediate_reset(ctx);
 }
 
 void ia_vertex(context *ctx, float x, float y, float z, float w)
 {
+	unsigned int i, slot = 0, *idx;
+	rs_vertex *v;
+
 	if (!ctx->immediate.active)
 		return;
 
+	if (ctx->immediate.skip) {
+		ctx->immediate.skip -= 1;
+		return;
+	}
+
+	/* out of memory, draw what is complete and drop the rest of the
+	   current triangle, so the following ones are assembled from the
+	   right vertices */
+	if (!immediate_reserve(ctx)) {
+		i = ctx->immediate.index_count % 3;
+
+		ctx->immediate.index_count -= i;
+		ctx->immediate.skip = 2 - i;
+		immediate_flush(ctx);
+		return;
+	}
+
 	ctx->immediate.next.attribs[ATTRIB_POS] = vec4_set(x, y, z, w);
 	ctx->immediate.next.used |= ATTRIB_FLAG_POS;
 
-	ctx->immediate.vertex[ctx->immediate.current++] = ctx->immediate.next;
+	v = ctx->immediate.vertices;
+	idx = ctx->immediate.indices;
+	i = ctx->immediate.vertex_count;
 
-	if (ctx->immediate.current < 3)
-		return;
+	if (ctx->immediate.dedup) {
+		slot = hash_slot(ctx, &ctx->immediate.next);
 
-	ctx->immediate.current = 0;
-	draw_triangle(ctx, ctx->immediate.vertex, ctx->immediate.vertex + 1,
-			ctx->immediate.vertex + 2);
+		if (ctx->immediate.hash[slot] != UINT_MAX)
+			i = ctx->immediate.hash[slot];
+	}
+
+	if (i == ctx->immediate.vertex_count) {
+		v[i] = ctx->immediate.next;
+		ctx->immediate.vertex_count += 1;
+
+		if (ctx->immediate.dedup)
+			ctx->immediate.hash[slot] = i;
+	}
+
+	idx[ctx->immediate.index_count++] = i;
+
+	/* draw once full, there must be room for another triangle */
+	if ((ctx->immediate.index_count % 3) == 0 &&
+		(ctx->immediate.vertex_count > IA_IMMEDIATE_VERTICES - 3 ||
+		ctx->immediate.index_count > 3 * IA_IMMEDIATE_VERTICES - 3)) {
+		immediate_flush(ctx);
+	}
 }
 
 void ia_color(context *ctx, float r, float g, float b, float a)
@@ -256,7 +1802,11 @@ void ia_texcoord(context *ctx, int layer, float s, float t)
 
 void ia_end(context *ctx)
 {
+	if (!ctx->immediate.active)
+		return;
+
+	immediate_flush(ctx);
+
 	ctx->immediate.next.used = 0;
-	ctx->immediate.current = 0;
 	ctx->immediate.active = 0;
 }
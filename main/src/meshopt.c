@@ -0,0 +1,581 @@
+#include "inputassembler.h"
+#include "meshopt.h"
+#include "context.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+/* cache size used to find cluster boundaries */
+#define OPT_CACHE_SIZE 32
+
+/* attempts to find a cluster split that keeps the ACMR threshold */
+#define OPT_SPLIT_STEPS 8
+
+typedef struct {
+	float key;                      /* occlusion potential */
+	unsigned int start;             /* first triangle */
+	unsigned int end;               /* one past the last triangle */
+} cluster;
+
+static unsigned int get_index(const void *ib, int type, unsigned int i)
+{
+	switch (type) {
+	case INDEX_U8:
+		return ((const unsigned char *)ib)[i];
+	case INDEX_U32:
+		return ((const unsigned int *)ib)[i];
+	}
+
+	return ((const unsigned short *)ib)[i];
+}
+
+static void set_index(void *ib, int type, unsigned int i, unsigned int v)
+{
+	switch (type) {
+	case INDEX_U8:
+		((unsigned char *)ib)[i] = v;
+		break;
+	case INDEX_U32:
+		((unsigned int *)ib)[i] = v;
+		break;
+	default:
+		((unsigned short *)ib)[i] = v;
+		break;
+	}
+}
+
+/* copy an index buffer to an array of unsigned int, NULL if an index is
+   out of range or out of memory */
+static unsigned int *decode_indices(const void *ib, int type,
+				unsigned int indexcount,
+				unsigned int vertexcount)
+{
+	unsigned int i, *out = malloc(sizeof(unsigned int) * (indexcount + 1));
+
+	if (!out)
+		return NULL;
+
+	for (i = 0; i < indexcount; ++i) {
+		out[i] = get_index(ib, type, i);
+
+		if (out[i] >= vertexcount) {
+			free(out);
+			return NULL;
+		}
+	}
+
+	return out;
+}
+
+static void get_position(float *pos, const unsigned char *v, int format)
+{
+	const float *f = (const float *)v;
+
+	pos[0] = f[0];
+	pos[1] = f[1];
+	pos[2] = (format & VF_POSITION_F2) ? 0.0f : f[2];
+}
+
+/****************************************************************************/
+
+/* next vertex to fan around: a vertex of the last triangles that is still
+   in the cache after emitting all its remaining triangles and otherwise
+   the oldest one, or a dead end if none of them has triangles left */
+static unsigned int next_vertex(const unsigned int *live,
+				const unsigned int *stamp,
+				const unsigned int *dead, unsigned int *ndead,
+				unsigned int first, unsigned int *cursor,
+				unsigned int vertexcount, unsigned int time,
+				unsigned int cachesize)
+{
+	unsigned int i, v, p, best = UINT_MAX, bestp = 0;
+
+	for (i = first; i < *ndead; ++i) {
+		v = dead[i];
+
+		if (!live[v])
+			continue;
+
+		p = 0;
+		if ((time - stamp[v] + 2 * live[v]) <= cachesize)
+			p = time - stamp[v];
+
+		if (best == UINT_MAX || p > bestp) {
+			best = v;
+			bestp = p;
+		}
+	}
+
+	if (best != UINT_MAX)
+		return best;
+
+	while (*ndead) {
+		v = dead[--(*ndead)];
+
+		if (live[v])
+			return v;
+	}
+
+	for (; *cursor < vertexcount; ++(*cursor)) {
+		if (live[*cursor])
+			return *cursor;
+	}
+
+	return UINT_MAX;
+}
+
+int meshopt_optimize_vertex_cache(void *indices, int type,
+				unsigned int indexcount,
+				unsigned int vertexcount,
+				unsigned int cachesize)
+{
+	unsigned int *idx, *offset = NULL, *live = NULL, *adj = NULL;
+	unsigned int i, k, n = 0, t, v, f, first, time, cursor = 0;
+	unsigned int *stamp = NULL, *dead = NULL, ndead = 0;
+	unsigned char *done = NULL;
+	int ret = 0;
+
+	if (indexcount < 3)
+		return 1;
+
+	idx = decode_indices(indices, type, indexcount, vertexcount);
+	if (!idx)
+		return 0;
+
+	indexcount -= indexcount % 3;
+	offset = calloc(vertexcount + 1, sizeof(unsigned int));
+	live = calloc(vertexcount, sizeof(unsigned int));
+	stamp = calloc(vertexcount, sizeof(unsigned int));
+	adj = malloc(sizeof(unsigned int) * indexcount);
+	dead = malloc(sizeof(unsigned int) * indexcount);
+	done = calloc(indexcount / 3, 1);
+
+	if (!offset || !live || !stamp || !adj || !dead || !done)
+		goto out;
+
+	/* build the vertex to triangle adjacency */
+	for (i = 0; i < indexcount; ++i)
+		++offset[idx[i] + 1];
+
+	for (v = 0; v < vertexcount; ++v)
+		offset[v + 1] += offset[v];
+
+	for (i = 0; i < indexcount; ++i) {
+		v = idx[i];
+		adj[offset[v] + live[v]++] = i / 3;
+	}
+
+	/* emit all remaining triangles around a vertex at a time */
+	time = cachesize + 1;
+	f = idx[0];
+
+	while (f != UINT_MAX) {
+		first = ndead;
+
+		for (i = offset[f]; i < offset[f + 1]; ++i) {
+			t = adj[i];
+			if (done[t])
+				continue;
+
+			done[t] = 1;
+
+			for (k = 0; k < 3; ++k) {
+				v = idx[t * 3 + k];
+				set_index(indices, type, n++, v);
+
+				dead[ndead++] = v;
+				--live[v];
+
+				if ((time - stamp[v]) > cachesize)
+					stamp[v] = time++;
+			}
+		}
+
+		f = next_vertex(live, stamp, dead, &ndead, first, &cursor,
+				vertexcount, time, cachesize);
+	}
+
+	ret = 1;
+out:
+	free(idx);
+	free(offset);
+	free(live);
+	free(stamp);
+	free(adj);
+	free(dead);
+	free(done);
+	return ret;
+}
+
+/****************************************************************************/
+
+/* simulate a FIFO cache for one triangle, a vertex is cached if it was
+   inserted less than OPT_CACHE_SIZE misses ago */
+static unsigned int cache_misses(unsigned int *stamp, unsigned int *time,
+				const unsigned int *tri)
+{
+	unsigned int k, misses = 0;
+
+	for (k = 0; k < 3; ++k) {
+		if ((*time - stamp[tri[k]]) >= OPT_CACHE_SIZE) {
+			stamp[tri[k]] = (*time)++;
+			++misses;
+		}
+	}
+
+	return misses;
+}
+
+static int compare_clusters(const void *a, const void *b)
+{
+	const cluster *ca = a, *cb = b;
+
+	if (ca->key != cb->key)
+		return ca->key > cb->key ? -1 : 1;
+
+	return ca->start < cb->start ? -1 : 1;
+}
+
+/* split the hard clusters further while the ACMR of a part stays within
+   factor times the one of the enclosing cluster */
+static unsigned int split_clusters(const unsigned int *idx,
+				unsigned int *stamp, unsigned int *time,
+				const unsigned int *hard, unsigned int count,
+				unsigned int *start, double factor)
+{
+	unsigned int i, j, t, end, misses, m, nt;
+	double acmr;
+
+	for (i = 0, j = 0; i < count; ++i) {
+		end = hard[i + 1];
+
+		*time += OPT_CACHE_SIZE;
+		for (t = hard[i], misses = 0; t < end; ++t)
+			misses += cache_misses(stamp, time, idx + t * 3);
+
+		acmr = (double)misses / (double)(end - hard[i]);
+
+		start[j++] = hard[i];
+		*time += OPT_CACHE_SIZE;
+
+		for (t = hard[i], m = 0, nt = 0; t < end; ++t) {
+			m += cache_misses(stamp, time, idx + t * 3);
+			++nt;
+
+			if ((t + 1) < end &&
+				(double)m <= (double)nt * acmr * factor) {
+				start[j++] = t + 1;
+				*time += OPT_CACHE_SIZE;
+				m = nt = 0;
+			}
+		}
+	}
+
+	start[j] = hard[count];
+	return j;
+}
+
+/* occlusion potential, clusters facing away from the mesh center are
+   likely to occlude the others and are drawn first */
+static void sort_clusters(cluster *clusters, const unsigned int *start,
+			unsigned int count, const unsigned int *idx,
+			const unsigned char *vb, int format,
+			unsigned int vsize, const float (*center)[4],
+			const float *mc)
+{
+	float p[3][3], e0[3], e1[3], n[3], c[3], len, w;
+	unsigned int i, k, t;
+
+	for (i = 0; i < count; ++i) {
+		c[0] = c[1] = c[2] = 0.0f;
+		n[0] = n[1] = n[2] = 0.0f;
+		w = 0.0f;
+
+		for (t = start[i]; t < start[i + 1]; ++t) {
+			for (k = 0; k < 3; ++k) {
+				get_position(p[k], vb + idx[t * 3 + k] * vsize,
+						format);
+			}
+
+			for (k = 0; k < 3; ++k) {
+				e0[k] = p[1][k] - p[0][k];
+				e1[k] = p[2][k] - p[0][k];
+				c[k] += center[t][k] * center[t][3];
+			}
+
+			n[0] += e0[1] * e1[2] - e0[2] * e1[1];
+			n[1] += e0[2] * e1[0] - e0[0] * e1[2];
+			n[2] += e0[0] * e1[1] - e0[1] * e1[0];
+			w += center[t][3];
+		}
+
+		len = (float)sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+		clusters[i].key = 0.0f;
+		clusters[i].start = start[i];
+		clusters[i].end = start[i + 1];
+
+		if (w > 0.0f && len > 0.0f) {
+			for (k = 0; k < 3; ++k) {
+				clusters[i].key += (c[k] / w - mc[k]) *
+							n[k] / len;
+			}
+		}
+	}
+
+	qsort(clusters, count, sizeof(cluster), compare_clusters);
+}
+
+/* cache misses when drawing the clusters in order */
+static unsigned long order_misses(const cluster *clusters,
+				unsigned int count, const unsigned int *idx,
+				unsigned int *stamp, unsigned int *time)
+{
+	unsigned long misses = 0;
+	unsigned int i, t;
+
+	*time += OPT_CACHE_SIZE;
+
+	for (i = 0; i < count; ++i) {
+		for (t = clusters[i].start; t < clusters[i].end; ++t)
+			misses += cache_misses(stamp, time, idx + t * 3);
+	}
+
+	return misses;
+}
+
+int meshopt_optimize_overdraw(void *indices, int type,
+			unsigned int indexcount, const void *vertices,
+			int format, unsigned int vertexcount,
+			float threshold)
+{
+	float p[3][3], e0[3], e1[3], n[3], mc[3], w;
+	unsigned int i, j, k, t, tris, count = 0, nhard, time;
+	unsigned int *idx, *stamp = NULL, *start = NULL, *hard = NULL;
+	const unsigned char *vb = vertices;
+	double factor, best, lo, hi;
+	cluster *clusters = NULL;
+	float (*center)[4] = NULL;
+	unsigned long budget, misses;
+	unsigned int vsize;
+	int ret = 0;
+
+	tris = indexcount / 3;
+	if (!tris)
+		return 1;
+
+	idx = decode_indices(indices, type, indexcount, vertexcount);
+	if (!idx)
+		return 0;
+
+	stamp = calloc(vertexcount, sizeof(unsigned int));
+	start = malloc(sizeof(unsigned int) * (tris + 1));
+	hard = malloc(sizeof(unsigned int) * (tris + 1));
+	center = malloc(sizeof(center[0]) * tris);
+	clusters = malloc(sizeof(cluster) * tris);
+
+	if (!stamp || !start || !hard || !center || !clusters)
+		goto out;
+
+	vsize = ia_vertex_size(format);
+
+	/* hard boundaries, where a triangle misses the cache three times,
+	   the first cluster always starts at the first triangle */
+	time = OPT_CACHE_SIZE;
+	hard[count++] = 0;
+	budget = 0;
+
+	for (t = 0; t < tris; ++t) {
+		k = cache_misses(stamp, &time, idx + t * 3);
+		budget += k;
+
+		if (k == 3 && t > 0)
+			hard[count++] = t;
+	}
+
+	nhard = count;
+	hard[nhard] = tris;
+	budget = (unsigned long)((double)budget * threshold);
+
+	/* area weighted triangle centers and normals */
+	mc[0] = mc[1] = mc[2] = 0.0f;
+
+	for (t = 0; t < tris; ++t) {
+		for (k = 0; k < 3; ++k)
+			get_position(p[k], vb + idx[t * 3 + k] * vsize, format);
+
+		for (k = 0; k < 3; ++k) {
+			e0[k] = p[1][k] - p[0][k];
+			e1[k] = p[2][k] - p[0][k];
+		}
+
+		n[0] = e0[1] * e1[2] - e0[2] * e1[1];
+		n[1] = e0[2] * e1[0] - e0[0] * e1[2];
+		n[2] = e0[0] * e1[1] - e0[1] * e1[0];
+		w = (float)sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+		for (k = 0; k < 3; ++k) {
+			center[t][k] = (p[0][k] + p[1][k] + p[2][k]) / 3.0f;
+			mc[k] += center[t][k] * w;
+		}
+
+		center[t][3] = w;
+	}
+
+	for (t = 0, w = 0.0f; t < tris; ++t)
+		w += center[t][3];
+
+	for (k = 0; k < 3; ++k)
+		mc[k] = w > 0.0f ? mc[k] / w : 0.0f;
+
+	/* every cluster restarts the cache, so splitting with the threshold
+	   itself can exceed it. Search for the largest split factor whose
+	   order stays within the threshold times the misses of the input */
+	best = -1.0;
+	lo = 0.0;
+	hi = threshold;
+	factor = threshold;
+
+	for (i = 0; i < OPT_SPLIT_STEPS; ++i) {
+		count = split_clusters(idx, stamp, &time, hard, nhard,
+					start, factor);
+		sort_clusters(clusters, start, count, idx, vb, format, vsize,
+				(const float (*)[4])center, mc);
+
+		misses = order_misses(clusters, count, idx, stamp, &time);
+
+		if (misses <= budget) {
+			best = factor;
+			lo = factor;
+
+			if (factor >= threshold)
+				break;
+		} else {
+			hi = factor;
+		}
+
+		factor = (lo + hi) * 0.5;
+	}
+
+	/* only sort the hard clusters, or keep the order if even that
+	   does not work out */
+	if (best < 0.0) {
+		memcpy(start, hard, sizeof(unsigned int) * (nhard + 1));
+		count = nhard;
+		sort_clusters(clusters, start, count, idx, vb, format, vsize,
+				(const float (*)[4])center, mc);
+
+		misses = order_misses(clusters, count, idx, stamp, &time);
+
+		if (misses > budget) {
+			ret = 1;
+			goto out;
+		}
+	} else if (best != factor) {
+		count = split_clusters(idx, stamp, &time, hard, nhard,
+					start, best);
+		sort_clusters(clusters, start, count, idx, vb, format, vsize,
+				(const float (*)[4])center, mc);
+	}
+
+	for (i = 0, j = 0; i < count; ++i) {
+		for (t = clusters[i].start; t < clusters[i].end; ++t) {
+			for (k = 0; k < 3; ++k)
+				set_index(indices, type, j++, idx[t * 3 + k]);
+		}
+	}
+
+	ret = 1;
+out:
+	free(idx);
+	free(stamp);
+	free(start);
+	free(hard);
+	free(center);
+	free(clusters);
+	return ret;
+}
+
+/****************************************************************************/
+
+unsigned int meshopt_optimize_vertex_fetch(void *vertices, int format,
+					unsigned int vertexcount,
+					void *indices, int type,
+					unsigned int indexcount)
+{
+	unsigned int i, v, used, next = 0, *remap, vsize;
+	unsigned char *vb = vertices, *temp;
+
+	vsize = ia_vertex_size(format);
+	remap = malloc(sizeof(unsigned int) * vertexcount);
+	temp = malloc(vsize * vertexcount);
+
+	if (!remap || !temp) {
+		free(remap);
+		free(temp);
+		return 0;
+	}
+
+	memset(remap, 0xFF, sizeof(unsigned int) * vertexcount);
+
+	for (i = 0; i < indexcount; ++i) {
+		v = get_index(indices, type, i);
+
+		if (v >= vertexcount)
+			continue;
+
+		if (remap[v] == UINT_MAX)
+			remap[v] = next++;
+
+		set_index(indices, type, i, remap[v]);
+	}
+
+	used = next;
+
+	for (v = 0; v < vertexcount; ++v) {
+		if (remap[v] == UINT_MAX)
+			remap[v] = next++;
+
+		memcpy(temp + remap[v] * vsize, vb + v * vsize, vsize);
+	}
+
+	memcpy(vb, temp, vsize * vertexcount);
+
+	free(remap);
+	free(temp);
+	return used;
+}
+
+double meshopt_compute_acmr(const void *indices, int type,
+			unsigned int indexcount, unsigned int cachesize)
+{
+	unsigned int i, v, max = 0, time, misses = 0, *stamp;
+
+	if (indexcount < 3)
+		return 0.0;
+
+	for (i = 0; i < indexcount; ++i) {
+		v = get_index(indices, type, i);
+		max = v > max ? v : max;
+	}
+
+	stamp = calloc(max + 1, sizeof(unsigned int));
+	if (!stamp)
+		return -1.0;
+
+	time = cachesize;
+
+	for (i = 0; i < (indexcount - indexcount % 3); ++i) {
+		v = get_index(indices, type, i);
+
+		if ((time - stamp[v]) >= cachesize) {
+			stamp[v] = time++;
+			++misses;
+		}
+	}
+
+	free(stamp);
+	return (double)misses / (double)(indexcount / 3);
+}
@@ -6,6 +6,13 @@
 #include "color.h"
 #include <math.h>
 
+/* w > 0, near, far and the four sides of the guard band */
+#define CLIP_PLANES 7
+
+#define MIN3(a, b, c) ((a) < (b) ? ((a) < (c) ? (a) : (c)) : \
+			((b) < (c) ? (b) : (c)))
+#define MAX3(a, b, c) ((a) > (b) ? ((a) > (c) ? (a) : (c)) : \
+			((b) > (c) ? (b) : (c)))
 
 typedef struct {
 	int left;                       /* index of left edge */
@@ -19,6 +26,11 @@ typedef struct {
 	} edge[2];
 } edge_data;
 
+typedef struct {
+	vec4 n;                     /* inside if dot(n, position) + d >= 0 */
+	float d;
+} clip_plane;
+
 typedef struct {
 	float pixelscale;           /* 1.0/dx */
 
@@ -58,32 +70,81 @@ static void scaled_vertex_add(rs_vertex *V, const rs_vertex *A,
 	}
 }
 
-static void write_fragment(const context *ctx, const color4 frag_color,
-			   float frag_depth, color4 *color_buffer,
-			   float *depth_buffer)
+/* fragment write kernels, one per combination of color write mode and
+   depth write, so that the state is only looked at once per triangle */
+#define WRITE_KERNEL(name, color, depth) \
+static void name(const context *ctx, const color4 frag_color, \
+		float frag_depth, color4 *color_buffer, float *depth_buffer) \
+{ \
+	color4 new; \
+	(void)ctx; (void)frag_color; (void)frag_depth; \
+	(void)color_buffer; (void)depth_buffer; (void)new; \
+	color; \
+	depth; \
+}
+
+#define WRITE_NONE
+#define WRITE_REPLACE color_buffer->ui = frag_color.ui
+#define WRITE_MASK \
+	color_buffer->ui &= ~ctx->colormask.ui; \
+	color_buffer->ui |= frag_color.ui & ctx->colormask.ui
+#define WRITE_BLEND \
+	new = color_blend(*color_buffer, frag_color); \
+	color_buffer->ui &= ~ctx->colormask.ui; \
+	color_buffer->ui |= new.ui & ctx->colormask.ui
+#define WRITE_DEPTH *depth_buffer = frag_depth
+
+WRITE_KERNEL(write_none, WRITE_NONE, WRITE_NONE)
+WRITE_KERNEL(write_replace, WRITE_REPLACE, WRITE_NONE)
+WRITE_KERNEL(write_mask, WRITE_MASK, WRITE_NONE)
+WRITE_KERNEL(write_blend, WRITE_BLEND, WRITE_NONE)
+WRITE_KERNEL(write_depth, WRITE_NONE, WRITE_DEPTH)
+WRITE_KERNEL(write_replace_depth, WRITE_REPLACE, WRITE_DEPTH)
+WRITE_KERNEL(write_mask_depth, WRITE_MASK, WRITE_DEPTH)
+WRITE_KERNEL(write_blend_depth, WRITE_BLEND, WRITE_DEPTH)
+
+/* indexed by the color write mode and whether depth is written */
+static void (*const write_kernels[4][2])(const context *, const color4,
+					float, color4 *, float *) = {
+	{ write_none, write_depth },
+	{ write_replace, write_replace_depth },
+	{ write_mask, write_mask_depth },
+	{ write_blend, write_blend_depth },
+};
+
+static void select_write_kernel(context *ctx)
 {
-	color4 new;
+	int mode;
+
+	if (!ctx->colormask.ui) {
+		mode = 0;
+	} else if (ctx->flags & BLEND_ENABLE) {
+		mode = 3;
+	} else {
+		mode = ctx->colormask.ui == 0xFFFFFFFF ? 1 : 2;
+	}
 
-	if (ctx->colormask.ui) {
-		if (ctx->flags & BLEND_ENABLE) {
-			new = color_blend(*color_buffer, frag_color);
-		} else {
-			new = frag_color;
-		}
+	ctx->derived.write_fragment =
+		write_kernels[mode][(ctx->flags & DEPTH_WRITE) != 0];
+}
 
-		color_buffer->ui &= ~ctx->colormask.ui;
-		color_buffer->ui |= new.ui & ctx->colormask.ui;
-	}
+static vec4 viewport_map(const context *ctx, vec4 v, float w)
+{
+	float d = (1.0f - v.z) * 0.5f;
 
-	if (ctx->flags & DEPTH_WRITE)
-		*depth_buffer = frag_depth;
+	v.x = (1.0f + v.x) * 0.5f * (float)ctx->viewport.width +
+		ctx->viewport.x;
+	v.y = (1.0f - v.y) * 0.5f * (float)ctx->viewport.height +
+		ctx->viewport.y;
+	v.z = d*ctx->depth_far + (1.0f - d)*ctx->depth_near;
+	v.w = w;
+	return v;
 }
 
 static void vertex_prepare(rs_vertex *out, const rs_vertex *in, context *ctx)
 {
-	float d, w = 1.0f / in->attribs[ATTRIB_POS].w;
+	float w = 1.0f / in->attribs[ATTRIB_POS].w;
 	int i, j;
-	vec4 v;
 
 	/* perspective divide of attributes */
 	for (i = 0, j = 0x01; i < ATTRIB_COUNT; ++i, j <<= 1) {
@@ -91,18 +152,8 @@ static void vertex_prepare(rs_vertex *out, const rs_vertex *in, context *ctx)
 			out->attribs[i] = vec4_scale(in->attribs[i], w);
 	}
 
-	/* viewport mapping */
-	v = out->attribs[ATTRIB_POS];
-	d = (1.0f - v.z) * 0.5f;
-
-	v.x = (1.0f + v.x) * 0.5f * (float)ctx->viewport.width +
-		ctx->viewport.x;
-	v.y = (1.0f - v.y) * 0.5f * (float)ctx->viewport.height +
-		ctx->viewport.y;
-	v.z = d*ctx->depth_far + (1.0f - d)*ctx->depth_near;
-	v.w = w;
-
-	out->attribs[ATTRIB_POS] = v;
+	out->attribs[ATTRIB_POS] = viewport_map(ctx, out->attribs[ATTRIB_POS],
+						w);
 	out->used = in->used;
 }
 
@@ -150,14 +201,125 @@ static int cull(const context *ctx, const vec4 A, const vec4 B, const vec4 C)
 	return (ccw && cullccw) || (!ccw && cullcw);
 }
 
+static void mark_dirty(context *ctx, const vec4 A, const vec4 B, const vec4 C)
+{
+	float minx, miny, maxx, maxy;
+
+	minx = A.x < B.x ? (A.x < C.x ? A.x : C.x) : (B.x < C.x ? B.x : C.x);
+	miny = A.y < B.y ? (A.y < C.y ? A.y : C.y) : (B.y < C.y ? B.y : C.y);
+	maxx = A.x > B.x ? (A.x > C.x ? A.x : C.x) : (B.x > C.x ? B.x : C.x);
+	maxy = A.y > B.y ? (A.y > C.y ? A.y : C.y) : (B.y > C.y ? B.y : C.y);
+
+	minx = minx < ctx->draw_area.minx ? ctx->draw_area.minx : floor(minx);
+	miny = miny < ctx->draw_area.miny ? ctx->draw_area.miny : floor(miny);
+	maxx = maxx > ctx->draw_area.maxx ? ctx->draw_area.maxx : ceil(maxx);
+	maxy = maxy > ctx->draw_area.maxy ? ctx->draw_area.maxy : ceil(maxy);
+
+	framebuffer_mark_dirty(ctx->target, minx, miny, maxx, maxy);
+}
+
+/* depth test, shade and write a fragment from interpolated attributes
+   that are still divided by w */
+static void shade_fragment(context *ctx, const rs_vertex *v,
+			color4 *color_buffer, float *depth_buffer)
+{
+	float z = v->attribs[ATTRIB_POS].z, w;
+	rs_vertex frag;
+	int i, j;
+	color4 c;
+
+	if (!depth_test(ctx, z, *depth_buffer))
+		return;
+
+	/* calculate interpolated attributes */
+	w = 1.0f / v->attribs[ATTRIB_POS].w;
+	frag.used = v->used;
+
+	for (i = 0, j = 0x01; i < ATTRIB_COUNT; ++i, j <<= 1) {
+		if (frag.used & j)
+			frag.attribs[i] = vec4_scale(v->attribs[i], w);
+	}
+
+	c = color_from_vec(ctx->shader->fragment(ctx->shader, ctx, &frag));
+
+	ctx->derived.write_fragment(ctx, c, z, color_buffer, depth_buffer);
+}
+
+/* shade count fragments starting at v and stepping by dvdx, through the
+   span entry point of the shader if it has one */
+static void shade_span(context *ctx, const rs_vertex *v, const rs_vertex *dvdx,
+			int count, color4 *color_buffer, float *depth_buffer)
+{
+	const shader_program *prog = ctx->shader;
+	int i, j, k, n, chunk, offset[SHADER_SPAN_SIZE];
+	color4 colors[SHADER_SPAN_SIZE];
+	float w, z[SHADER_SPAN_SIZE];
+	unsigned int discard;
+	rs_fragment_batch b;
+	rs_vertex l = *v;
+
+	if (!prog->fragment_span) {
+		for (i = 0; i < count; ++i) {
+			shade_fragment(ctx, &l, color_buffer++,
+					depth_buffer++);
+			scaled_vertex_add(&l, &l, dvdx, 1.0f);
+		}
+		return;
+	}
+
+	b.used = l.used;
+
+	for (; count > 0; count -= chunk) {
+		chunk = count < SHADER_SPAN_SIZE ? count : SHADER_SPAN_SIZE;
+
+		/* gather the fragments that pass the depth test */
+		for (i = 0, n = 0; i < chunk; ++i) {
+			z[n] = l.attribs[ATTRIB_POS].z;
+
+			if (depth_test(ctx, z[n], depth_buffer[i])) {
+				w = 1.0f / l.attribs[ATTRIB_POS].w;
+
+				for (j = 0, k = 0x01; j < ATTRIB_COUNT;
+					++j, k <<= 1) {
+					if (!(b.used & k))
+						continue;
+					b.attribs[j][0][n] = l.attribs[j].x * w;
+					b.attribs[j][1][n] = l.attribs[j].y * w;
+					b.attribs[j][2][n] = l.attribs[j].z * w;
+					b.attribs[j][3][n] = l.attribs[j].w * w;
+				}
+
+				offset[n++] = i;
+			}
+
+			scaled_vertex_add(&l, &l, dvdx, 1.0f);
+		}
+
+		if (n) {
+			b.count = n;
+			discard = prog->fragment_span(prog, ctx, &b, colors);
+
+			for (i = 0; i < n; ++i) {
+				if (discard & (1u << i))
+					continue;
+
+				ctx->derived.write_fragment(ctx, colors[i],
+						z[i], color_buffer + offset[i],
+						depth_buffer + offset[i]);
+			}
+		}
+
+		color_buffer += chunk;
+		depth_buffer += chunk;
+	}
+}
+
 static void draw_scanline(int y, context *ctx, const edge_data *s)
 {
-	float sub_pixel, z, w, *z_buffer;
+	float sub_pixel, *z_buffer;
 	color4 *start, *end;
-	int x0, x1, i, j;
-	rs_vertex frag;
 	scan_line l;
-	color4 c;
+	int x0, x1;
 
 	/* get line start and end */
 	x0 = ceil(s->edge[s->left].v.attribs[ATTRIB_POS].x);
@@ -191,32 +353,7 @@ static void draw_scanline(int y, context *ctx, const edge_data *s)
 	start = ctx->target->color + y * ctx->target->width + x0;
 	end = ctx->target->color + y * ctx->target->width + x1;
 
-	/* for each fragment */
-	while (start != end && x0 <= ctx->draw_area.maxx) {
-		z = l.v.attribs[ATTRIB_POS].z;
-
-		if (!depth_test(ctx, z, *z_buffer))
-			goto skip_fragment;
-
-		/* calculate interpolated attributes */
-		w = 1.0f / l.v.attribs[ATTRIB_POS].w;
-		frag.used = l.v.used;
-
-		for (i = 0, j = 0x01; i < ATTRIB_COUNT; ++i, j <<= 1) {
-			if (frag.used & j)
-				frag.attribs[i] = vec4_scale(l.v.attribs[i],w);
-		}
-
-		c = color_from_vec(ctx->shader->fragment(ctx->shader, ctx,
-							&frag));
-
-		write_fragment(ctx, c, z, start, z_buffer);
-	skip_fragment:
-		scaled_vertex_add(&l.v, &l.v, &l.dvdx, 1.0f);
-		++start;
-		++z_buffer;
-		++x0;
-	}
+	shade_span(ctx, &l.v, &l.dvdx, end - start, start, z_buffer);
 }
 
 static void advance_line(edge_data *s, float scale)
@@ -308,67 +445,348 @@ static void draw_triangle(const rs_vertex *A, const rs_vertex *B,
 	}
 }
 
-void rasterizer_process_triangle(context *ctx, const rs_vertex *v0,
-				const rs_vertex *v1, const rs_vertex *v2)
+/* homogeneous clip planes: w > 0, the near and far plane if depth values
+   are clipped and a guard band around the viewport */
+static int clip_planes(const context *ctx, clip_plane *plane)
+{
+	float w = (float)ctx->viewport.width, x = (float)ctx->viewport.x;
+	float h = (float)ctx->viewport.height, y = (float)ctx->viewport.y;
+	float g = GUARD_BAND;
+	int n = 0;
+
+	plane[n].n = vec4_set(0.0f, 0.0f, 0.0f, 1.0f);
+	plane[n++].d = -CLIP_MIN_W;
+
+	if (ctx->flags & DEPTH_CLIP) {
+		plane[n].n = vec4_set(0.0f, 0.0f, 1.0f, 1.0f);
+		plane[n++].d = 0.0f;
+		plane[n].n = vec4_set(0.0f, 0.0f, -1.0f, 1.0f);
+		plane[n++].d = 0.0f;
+	}
+
+	/* screen space x >= -g, x <= g, y >= -g and y <= g */
+	plane[n].n = vec4_set(w, 0.0f, 0.0f, w + 2.0f * (g + x));
+	plane[n++].d = 0.0f;
+	plane[n].n = vec4_set(-w, 0.0f, 0.0f, 2.0f * (g - x) - w);
+	plane[n++].d = 0.0f;
+	plane[n].n = vec4_set(0.0f, -h, 0.0f, h + 2.0f * (g + y));
+	plane[n++].d = 0.0f;
+	plane[n].n = vec4_set(0.0f, h, 0.0f, 2.0f * (g - y) - h);
+	plane[n++].d = 0.0f;
+
+	return n;
+}
+
+/* bit i is set if a position is outside of plane i */
+static int outcode(const clip_plane *plane, int count, const vec4 p)
+{
+	int i, code = 0;
+
+	for (i = 0; i < count; ++i) {
+		if ((vec4_dot(plane[i].n, p) + plane[i].d) < 0.0f)
+			code |= 1 << i;
+	}
+
+	return code;
+}
+
+/* clip a convex polygon against a plane, returns the new vertex count */
+static int clip_polygon(const clip_plane *plane, const rs_vertex *in,
+			int count, rs_vertex *out)
+{
+	const rs_vertex *a, *b, *from, *to;
+	float da, db, t;
+	int i, j, k, n = 0;
+
+	for (i = 0; i < count; ++i) {
+		a = in + i;
+		b = in + (i + 1) % count;
+
+		da = vec4_dot(plane->n, a->attribs[ATTRIB_POS]) + plane->d;
+		db = vec4_dot(plane->n, b->attribs[ATTRIB_POS]) + plane->d;
+
+		if (da >= 0.0f)
+			out[n++] = *a;
+
+		if ((da >= 0.0f) == (db >= 0.0f))
+			continue;
+
+		/* always interpolate from the inside vertex, so that an edge
+		   shared by two triangles is split at the same point */
+		from = da >= 0.0f ? a : b;
+		to = da >= 0.0f ? b : a;
+		t = da >= 0.0f ? da / (da - db) : db / (db - da);
+
+		out[n].used = from->used & to->used;
+
+		for (j = 0, k = 0x01; j < ATTRIB_COUNT; ++j, k <<= 1) {
+			if (!(out[n].used & k))
+				continue;
+
+			out[n].attribs[j] = vec4_add(from->attribs[j],
+					vec4_scale(vec4_sub(to->attribs[j],
+							from->attribs[j]), t));
+		}
+
+		++n;
+	}
+
+	return n;
+}
+
+/* the screen space position of a clip space position, as computed by
+   vertex_prepare */
+static vec4 screen_pos(const context *ctx, const vec4 p)
+{
+	float w = 1.0f / p.w;
+
+	return viewport_map(ctx, vec4_scale(p, w), w);
+}
+
+/* x coordinate of the edge from a to b at a given y */
+static float edge_x(const vec4 a, const vec4 b, float y)
+{
+	return a.x + (y - a.y) * ((b.x - a.x) / (b.y - a.y));
+}
+
+/* rasterize a triangle covering at most SMALL_TRIANGLE_SIZE rows and
+   columns of samples, given sorted on the Y axis with the screen space
+   positions and the clamped range of candidate samples. The samples are
+   tested directly and the attributes are only computed for rows that
+   cover samples, from plane equations. */
+static void draw_small_triangle(context *ctx, const rs_vertex *v0,
+				const rs_vertex *v1, const rs_vertex *v2,
+				const vec4 *p, int x0, int y0, int x1, int y1)
+{
+	int i, j, y, n, xs[SMALL_TRIANGLE_SIZE], xe[SMALL_TRIANGLE_SIZE];
+	vec4 a = p[0], b = p[1], c = p[2], dba, dca;
+	rs_vertex A, B, C, ddx, ddy, v;
+	float major, minor, area, *z_buffer;
+	color4 *color_buffer;
+
+	/* coverage: the left edge is inclusive, the right one exclusive */
+	for (y = y0, n = 0; y < y1; ++y) {
+		major = edge_x(a, c, (float)y);
+		minor = (float)y < b.y ? edge_x(a, b, (float)y) :
+					edge_x(b, c, (float)y);
+
+		i = y - y0;
+		xs[i] = ceil(major < minor ? major : minor);
+		xe[i] = ceil(major < minor ? minor : major);
+
+		xs[i] = xs[i] < x0 ? x0 : xs[i];
+		xe[i] = xe[i] > x1 ? x1 : xe[i];
+
+		if (xs[i] < xe[i])
+			++n;
+	}
+
+	area = (b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y);
+
+	if (!n || area == 0.0f)
+		return;
+
+	if (ctx->colormask.ui)
+		mark_dirty(ctx, a, b, c);
+
+	vertex_prepare(&A, v0, ctx);
+	vertex_prepare(&B, v1, ctx);
+	vertex_prepare(&C, v2, ctx);
+
+	/* attribute gradients along x and y */
+	ddx.used = ddy.used = A.used & B.used & C.used;
+
+	for (i = 0, j = 0x01; i < ATTRIB_COUNT; ++i, j <<= 1) {
+		if (!(ddx.used & j))
+			continue;
+
+		dba = vec4_sub(B.attribs[i], A.attribs[i]);
+		dca = vec4_sub(C.attribs[i], A.attribs[i]);
+
+		ddx.attribs[i] = vec4_scale(vec4_sub(vec4_scale(dba, c.y - a.y),
+						vec4_scale(dca, b.y - a.y)),
+					1.0f / area);
+		ddy.attribs[i] = vec4_scale(vec4_sub(vec4_scale(dca, b.x - a.x),
+						vec4_scale(dba, c.x - a.x)),
+					1.0f / area);
+	}
+
+	for (y = y0; y < y1; ++y) {
+		i = y - y0;
+
+		if (xs[i] >= xe[i])
+			continue;
+
+		scaled_vertex_add(&v, &A, &ddy, (float)y - a.y);
+		scaled_vertex_add(&v, &v, &ddx, (float)xs[i] - a.x);
+
+		color_buffer = ctx->target->color +
+				y * ctx->target->width + xs[i];
+		z_buffer = ctx->target->depth + y * ctx->target->width + xs[i];
+
+		shade_span(ctx, &v, &ddx, xe[i] - xs[i], color_buffer,
+			z_buffer);
+	}
+}
+
+static void setup_triangle(context *ctx, const rs_vertex *v0,
+			const rs_vertex *v1, const rs_vertex *v2)
 {
 	const rs_vertex *temp_v;
+	int x0, y0, x1, y1;
 	rs_vertex A, B, C;
+	vec4 p[3], temp_p;
 
-	if ((ctx->flags & CULL_FRONT) && (ctx->flags & CULL_BACK))
-		return;
+	/* work on the positions only until the triangle is known to cover
+	   any samples */
+	p[0] = screen_pos(ctx, v0->attribs[ATTRIB_POS]);
+	p[1] = screen_pos(ctx, v1->attribs[ATTRIB_POS]);
+	p[2] = screen_pos(ctx, v2->attribs[ATTRIB_POS]);
 
-	if ((ctx->flags & DEPTH_TEST) && ctx->depth_test == COMPARE_NEVER)
+	/* clipping */
+	if (clip(ctx, p[0], p[1], p[2]))
 		return;
 
-	if (v0->attribs[ATTRIB_POS].w <= 0.0f ||
-		v1->attribs[ATTRIB_POS].w <= 0.0f ||
-		v2->attribs[ATTRIB_POS].w <= 0.0f) {
+	/* culling */
+	if (cull(ctx, p[0], p[1], p[2]))
 		return;
+
+	/* sort on Y axis */
+	if (p[0].y > p[1].y) {
+		temp_v = v0; v0 = v1; v1 = temp_v;
+		temp_p = p[0]; p[0] = p[1]; p[1] = temp_p;
+	}
+	if (p[1].y > p[2].y) {
+		temp_v = v1; v1 = v2; v2 = temp_v;
+		temp_p = p[1]; p[1] = p[2]; p[2] = temp_p;
+	}
+	if (p[0].y > p[1].y) {
+		temp_v = v0; v0 = v1; v1 = temp_v;
+		temp_p = p[0]; p[0] = p[1]; p[1] = temp_p;
 	}
 
-	if (ctx->draw_area.minx >= ctx->draw_area.maxx ||
-		ctx->draw_area.miny >= ctx->draw_area.maxy) {
+	/* range of candidate samples, clamped like the scanlines */
+	x0 = ceil(MIN3(p[0].x, p[1].x, p[2].x));
+	x1 = ceil(MAX3(p[0].x, p[1].x, p[2].x));
+	y0 = ceil(p[0].y);
+	y1 = ceil(p[2].y);
+
+	x0 = x0 < ctx->draw_area.minx ? ctx->draw_area.minx : x0;
+	y0 = y0 < ctx->draw_area.miny ? ctx->draw_area.miny : y0;
+	x1 = x1 > ctx->draw_area.maxx ? ctx->draw_area.maxx : x1;
+	y1 = y1 > ctx->draw_area.maxy ? ctx->draw_area.maxy + 1 : y1;
+
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	if ((x1 - x0) <= SMALL_TRIANGLE_SIZE &&
+		(y1 - y0) <= SMALL_TRIANGLE_SIZE) {
+		draw_small_triangle(ctx, v0, v1, v2, p, x0, y0, x1, y1);
 		return;
 	}
 
+	/* track the modified region of the color buffer */
+	if (ctx->colormask.ui)
+		mark_dirty(ctx, p[0], p[1], p[2]);
+
 	/* prepare vertices */
 	vertex_prepare(&A, v0, ctx);
 	vertex_prepare(&B, v1, ctx);
 	vertex_prepare(&C, v2, ctx);
 
-	/* clipping */
-	if (clip(ctx, A.attribs[ATTRIB_POS], B.attribs[ATTRIB_POS],
-			C.attribs[ATTRIB_POS])) {
+	/* draw */
+	draw_triangle(&A, &B, &C, ctx);
+}
+
+int rasterizer_triangle_visible(const context *ctx, vec4 p0, vec4 p1,
+				vec4 p2)
+{
+	clip_plane plane[CLIP_PLANES];
+	int n, c0, c1, c2;
+
+	if ((ctx->flags & CULL_FRONT) && (ctx->flags & CULL_BACK))
+		return 0;
+
+	if ((ctx->flags & DEPTH_TEST) && ctx->depth_test == COMPARE_NEVER)
+		return 0;
+
+	if (ctx->draw_area.minx >= ctx->draw_area.maxx ||
+		ctx->draw_area.miny >= ctx->draw_area.maxy) {
+		return 0;
+	}
+
+	/* triangles that have to be clipped are only rejected if all
+	   vertices are outside the same plane */
+	n = clip_planes(ctx, plane);
+	c0 = outcode(plane, n, p0);
+	c1 = outcode(plane, n, p1);
+	c2 = outcode(plane, n, p2);
+
+	if (c0 | c1 | c2)
+		return !(c0 & c1 & c2);
+
+	p0 = screen_pos(ctx, p0);
+	p1 = screen_pos(ctx, p1);
+	p2 = screen_pos(ctx, p2);
+
+	return !clip(ctx, p0, p1, p2) && !cull(ctx, p0, p1, p2);
+}
+
+void rasterizer_process_triangle(context *ctx, const rs_vertex *v0,
+				const rs_vertex *v1, const rs_vertex *v2)
+{
+	rs_vertex poly[2][CLIP_PLANES + 3];
+	clip_plane plane[CLIP_PLANES];
+	int i, n, count, c0, c1, c2, cur = 0;
+
+	if ((ctx->flags & CULL_FRONT) && (ctx->flags & CULL_BACK))
+		return;
+
+	/* cheap enough to do per triangle, so the depth test and the write
+	   kernel are up to date for callers that do not go through the
+	   input assembler */
+	ctx->derived.depth_func = depth_func(ctx);
+	select_write_kernel(ctx);
+
+	if (ctx->derived.depth_func == COMPARE_NEVER ||
+		ctx->derived.write_fragment == write_none) {
 		return;
 	}
 
-	/* culling */
-	if (cull(ctx, A.attribs[ATTRIB_POS], B.attribs[ATTRIB_POS],
-			C.attribs[ATTRIB_POS])) {
+	if (ctx->draw_area.minx >= ctx->draw_area.maxx ||
+		ctx->draw_area.miny >= ctx->draw_area.maxy) {
 		return;
 	}
 
-	/* sort on Y axis */
-	v0 = &A;
-	v1 = &B;
-	v2 = &C;
+	n = clip_planes(ctx, plane);
+	c0 = outcode(plane, n, v0->attribs[ATTRIB_POS]);
+	c1 = outcode(plane, n, v1->attribs[ATTRIB_POS]);
+	c2 = outcode(plane, n, v2->attribs[ATTRIB_POS]);
 
-	if (v0->attribs[ATTRIB_POS].y > v1->attribs[ATTRIB_POS].y) {
-		temp_v = v0;
-		v0 = v1;
-		v1 = temp_v;
-	}
-	if (v1->attribs[ATTRIB_POS].y > v2->attribs[ATTRIB_POS].y) {
-		temp_v = v1;
-		v1 = v2;
-		v2 = temp_v;
+	if (!(c0 | c1 | c2)) {
+		setup_triangle(ctx, v0, v1, v2);
+		return;
 	}
-	if (v0->attribs[ATTRIB_POS].y > v1->attribs[ATTRIB_POS].y) {
-		temp_v = v0;
-		v0 = v1;
-		v1 = temp_v;
+
+	if (c0 & c1 & c2)
+		return;
+
+	/* clip against the planes that are crossed, draw the result as fan */
+	poly[0][0] = *v0;
+	poly[0][1] = *v1;
+	poly[0][2] = *v2;
+	count = 3;
+
+	for (i = 0; i < n && count >= 3; ++i) {
+		if ((c0 | c1 | c2) & (1 << i)) {
+			count = clip_polygon(plane + i, poly[cur], count,
+					poly[!cur]);
+			cur = !cur;
+		}
 	}
 
-	/* draw */
-	draw_triangle(v0, v1, v2, ctx);
+	for (i = 2; i < count; ++i) {
+		setup_triangle(ctx, poly[cur], poly[cur] + i - 1,
+				poly[cur] + i);
+	}
 }
@@ -6,6 +6,13 @@
 #include <math.h>
 #include <stddef.h>
 
+#ifdef __SSE__
+	#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
 vec4 blinn_phong(const context *ctx, int i, const vec4 V, const vec4 N)
 {
 	float dist, att, ks, kd;
@@ -37,21 +44,140 @@ vec4 blinn_phong(const context *ctx, int i, const vec4 V, const vec4 N)
 	ks = pow(ks, ctx->material.shininess);
 
 	/* combine */
-	cd = vec4_mul(ctx->light[i].diffuse, ctx->material.diffuse);
-	cs = vec4_mul(ctx->light[i].specular, ctx->material.specular);
+	cd = ctx->derived.light[i].diffuse;
+	cs = ctx->derived.light[i].specular;
 
 	return vec4_add(vec4_scale(cd, kd * att), vec4_scale(cs, ks * att));
 }
 
-static void mv_transform(const context *ctx, rs_vertex *v)
+
+/* 1 / sqrt(x) for x > 0, from an estimate refined by one Newton step */
+static float fast_rsqrt(float x)
 {
-	/* transform normal to viewspace */
-	v->attribs[ATTRIB_NORMAL] = vec4_transform(ctx->normalmatrix,
-						v->attribs[ATTRIB_NORMAL]);
+#ifdef __SSE__
+	float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
 
-	/* transform position to viewspace */
-	v->attribs[ATTRIB_POS] = vec4_transform(ctx->modelview,
-						v->attribs[ATTRIB_POS]);
+	return r * (1.5f - 0.5f * x * r * r);
+#else
+	return 1.0f / sqrt(x);
+#endif
+}
+
+/* x^n for n >= 0 by repeated squaring */
+static float pow_int(float x, int n)
+{
+	float r = 1.0f;
+
+	for (; n > 0; n >>= 1) {
+		if (n & 1)
+			r *= x;
+		x *= x;
+	}
+
+	return r;
+}
+
+static vec4 fast_normalize(const vec4 v)
+{
+	float s = v.x * v.x + v.y * v.y + v.z * v.z;
+
+	return vec4_scale(v, s > 0.0f ? fast_rsqrt(s) : 0.0f);
+}
+
+/* blinn_phong with the approximations enabled by LIGHTING_FAST */
+static vec4 blinn_phong_fast(const context *ctx, int i, const vec4 V,
+				const vec4 N)
+{
+	float dist, att, ks, kd;
+	vec4 L, H;
+
+	/* light vector */
+	L = vec4_add(ctx->light[i].position, V);
+	L.w = 0.0f;
+
+	dist = vec4_dot(L, L);
+	ks = dist > 0.0f ? fast_rsqrt(dist) : 0.0f;
+	dist *= ks;
+	L = vec4_scale(L, ks);
+
+	/* half vector */
+	H = fast_normalize(vec4_add(L, V));
+
+	/* attenuation factor */
+	att = ctx->light[i].attenuation_constant +
+		ctx->light[i].attenuation_linear * dist +
+		ctx->light[i].attenuation_quadratic * dist * dist;
+	att = att > 0.0f ? 1.0f / att : 0.0f;
+
+	/* diffuse component */
+	kd = vec4_dot(N, L);
+	kd = kd < 0.0f ? 0.0f : kd;
+
+	/* specular component */
+	ks = vec4_dot(N, H);
+	ks = ks < 0.0f ? 0.0f : ks;
+	ks = pow_int(ks, ctx->material.shininess);
+
+	/* combine */
+	return vec4_add(vec4_scale(ctx->derived.light[i].diffuse, kd * att),
+			vec4_scale(ctx->derived.light[i].specular, ks * att));
+}
+
+/* transform an attribute of all vertices in a batch, in & out may alias */
+static void batch_transform(const float *m, float (*out)[SHADER_BATCH_SIZE],
+			float (*in)[SHADER_BATCH_SIZE], unsigned int count)
+{
+	unsigned int i;
+#ifdef __SSE__
+	__m128 x, y, z, w;
+
+	for (i = 0; i < count; i += 4) {
+		x = _mm_load_ps(in[0] + i);
+		y = _mm_load_ps(in[1] + i);
+		z = _mm_load_ps(in[2] + i);
+		w = _mm_load_ps(in[3] + i);
+
+	#define ROW(r) \
+		_mm_add_ps(_mm_add_ps(_mm_add_ps( \
+			_mm_mul_ps(_mm_set1_ps(m[r]), x), \
+			_mm_mul_ps(_mm_set1_ps(m[4 + r]), y)), \
+			_mm_mul_ps(_mm_set1_ps(m[8 + r]), z)), \
+			_mm_mul_ps(_mm_set1_ps(m[12 + r]), w))
+
+		_mm_store_ps(out[0] + i, ROW(0));
+		_mm_store_ps(out[1] + i, ROW(1));
+		_mm_store_ps(out[2] + i, ROW(2));
+		_mm_store_ps(out[3] + i, ROW(3));
+	#undef ROW
+	}
+#else
+	float x, y, z, w;
+
+	for (i = 0; i < count; ++i) {
+		x = in[0][i];
+		y = in[1][i];
+		z = in[2][i];
+		w = in[3][i];
+
+		out[0][i] = m[0] * x + m[4] * y + m[ 8] * z + m[12] * w;
+		out[1][i] = m[1] * x + m[5] * y + m[ 9] * z + m[13] * w;
+		out[2][i] = m[2] * x + m[6] * y + m[10] * z + m[14] * w;
+		out[3][i] = m[3] * x + m[7] * y + m[11] * z + m[15] * w;
+	}
+#endif
+}
+
+static void batch_set(float (*out)[SHADER_BATCH_SIZE], const vec4 v,
+			unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		out[0][i] = v.x;
+		out[1][i] = v.y;
+		out[2][i] = v.z;
+		out[3][i] = v.w;
+	}
 }
 
 static vec4 apply_textures(const context *ctx, const rs_vertex *frag)
@@ -71,24 +197,184 @@ static vec4 apply_textures(const context *ctx, const rs_vertex *frag)
 	return c;
 }
 
+static vec4 span_get(const float (*in)[SHADER_SPAN_SIZE], unsigned int i)
+{
+	return vec4_set(in[0][i], in[1][i], in[2][i], in[3][i]);
+}
+
+/* c = c * in for the first count colors of a span */
+static void span_mul(float (*c)[SHADER_SPAN_SIZE],
+		const float (*in)[SHADER_SPAN_SIZE], unsigned int count)
+{
+	unsigned int i, j;
+
+	for (j = 0; j < 4; ++j) {
+#ifdef __SSE__
+		for (i = 0; i < count; i += 4) {
+			_mm_store_ps(c[j] + i,
+				_mm_mul_ps(_mm_load_ps(c[j] + i),
+					_mm_load_ps(in[j] + i)));
+		}
+#else
+		for (i = 0; i < count; ++i)
+			c[j][i] *= in[j][i];
+#endif
+	}
+}
+
+/* multiply the colors of a span with the vertex color, if there is one,
+   and the colors of the enabled texture layers */
+static void span_modulate(const context *ctx, const rs_fragment_batch *f,
+			float (*c)[SHADER_SPAN_SIZE])
+{
+	float tex[4][SHADER_SPAN_SIZE] __attribute__ ((aligned (16)));
+	const float (*ctex)[SHADER_SPAN_SIZE] =
+		(const float (*)[SHADER_SPAN_SIZE])tex;
+	int i, enabled = 0;
+	unsigned int j;
+	vec4 t;
+
+	if (f->used & ATTRIB_FLAG_COLOR)
+		span_mul(c, f->attribs[ATTRIB_COLOR], f->count);
+
+	for (i = 0; i < MAX_TEXTURES; ++i) {
+		if (!ctx->texture_enable[i])
+			continue;
+
+		for (j = 0; j < f->count; ++j) {
+			t = texture_sample(ctx->textures[i],
+					span_get(f->attribs[ATTRIB_TEX0 + i],
+						j));
+
+			if (enabled)
+				t = vec4_mul(span_get(ctex, j), t);
+
+			tex[0][j] = t.x;
+			tex[1][j] = t.y;
+			tex[2][j] = t.z;
+			tex[3][j] = t.w;
+		}
+
+		enabled = 1;
+	}
+
+	if (enabled)
+		span_mul(c, ctex, f->count);
+}
+
+/* convert the first count colors of a span like color_from_vec */
+static void span_pack(color4 *out, const float (*c)[SHADER_SPAN_SIZE],
+			unsigned int count)
+{
+	unsigned int i;
+#ifdef __SSE2__
+	__m128i r, g, b, a, mask = _mm_set1_epi32(0xFF);
+	__m128 scale = _mm_set1_ps(255.0f);
+
+	for (i = 0; i < count; i += 4) {
+	#define CHANNEL(j) _mm_and_si128(mask, _mm_cvttps_epi32( \
+				_mm_mul_ps(_mm_load_ps(c[j] + i), scale)))
+
+		r = _mm_slli_epi32(CHANNEL(0), RED * 8);
+		g = _mm_slli_epi32(CHANNEL(1), GREEN * 8);
+		b = _mm_slli_epi32(CHANNEL(2), BLUE * 8);
+		a = _mm_slli_epi32(CHANNEL(3), ALPHA * 8);
+	#undef CHANNEL
+
+		_mm_storeu_si128((__m128i *)(out + i),
+				_mm_or_si128(_mm_or_si128(r, g),
+					_mm_or_si128(b, a)));
+	}
+#else
+	for (i = 0; i < count; ++i)
+		out[i] = color_from_vec(span_get(c, i));
+#endif
+}
+
+/* add the contribution of all enabled lights to a color, V points from
+   the surface towards the viewer, neither V nor N need to be normalized */
+static vec4 add_lights(const context *ctx, vec4 color, vec4 V, vec4 N)
+{
+	int i;
+
+	if (ctx->flags & LIGHTING_FAST) {
+		V = fast_normalize(V);
+		N = fast_normalize(N);
+
+		for (i = 0; i < ctx->derived.light_count; ++i) {
+			color = vec4_add(color, blinn_phong_fast(ctx,
+						ctx->derived.lights[i], V, N));
+		}
+	} else {
+		V = vec4_normalize(V);
+		N = vec4_normalize(N);
+
+		for (i = 0; i < ctx->derived.light_count; ++i) {
+			color = vec4_add(color, blinn_phong(ctx,
+						ctx->derived.lights[i], V, N));
+		}
+	}
+
+	color.w = 1.0f;
+	return color;
+}
+
 /****************************************************************************/
 
 static void shader_unlit_vertex(const shader_program *prog, const context *ctx,
 				rs_vertex *v)
 {
-	vec4 V = vec4_transform(ctx->modelview, v->attribs[ATTRIB_POS]);
 	(void)prog;
 
-	v->attribs[ATTRIB_POS] = vec4_transform(ctx->projection, V);
+	v->attribs[ATTRIB_POS] = vec4_transform(ctx->derived.mvp,
+						v->attribs[ATTRIB_POS]);
 	v->used &= ~(ATTRIB_FLAG_NORMAL|ATTRIB_FLAG_USR0|ATTRIB_FLAG_USR1);
 }
 
+static void shader_unlit_vertex_batch(const shader_program *prog,
+				const context *ctx, rs_vertex_batch *b)
+{
+	unsigned int i;
+	(void)prog;
+
+	batch_transform(ctx->derived.mvp, b->attribs[ATTRIB_POS],
+			b->attribs[ATTRIB_POS], b->count);
+
+	for (i = 0; i < b->count; ++i) {
+		b->used[i] &= ~(ATTRIB_FLAG_NORMAL | ATTRIB_FLAG_USR0 |
+				ATTRIB_FLAG_USR1);
+	}
+}
+
 static vec4 shader_unlit_fragment(const shader_program *prog,
 				const context *ctx, const rs_vertex *frag)
 {
+	vec4 color = apply_textures(ctx, frag);
+	(void)prog;
+
+	if (frag->used & ATTRIB_FLAG_COLOR)
+		color = vec4_mul(color, frag->attribs[ATTRIB_COLOR]);
+
+	return color;
+}
+
+static unsigned int shader_unlit_fragment_span(const shader_program *prog,
+					const context *ctx,
+					const rs_fragment_batch *f,
+					color4 *out)
+{
+	float c[4][SHADER_SPAN_SIZE] __attribute__ ((aligned (16)));
+	unsigned int i, j;
 	(void)prog;
-	return vec4_mul(apply_textures(ctx, frag),
-			frag->attribs[ATTRIB_COLOR]);
+
+	for (j = 0; j < 4; ++j) {
+		for (i = 0; i < SHADER_SPAN_SIZE; ++i)
+			c[j][i] = 1.0f;
+	}
+
+	span_modulate(ctx, f, c);
+	span_pack(out, (const float (*)[SHADER_SPAN_SIZE])c, f->count);
+	return 0;
 }
 
 /****************************************************************************/
@@ -97,48 +383,64 @@ static void shader_phong_vertex(const shader_program *prog, const context *ctx,
 				rs_vertex *vert)
 {
 	vec4 V;
-	int i;
 	(void)prog;
 
-	mv_transform(ctx, vert);
-
-	V = vec4_invert(vert->attribs[ATTRIB_POS]);
+	/* vector from the surface towards the viewer, in viewspace */
+	V = vec4_transform(ctx->modelview, vert->attribs[ATTRIB_POS]);
+	V = vec4_invert(V);
 	V.w = 0.0f;
+
 	vert->attribs[ATTRIB_USR0] = V;
+	vert->attribs[ATTRIB_USR1] = ctx->derived.ambient;
+	vert->used |= ATTRIB_FLAG_USR0|ATTRIB_FLAG_USR1;
 
-	V = vec4_set(0.0f, 0.0f, 0.0f, 0.0f);
+	vert->attribs[ATTRIB_NORMAL] = vec4_transform(ctx->normalmatrix,
+						vert->attribs[ATTRIB_NORMAL]);
+	vert->attribs[ATTRIB_POS] = vec4_transform(ctx->derived.mvp,
+						vert->attribs[ATTRIB_POS]);
+}
 
-	for (i = 0; i < MAX_LIGHTS; ++i) {
-		if (!ctx->light[i].enable)
-			continue;
-		V = vec4_mul(ctx->light[i].ambient, ctx->material.ambient);
-	}
+static vec4 shader_phong_position(const shader_program *prog,
+				const context *ctx, const rs_vertex *vert)
+{
+	(void)prog;
 
-	vert->attribs[ATTRIB_USR1] = vec4_add(V, ctx->material.emission);
+	return vec4_transform(ctx->derived.mvp, vert->attribs[ATTRIB_POS]);
+}
 
-	vert->used |= ATTRIB_FLAG_USR0|ATTRIB_FLAG_USR1;
+static void shader_phong_vertex_batch(const shader_program *prog,
+				const context *ctx, rs_vertex_batch *b)
+{
+	float (*pos)[SHADER_BATCH_SIZE] = b->attribs[ATTRIB_POS];
+	float (*V)[SHADER_BATCH_SIZE] = b->attribs[ATTRIB_USR0];
+	unsigned int i;
+	(void)prog;
 
-	vert->attribs[ATTRIB_POS] = vec4_transform(ctx->projection,
-						vert->attribs[ATTRIB_POS]);
+	batch_transform(ctx->normalmatrix, b->attribs[ATTRIB_NORMAL],
+			b->attribs[ATTRIB_NORMAL], b->count);
+	batch_transform(ctx->modelview, V, pos, b->count);
+	batch_transform(ctx->derived.mvp, pos, pos, b->count);
+
+	for (i = 0; i < b->count; ++i) {
+		V[0][i] = -V[0][i];
+		V[1][i] = -V[1][i];
+		V[2][i] = -V[2][i];
+		V[3][i] = 0.0f;
+		b->used[i] |= ATTRIB_FLAG_USR0 | ATTRIB_FLAG_USR1;
+	}
+
+	batch_set(b->attribs[ATTRIB_USR1], ctx->derived.ambient, b->count);
 }
 
 static vec4 shader_phong_fragment(const shader_program *prog,
 				const context *ctx, const rs_vertex *frag)
 {
-	vec4 color, V, N;
-	int i;
+	vec4 color;
 	(void)prog;
 
-	color = frag->attribs[ATTRIB_USR1];
-	V = vec4_normalize(frag->attribs[ATTRIB_USR0]);
-	N = vec4_normalize(frag->attribs[ATTRIB_NORMAL]);
-
-	for (i = 0; i < MAX_LIGHTS; ++i) {
-		if (ctx->light[i].enable)
-			color = vec4_add(color, blinn_phong(ctx, i, V, N));
-	}
-
-	color.w = 1.0f;
+	color = add_lights(ctx, frag->attribs[ATTRIB_USR1],
+			frag->attribs[ATTRIB_USR0],
+			frag->attribs[ATTRIB_NORMAL]);
 
 	if (frag->used & ATTRIB_FLAG_COLOR)
 		color = vec4_mul(frag->attribs[ATTRIB_COLOR], color);
@@ -146,11 +448,107 @@ static vec4 shader_phong_fragment(const shader_program *prog,
 	return vec4_mul(apply_textures(ctx, frag), color);
 }
 
+static unsigned int shader_phong_fragment_span(const shader_program *prog,
+					const context *ctx,
+					const rs_fragment_batch *f,
+					color4 *out)
+{
+	float c[4][SHADER_SPAN_SIZE] __attribute__ ((aligned (16)));
+	unsigned int i;
+	vec4 color;
+	(void)prog;
+
+	for (i = 0; i < f->count; ++i) {
+		color = add_lights(ctx, span_get(f->attribs[ATTRIB_USR1], i),
+				span_get(f->attribs[ATTRIB_USR0], i),
+				span_get(f->attribs[ATTRIB_NORMAL], i));
+
+		c[0][i] = color.x;
+		c[1][i] = color.y;
+		c[2][i] = color.z;
+		c[3][i] = color.w;
+	}
+
+	span_modulate(ctx, f, c);
+	span_pack(out, (const float (*)[SHADER_SPAN_SIZE])c, f->count);
+	return 0;
+}
+
+/****************************************************************************/
+
+static void shader_gouraud_vertex(const shader_program *prog,
+				const context *ctx, rs_vertex *vert)
+{
+	vec4 V, N, color;
+	(void)prog;
+
+	V = vec4_invert(vec4_transform(ctx->modelview,
+					vert->attribs[ATTRIB_POS]));
+	V.w = 0.0f;
+	N = vec4_transform(ctx->normalmatrix, vert->attribs[ATTRIB_NORMAL]);
+
+	color = add_lights(ctx, ctx->derived.ambient, V, N);
+
+	if (vert->used & ATTRIB_FLAG_COLOR)
+		color = vec4_mul(vert->attribs[ATTRIB_COLOR], color);
+
+	vert->attribs[ATTRIB_COLOR] = color;
+	vert->attribs[ATTRIB_POS] = vec4_transform(ctx->derived.mvp,
+						vert->attribs[ATTRIB_POS]);
+
+	vert->used |= ATTRIB_FLAG_COLOR;
+	vert->used &= ~(ATTRIB_FLAG_NORMAL|ATTRIB_FLAG_USR0|ATTRIB_FLAG_USR1);
+}
+
+static void shader_gouraud_vertex_batch(const shader_program *prog,
+				const context *ctx, rs_vertex_batch *b)
+{
+	float (*pos)[SHADER_BATCH_SIZE] = b->attribs[ATTRIB_POS];
+	float (*nrm)[SHADER_BATCH_SIZE] = b->attribs[ATTRIB_NORMAL];
+	float (*col)[SHADER_BATCH_SIZE] = b->attribs[ATTRIB_COLOR];
+	float (*V)[SHADER_BATCH_SIZE] = b->attribs[ATTRIB_USR0];
+	vec4 color;
+	unsigned int i;
+	(void)prog;
+
+	batch_transform(ctx->normalmatrix, nrm, nrm, b->count);
+	batch_transform(ctx->modelview, V, pos, b->count);
+	batch_transform(ctx->derived.mvp, pos, pos, b->count);
+
+	for (i = 0; i < b->count; ++i) {
+		color = add_lights(ctx, ctx->derived.ambient,
+				vec4_set(-V[0][i], -V[1][i], -V[2][i], 0.0f),
+				vec4_set(nrm[0][i], nrm[1][i], nrm[2][i],
+					nrm[3][i]));
+
+		if (b->used[i] & ATTRIB_FLAG_COLOR) {
+			color = vec4_mul(vec4_set(col[0][i], col[1][i],
+						col[2][i], col[3][i]), color);
+		}
+
+		col[0][i] = color.x;
+		col[1][i] = color.y;
+		col[2][i] = color.z;
+		col[3][i] = color.w;
+
+		b->used[i] |= ATTRIB_FLAG_COLOR;
+		b->used[i] &= ~(ATTRIB_FLAG_NORMAL | ATTRIB_FLAG_USR0 |
+				ATTRIB_FLAG_USR1);
+	}
+}
+
 /****************************************************************************/
 
 static const shader_program shaders[] = {
-	{ shader_unlit_vertex, shader_unlit_fragment },
-	{ shader_phong_vertex, shader_phong_fragment },
+	{ shader_unlit_vertex, shader_unlit_fragment,
+		shader_unlit_vertex_batch, NULL,
+		shader_unlit_fragment_span },
+	{ shader_phong_vertex, shader_phong_fragment,
+		shader_phong_vertex_batch, shader_phong_position,
+		shader_phong_fragment_span },
+	{ shader_gouraud_vertex, shader_unlit_fragment,
+		shader_gouraud_vertex_batch, shader_phong_position,
+		shader_unlit_fragment_span },
 };
 
 const shader_program *shader_internal(unsigned int id)
@@ -0,0 +1,690 @@
+#include "rasterizer.h"
+#include "shadervm.h"
+#include "context.h"
+#include "texture.h"
+#include "color.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE__
+	#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+/* fragments processed at once, the width of a register component */
+#define LANES 4
+
+enum {
+	OP_LOAD = 0,
+	OP_UNIFORM,
+	OP_SAMPLE,
+	OP_MUL,
+	OP_ADD,
+	OP_MAD,
+	OP_MAX,
+	OP_DOT,
+	OP_RSQRT,
+	OP_LERP,
+	OP_OUT,
+	OP_SET          /* set a register to a folded constant */
+};
+
+/* operands after the mnemonic: r = register, a = attribute slot,
+   u = uniform, n = texture layer */
+static const struct {
+	const char *name;
+	const char *operands;
+} opcodes[] = {
+	{ "load", "ra" },
+	{ "uniform", "ru" },
+	{ "sample", "rrn" },
+	{ "mul", "rrr" },
+	{ "add", "rrr" },
+	{ "mad", "rrrr" },
+	{ "max", "rrr" },
+	{ "dot", "rrr" },
+	{ "rsqrt", "rr" },
+	{ "lerp", "rrrr" },
+	{ "out", "r" },
+};
+
+static const char *slots[ATTRIB_COUNT] = {
+	"pos", "color", "normal", "tex0", "tex1", "usr0", "usr1"
+};
+
+/****************************************************************************/
+
+#ifdef __SSE__
+typedef __m128 lanes;
+
+#define lanes_load _mm_load_ps
+#define lanes_set _mm_set1_ps
+#define lanes_add _mm_add_ps
+#define lanes_sub _mm_sub_ps
+#define lanes_mul _mm_mul_ps
+#define lanes_max _mm_max_ps
+#define lanes_store _mm_store_ps
+#define lanes_rsqrt(a) _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(a))
+#else
+typedef struct {
+	float v[LANES];
+} lanes;
+
+#define LANES_OP(name, expr) \
+	static lanes name(lanes a, lanes b) \
+	{ \
+		int i; \
+		for (i = 0; i < LANES; ++i) \
+			a.v[i] = (expr); \
+		return a; \
+	}
+
+LANES_OP(lanes_add, a.v[i] + b.v[i])
+LANES_OP(lanes_sub, a.v[i] - b.v[i])
+LANES_OP(lanes_mul, a.v[i] * b.v[i])
+LANES_OP(lanes_max, a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+#undef LANES_OP
+
+static lanes lanes_load(const float *ptr)
+{
+	lanes a;
+	memcpy(a.v, ptr, sizeof(a.v));
+	return a;
+}
+
+static lanes lanes_set(float x)
+{
+	lanes a;
+	int i;
+
+	for (i = 0; i < LANES; ++i)
+		a.v[i] = x;
+	return a;
+}
+
+static void lanes_store(float *ptr, lanes a)
+{
+	memcpy(ptr, a.v, sizeof(a.v));
+}
+
+static lanes lanes_rsqrt(lanes a)
+{
+	int i;
+
+	for (i = 0; i < LANES; ++i)
+		a.v[i] = 1.0f / (float)sqrt(a.v[i]);
+	return a;
+}
+#endif
+
+static float component(const vec4 *v, int c)
+{
+	return ((const float *)v)[c];
+}
+
+/****************************************************************************/
+
+static vec4 fold(int op, vec4 a, vec4 b, vec4 c)
+{
+	float d;
+
+	switch (op) {
+	case OP_MUL:
+		return vec4_mul(a, b);
+	case OP_ADD:
+		return vec4_add(a, b);
+	case OP_MAD:
+		return vec4_add(vec4_mul(a, b), c);
+	case OP_MAX:
+		return vec4_set(a.x > b.x ? a.x : b.x, a.y > b.y ? a.y : b.y,
+				a.z > b.z ? a.z : b.z, a.w > b.w ? a.w : b.w);
+	case OP_DOT:
+		d = a.x * b.x + a.y * b.y + a.z * b.z;
+		return vec4_set(d, d, d, d);
+	case OP_RSQRT:
+		return vec4_set(1.0f / (float)sqrt(a.x),
+				1.0f / (float)sqrt(a.y),
+				1.0f / (float)sqrt(a.z),
+				1.0f / (float)sqrt(a.w));
+	case OP_LERP:
+		return vec4_add(a, vec4_mul(vec4_sub(b, a), c));
+	}
+
+	return a;
+}
+
+static int source_count(int op)
+{
+	switch (op) {
+	case OP_RSQRT:
+	case OP_OUT:
+		return 1;
+	case OP_MAD:
+	case OP_LERP:
+		return 3;
+	case OP_MUL:
+	case OP_ADD:
+	case OP_MAX:
+	case OP_DOT:
+		return 2;
+	}
+
+	return 0;
+}
+
+static void emit(shadervm *vm, int op, int dst, int a, int b, int c)
+{
+	unsigned int i = vm->kernel_count++;
+
+	vm->kernel[i].op = op;
+	vm->kernel[i].dst = dst;
+	vm->kernel[i].src[0] = a;
+	vm->kernel[i].src[1] = b;
+	vm->kernel[i].src[2] = c;
+}
+
+/* the value of a folded register is set by an OP_SET right before the
+   first kernel instruction that reads it */
+static void materialize(shadervm *vm, int *konst, int *set, int r)
+{
+	if (konst[r] >= 0 && !set[r]) {
+		emit(vm, OP_SET, r, konst[r], 0, 0);
+		set[r] = 1;
+	}
+}
+
+static void compile(shadervm *vm)
+{
+	int konst[SHADERVM_REGISTERS], set[SHADERVM_REGISTERS];
+	unsigned int i, count = 0;
+	int j, n, op, dst;
+	vec4 v[3];
+
+	for (j = 0; j < SHADERVM_REGISTERS; ++j) {
+		konst[j] = -1;
+		set[j] = 0;
+	}
+
+	vm->kernel_count = 0;
+
+	for (i = 0; i < vm->count; ++i) {
+		op = vm->code[i].op;
+		dst = vm->code[i].dst;
+		n = source_count(op);
+
+		if (op == OP_UNIFORM) {
+			vm->constant[count] = vm->uniform[vm->code[i].src[0]];
+			konst[dst] = count++;
+			set[dst] = 0;
+			continue;
+		}
+
+		if (op != OP_LOAD && op != OP_SAMPLE && op != OP_OUT) {
+			for (j = 0; j < n; ++j) {
+				if (konst[vm->code[i].src[j]] < 0)
+					break;
+				v[j] = vm->constant[konst[vm->code[i].src[j]]];
+			}
+
+			if (j == n) {
+				vm->constant[count] = fold(op, v[0], v[1],
+							v[2]);
+				konst[dst] = count++;
+				set[dst] = 0;
+				continue;
+			}
+		}
+
+		if (op == OP_SAMPLE)
+			n = 1;
+
+		for (j = 0; j < n; ++j)
+			materialize(vm, konst, set, vm->code[i].src[j]);
+
+		emit(vm, op, dst, vm->code[i].src[0], vm->code[i].src[1],
+			vm->code[i].src[2]);
+
+		if (op != OP_OUT)
+			konst[dst] = -1;
+	}
+}
+
+/****************************************************************************/
+
+static void sample(const context *ctx, const rs_fragment_batch *f,
+		unsigned int base, int layer, const lanes *tc, lanes *out)
+{
+	float in[4][LANES] __attribute__ ((aligned (16)));
+	float c[4][LANES] __attribute__ ((aligned (16)));
+	unsigned int i;
+	int j;
+	vec4 s;
+
+	for (j = 0; j < 4; ++j)
+		lanes_store(in[j], tc[j]);
+
+	for (i = 0; i < LANES; ++i) {
+		s = vec4_set(1.0f, 1.0f, 1.0f, 1.0f);
+
+		if (ctx->texture_enable[layer] && base + i < f->count) {
+			s = texture_sample(ctx->textures[layer],
+					vec4_set(in[0][i], in[1][i],
+						in[2][i], in[3][i]));
+		}
+
+		c[0][i] = s.x;
+		c[1][i] = s.y;
+		c[2][i] = s.z;
+		c[3][i] = s.w;
+	}
+
+	for (j = 0; j < 4; ++j)
+		out[j] = lanes_load(c[j]);
+}
+
+/* run the kernel on the fragments base to base + LANES - 1 of a batch */
+static void run(const shadervm *vm, const context *ctx,
+		const rs_fragment_batch *f, unsigned int base, lanes *color)
+{
+	lanes r[SHADERVM_REGISTERS][4], t;
+	const int *s;
+	unsigned int i;
+	int j, d, slot;
+
+	for (j = 0; j < 4; ++j)
+		color[j] = lanes_set(1.0f);
+
+	for (i = 0; i < vm->kernel_count; ++i) {
+		d = vm->kernel[i].dst;
+		s = vm->kernel[i].src;
+
+		switch (vm->kernel[i].op) {
+		case OP_LOAD:
+			slot = s[0];
+
+			/* missing attributes are zero, colors white */
+			t = lanes_set(slot == ATTRIB_COLOR ? 1.0f : 0.0f);
+
+			for (j = 0; j < 4; ++j) {
+				r[d][j] = (f->used & (1 << slot)) ?
+					lanes_load(f->attribs[slot][j] + base) :
+					t;
+			}
+			break;
+		case OP_SET:
+			for (j = 0; j < 4; ++j) {
+				r[d][j] = lanes_set(component(vm->constant +
+								s[0], j));
+			}
+			break;
+		case OP_SAMPLE:
+			sample(ctx, f, base, s[1], r[s[0]], r[d]);
+			break;
+		case OP_MUL:
+			for (j = 0; j < 4; ++j)
+				r[d][j] = lanes_mul(r[s[0]][j], r[s[1]][j]);
+			break;
+		case OP_ADD:
+			for (j = 0; j < 4; ++j)
+				r[d][j] = lanes_add(r[s[0]][j], r[s[1]][j]);
+			break;
+		case OP_MAD:
+			for (j = 0; j < 4; ++j) {
+				r[d][j] = lanes_add(lanes_mul(r[s[0]][j],
+							r[s[1]][j]),
+						r[s[2]][j]);
+			}
+			break;
+		case OP_MAX:
+			for (j = 0; j < 4; ++j)
+				r[d][j] = lanes_max(r[s[0]][j], r[s[1]][j]);
+			break;
+		case OP_DOT:
+			t = lanes_add(lanes_add(lanes_mul(r[s[0]][0],
+							r[s[1]][0]),
+						lanes_mul(r[s[0]][1],
+							r[s[1]][1])),
+					lanes_mul(r[s[0]][2], r[s[1]][2]));
+
+			for (j = 0; j < 4; ++j)
+				r[d][j] = t;
+			break;
+		case OP_RSQRT:
+			for (j = 0; j < 4; ++j)
+				r[d][j] = lanes_rsqrt(r[s[0]][j]);
+			break;
+		case OP_LERP:
+			for (j = 0; j < 4; ++j) {
+				r[d][j] = lanes_add(r[s[0]][j],
+					lanes_mul(lanes_sub(r[s[1]][j],
+							r[s[0]][j]),
+						r[s[2]][j]));
+			}
+			break;
+		case OP_OUT:
+			for (j = 0; j < 4; ++j)
+				color[j] = r[s[0]][j];
+			break;
+		}
+	}
+}
+
+/* convert colors like color_from_vec */
+static void pack(color4 *out, const lanes *color)
+{
+#ifdef __SSE2__
+	__m128i r, g, b, a, mask = _mm_set1_epi32(0xFF);
+	__m128 scale = _mm_set1_ps(255.0f);
+
+	#define CHANNEL(j) _mm_and_si128(mask, \
+				_mm_cvttps_epi32(_mm_mul_ps(color[j], scale)))
+
+	r = _mm_slli_epi32(CHANNEL(0), RED * 8);
+	g = _mm_slli_epi32(CHANNEL(1), GREEN * 8);
+	b = _mm_slli_epi32(CHANNEL(2), BLUE * 8);
+	a = _mm_slli_epi32(CHANNEL(3), ALPHA * 8);
+	#undef CHANNEL
+
+	_mm_storeu_si128((__m128i *)out,
+			_mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, a)));
+#else
+	float c[4][LANES] __attribute__ ((aligned (16)));
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		lanes_store(c[i], color[i]);
+
+	for (i = 0; i < LANES; ++i)
+		out[i] = color_from_vec(vec4_set(c[0][i], c[1][i],
+						c[2][i], c[3][i]));
+#endif
+}
+
+/****************************************************************************/
+
+static void shadervm_vertex(const shader_program *prog, const context *ctx,
+			rs_vertex *vert)
+{
+	(void)prog;
+
+	vert->attribs[ATTRIB_NORMAL] = vec4_transform(ctx->normalmatrix,
+						vert->attribs[ATTRIB_NORMAL]);
+	vert->attribs[ATTRIB_POS] = vec4_transform(ctx->derived.mvp,
+						vert->attribs[ATTRIB_POS]);
+}
+
+static vec4 shadervm_position(const shader_program *prog,
+			const context *ctx, const rs_vertex *vert)
+{
+	(void)prog;
+
+	return vec4_transform(ctx->derived.mvp, vert->attribs[ATTRIB_POS]);
+}
+
+static vec4 shadervm_fragment(const shader_program *prog, const context *ctx,
+			const rs_vertex *frag)
+{
+	float c[4][LANES] __attribute__ ((aligned (16)));
+	rs_fragment_batch b;
+	lanes color[4];
+	int i, j;
+
+	b.used = frag->used;
+	b.count = 1;
+
+	/* run only reads the slots that are used */
+	for (i = 0; i < ATTRIB_COUNT; ++i) {
+		if (!(b.used & (1 << i)))
+			continue;
+
+		for (j = 0; j < 4; ++j)
+			b.attribs[i][j][0] = component(frag->attribs + i, j);
+	}
+
+	run((const shadervm *)prog, ctx, &b, 0, color);
+
+	for (j = 0; j < 4; ++j)
+		lanes_store(c[j], color[j]);
+
+	return vec4_set(c[0][0], c[1][0], c[2][0], c[3][0]);
+}
+
+static unsigned int shadervm_fragment_span(const shader_program *prog,
+					const context *ctx,
+					const rs_fragment_batch *f,
+					color4 *out)
+{
+	lanes color[4];
+	unsigned int i;
+
+	for (i = 0; i < f->count; i += LANES) {
+		run((const shadervm *)prog, ctx, f, i, color);
+		pack(out + i, color);
+	}
+
+	return 0;
+}
+
+/****************************************************************************/
+
+static const char *skip_space(const char *str)
+{
+	while (*str == ' ' || *str == '\t' || *str == '\r')
+		++str;
+	return str;
+}
+
+/* parse a prefix followed by a decimal number less than max */
+static const char *parse_index(const char *str, char prefix, int max,
+				int *out)
+{
+	int value = 0;
+
+	str = skip_space(str);
+
+	if (prefix) {
+		if (*str != prefix)
+			return NULL;
+		++str;
+	}
+
+	if (*str < '0' || *str > '9')
+		return NULL;
+
+	while (*str >= '0' && *str <= '9') {
+		value = value * 10 + (*str++ - '0');
+		if (value >= max)
+			return NULL;
+	}
+
+	*out = value;
+	return str;
+}
+
+static const char *parse_slot(const char *str, int *out)
+{
+	size_t len;
+	int i;
+
+	str = skip_space(str);
+
+	for (i = 0; i < ATTRIB_COUNT; ++i) {
+		len = strlen(slots[i]);
+
+		if (!strncmp(str, slots[i], len)) {
+			*out = i;
+			return str + len;
+		}
+	}
+
+	return NULL;
+}
+
+/* parse one line into an instruction, returns the end of the line or
+   NULL on error, *op is set to -1 for empty lines */
+static const char *parse_line(const char *str, int *op, int *operand)
+{
+	const char *kind;
+	size_t len;
+	int i;
+
+	str = skip_space(str);
+	*op = -1;
+
+	if (*str == '\0' || *str == '\n' || *str == '#')
+		goto out;
+
+	for (i = 0; i < (int)(sizeof(opcodes) / sizeof(opcodes[0])); ++i) {
+		len = strlen(opcodes[i].name);
+
+		if (!strncmp(str, opcodes[i].name, len) &&
+			(str[len] == ' ' || str[len] == '\t')) {
+			break;
+		}
+	}
+
+	if (i == (int)(sizeof(opcodes) / sizeof(opcodes[0])))
+		return NULL;
+
+	*op = i;
+	str += len;
+
+	for (kind = opcodes[i].operands; *kind; ++kind, ++operand) {
+		if (kind != opcodes[i].operands) {
+			str = skip_space(str);
+			if (*str++ != ',')
+				return NULL;
+		}
+
+		switch (*kind) {
+		case 'r':
+			str = parse_index(str, 'r', SHADERVM_REGISTERS,
+					operand);
+			break;
+		case 'u':
+			str = parse_index(str, 'u', SHADERVM_UNIFORMS, operand);
+			break;
+		case 'n':
+			str = parse_index(str, 0, MAX_TEXTURES, operand);
+			break;
+		case 'a':
+			str = parse_slot(str, operand);
+			break;
+		}
+
+		if (!str)
+			return NULL;
+	}
+
+	str = skip_space(str);
+out:
+	if (*str == '#') {
+		while (*str && *str != '\n')
+			++str;
+	}
+
+	return (*str == '\0' || *str == '\n') ? str : NULL;
+}
+
+/****************************************************************************/
+
+void shadervm_init(shadervm *vm)
+{
+	memset(vm, 0, sizeof(*vm));
+
+	vm->program.vertex = shadervm_vertex;
+	vm->program.fragment = shadervm_fragment;
+	vm->program.position = shadervm_position;
+	vm->program.fragment_span = shadervm_fragment_span;
+}
+
+int shadervm_load(shadervm *vm, const char *source)
+{
+	int op, operand[4], dst, n, i, written = 0;
+	unsigned int count = 0;
+	const char *str;
+
+	/* check everything before replacing the current program */
+	for (str = source; *str; ) {
+		memset(operand, 0, sizeof(operand));
+		str = parse_line(str, &op, operand);
+		if (!str)
+			return 0;
+
+		if (*str == '\n')
+			++str;
+
+		if (op < 0)
+			continue;
+
+		if (count == SHADERVM_MAX_CODE)
+			return 0;
+
+		n = source_count(op);
+
+		if (op == OP_OUT) {
+			dst = -1;
+			memmove(operand + 1, operand, sizeof(operand[0]) * 3);
+		} else {
+			dst = operand[0];
+		}
+
+		/* sample reads the register with the coordinates */
+		if (op == OP_SAMPLE)
+			n = 1;
+
+		for (i = 0; i < n; ++i) {
+			if (!(written & (1 << operand[i + 1])))
+				return 0;
+		}
+
+		if (dst >= 0)
+			written |= 1 << dst;
+		++count;
+	}
+
+	/* store it */
+	vm->count = 0;
+
+	for (str = source; *str; ) {
+		memset(operand, 0, sizeof(operand));
+		str = parse_line(str, &op, operand);
+
+		if (*str == '\n')
+			++str;
+
+		if (op < 0)
+			continue;
+
+		if (op == OP_OUT)
+			memmove(operand + 1, operand, sizeof(operand[0]) * 3);
+
+		vm->code[vm->count].op = op;
+		vm->code[vm->count].dst = op == OP_OUT ? -1 : operand[0];
+		vm->code[vm->count].src[0] = operand[1];
+		vm->code[vm->count].src[1] = operand[2];
+		vm->code[vm->count].src[2] = operand[3];
+		++vm->count;
+	}
+
+	compile(vm);
+	return 1;
+}
+
+void shadervm_set_uniform(shadervm *vm, unsigned int index, vec4 value)
+{
+	if (index < SHADERVM_UNIFORMS)
+		vm->uniform[index] = value;
+}
+
+void shadervm_bind(shadervm *vm, context *ctx)
+{
+	compile(vm);
+
+	if (ctx)
+		ctx->shader = &vm->program;
+}
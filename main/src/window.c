@@ -1,32 +1,545 @@
 #include "window.h"
+#include "color.h"
 
 #include <X11/X.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <time.h>
 
+typedef enum {
+	BUFFER_FREE = 0,        /* can be acquired */
+	BUFFER_ACQUIRED = 1,    /* owned by the application for rendering */
+	BUFFER_QUEUED = 2       /* waiting for or in presentation */
+} BUFFER_STATE;
+
+typedef struct {
+	XShmSegmentInfo info;
+	XImage *img;
+} shm_buffer;
+
+/* number of recent frame times kept for statistics */
+#define FRAME_SAMPLES 256
+
+/* maximum number of separate rectangles transferred per present */
+#define MAX_PRESENT_RECTS 64
+
 struct window {
 	Atom atom_wm_delete;
-	framebuffer fb;
 	Display* dpy;
 	XImage* img;
 	Window wnd;
 	GC gc;
+
+	/* swap chain */
+	framebuffer *fb;
+	shm_buffer *shm;            /* shared memory images, if available */
+	unsigned long shm_serial;   /* request number of a pending attach */
+	int shm_error;              /* set if the pending attach failed */
+	int *state;                 /* BUFFER_STATE per buffer */
+	unsigned int buffers;
+	unsigned int current;       /* most recently acquired buffer */
+
+	/* per buffer, tiles queued from other buffers since the buffer was
+	   last acquired, i.e. where the buffer holds an outdated frame */
+	unsigned char *damage;
+
+	/* per tile, the buffer holding the most recently queued contents */
+	unsigned int *owner;
+	int exposed;                /* present everything the next time */
+
+	/* present queue, processed by the present thread */
+	unsigned int *queue;
+	unsigned int queue_start;
+	unsigned int queue_count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t queued;      /* signaled when a buffer is queued */
+	pthread_cond_t released;    /* signaled when a buffer got presented */
+	pthread_t thread;
+	int quit;
+
+	/* frame pacing, protected by lock */
+	unsigned int fps;           /* target frame rate, 0 for uncapped */
+	struct timespec deadline;   /* absolute time of the next present */
+	struct timespec last;       /* time of the last present */
+	int have_last;
+
+	double samples[FRAME_SAMPLES];  /* frame times in seconds */
+	unsigned int sample_next;
+	unsigned int sample_count;
 };
 
+/* Xlib error handlers are process wide, so attaching is serialized and
+   the handler only takes errors of the attach request it waits for */
+static pthread_mutex_t shm_attach_lock = PTHREAD_MUTEX_INITIALIZER;
+static int (*shm_old_handler)(Display *, XErrorEvent *);
+static window *shm_attaching;
+
+static int shm_error_handler(Display *dpy, XErrorEvent *e)
+{
+	window *wnd = shm_attaching;
+
+	if (!wnd || wnd->dpy != dpy || e->serial != wnd->shm_serial)
+		return shm_old_handler ? shm_old_handler(dpy, e) : 0;
+
+	wnd->shm_error = 1;
+	return 0;
+}
+
+static int create_shm_buffer(window *wnd, shm_buffer *buf,
+				const framebuffer *fb)
+{
+	size_t size;
+
+	buf->img = XShmCreateImage(wnd->dpy,
+				DefaultVisual(wnd->dpy, DefaultScreen(wnd->dpy)),
+				24, ZPixmap, NULL, &buf->info,
+				fb->width, fb->height);
+	if (!buf->img)
+		return 0;
+
+	/* the frame buffer is used as image data, so layouts must match */
+	if (buf->img->bits_per_pixel != 32 ||
+		buf->img->bytes_per_line != fb->width * 4) {
+		goto fail_img;
+	}
+
+	size = buf->img->bytes_per_line * buf->img->height;
+
+	buf->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+	if (buf->info.shmid < 0)
+		goto fail_img;
+
+	buf->info.shmaddr = shmat(buf->info.shmid, NULL, 0);
+	if (buf->info.shmaddr == (char *)-1)
+		goto fail_id;
+
+	buf->img->data = buf->info.shmaddr;
+	buf->info.readOnly = True;
+
+	/* attaching fails e.g. for remote displays */
+	pthread_mutex_lock(&shm_attach_lock);
+	XLockDisplay(wnd->dpy);
+
+	wnd->shm_error = 0;
+	wnd->shm_serial = NextRequest(wnd->dpy);
+	shm_attaching = wnd;
+	shm_old_handler = XSetErrorHandler(shm_error_handler);
+
+	XShmAttach(wnd->dpy, &buf->info);
+	XSync(wnd->dpy, False);
+
+	XSetErrorHandler(shm_old_handler);
+	shm_attaching = NULL;
+
+	XUnlockDisplay(wnd->dpy);
+	pthread_mutex_unlock(&shm_attach_lock);
+
+	if (wnd->shm_error)
+		goto fail_at;
+
+	/* the segment is destroyed once both sides have detached */
+	shmctl(buf->info.shmid, IPC_RMID, NULL);
+	return 1;
+fail_at:
+	shmdt(buf->info.shmaddr);
+fail_id:
+	shmctl(buf->info.shmid, IPC_RMID, NULL);
+fail_img:
+	buf->img->data = NULL;
+	XDestroyImage(buf->img);
+	return 0;
+}
+
+static void destroy_shm_buffer(window *wnd, shm_buffer *buf)
+{
+	XShmDetach(wnd->dpy, &buf->info);
+	XSync(wnd->dpy, False);
+
+	buf->img->data = NULL;
+	XDestroyImage(buf->img);
+	shmdt(buf->info.shmaddr);
+}
+
+static void create_shm_buffers(window *wnd)
+{
+	unsigned int i;
+
+	wnd->shm = NULL;
+
+	if (!XShmQueryExtension(wnd->dpy))
+		return;
+
+	wnd->shm = calloc(wnd->buffers, sizeof(wnd->shm[0]));
+	if (!wnd->shm)
+		return;
+
+	for (i = 0; i < wnd->buffers; ++i) {
+		if (!create_shm_buffer(wnd, wnd->shm + i, wnd->fb + i))
+			goto fail;
+	}
+
+	/* render directly into the shared memory segments */
+	for (i = 0; i < wnd->buffers; ++i) {
+		free(wnd->fb[i].color);
+		wnd->fb[i].color = (color4 *)wnd->shm[i].info.shmaddr;
+	}
+	return;
+fail:
+	/* fall back to XPutImage */
+	while (i--)
+		destroy_shm_buffer(wnd, wnd->shm + i);
+
+	free(wnd->shm);
+	wnd->shm = NULL;
+}
+
+static void destroy_shm_buffers(window *wnd)
+{
+	unsigned int i;
+
+	if (!wnd->shm)
+		return;
+
+	for (i = 0; i < wnd->buffers; ++i) {
+		destroy_shm_buffer(wnd, wnd->shm + i);
+		wnd->fb[i].color = NULL;
+	}
+
+	free(wnd->shm);
+	wnd->shm = NULL;
+}
+
+static double timespec_diff(const struct timespec *a,
+				const struct timespec *b)
+{
+	return (double)(a->tv_sec - b->tv_sec) +
+		(double)(a->tv_nsec - b->tv_nsec) * 1e-9;
+}
+
+static void timespec_add_ns(struct timespec *ts, long ns)
+{
+	ts->tv_nsec += ns;
+
+	while (ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec += 1;
+	}
+}
+
+/* sleep until the next frame is due and record the frame time */
+static void pace_frame(window *wnd)
+{
+	struct timespec now;
+	unsigned int fps;
+	int have_last;
+
+	pthread_mutex_lock(&wnd->lock);
+	fps = wnd->fps;
+	have_last = wnd->have_last;
+	pthread_mutex_unlock(&wnd->lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (fps) {
+		if (!have_last)
+			wnd->deadline = now;
+
+		timespec_add_ns(&wnd->deadline, 1000000000L / fps);
+
+		/* if we fell behind by more than a frame, don't try to
+		   catch up by presenting a burst of frames */
+		if (timespec_diff(&wnd->deadline, &now) < 0.0) {
+			wnd->deadline = now;
+		} else {
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						&wnd->deadline, NULL) == EINTR)
+				;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		}
+	}
+
+	pthread_mutex_lock(&wnd->lock);
+
+	if (wnd->have_last) {
+		wnd->samples[wnd->sample_next] = timespec_diff(&now,
+								&wnd->last);
+		wnd->sample_next = (wnd->sample_next + 1) % FRAME_SAMPLES;
+
+		if (wnd->sample_count < FRAME_SAMPLES)
+			wnd->sample_count += 1;
+	}
+
+	wnd->last = now;
+	wnd->have_last = 1;
+
+	pthread_mutex_unlock(&wnd->lock);
+}
+
+/* add the modified tiles of a queued buffer to all other buffers */
+static void propagate_damage(window *wnd, unsigned int i)
+{
+	unsigned int j, k, tiles = wnd->fb[i].tiles_x * wnd->fb[i].tiles_y;
+	unsigned char *dst;
+
+	for (k = 0; k < tiles; ++k) {
+		if (wnd->fb[i].dirty[k])
+			wnd->owner[k] = i;
+	}
+
+	for (j = 0; j < wnd->buffers; ++j) {
+		if (j == i)
+			continue;
+
+		dst = wnd->damage + j * tiles;
+
+		for (k = 0; k < tiles; ++k)
+			dst[k] |= wnd->fb[i].dirty[k];
+	}
+}
+
+/* copy the tiles queued from other buffers since the buffer was last
+   acquired, so it holds the previous frame again */
+static void take_damage(window *wnd, unsigned int i)
+{
+	framebuffer *fb = wnd->fb + i;
+	unsigned int k, tiles = fb->tiles_x * fb->tiles_y;
+	unsigned char *src = wnd->damage + i * tiles;
+	int x, y, w, h, row;
+	const color4 *in;
+	color4 *out;
+
+	for (k = 0; k < tiles; ++k) {
+		if (!src[k] || wnd->owner[k] == i)
+			continue;
+
+		x = (k % fb->tiles_x) * FB_TILE_SIZE;
+		y = (k / fb->tiles_x) * FB_TILE_SIZE;
+		w = fb->width - x < FB_TILE_SIZE ? fb->width - x : FB_TILE_SIZE;
+		h = fb->height - y < FB_TILE_SIZE ?
+			fb->height - y : FB_TILE_SIZE;
+
+		in = wnd->fb[wnd->owner[k]].color + y * fb->width + x;
+		out = fb->color + y * fb->width + x;
+
+		for (row = 0; row < h; ++row) {
+			memcpy(out, in, w * sizeof(*out));
+			in += fb->width;
+			out += fb->width;
+		}
+	}
+
+	memset(src, 0, tiles);
+}
+
+static void present(window *wnd, framebuffer *fb)
+{
+	fb_rect rects[MAX_PRESENT_RECTS];
+	unsigned int i, count;
+	int exposed;
+
+	/* after an expose, the buffer holds the complete current frame */
+	pthread_mutex_lock(&wnd->lock);
+	exposed = wnd->exposed;
+	wnd->exposed = 0;
+	pthread_mutex_unlock(&wnd->lock);
+
+	if (exposed)
+		framebuffer_mark_dirty(fb, 0, 0, fb->width - 1, fb->height - 1);
+
+	count = framebuffer_get_dirty_rects(fb, rects, MAX_PRESENT_RECTS);
+
+	/* only transfer the modified regions */
+	for (i = 0; i < count; ++i) {
+		if (wnd->shm) {
+			XShmPutImage(wnd->dpy, wnd->wnd, wnd->gc,
+				wnd->shm[fb - wnd->fb].img,
+				rects[i].x, rects[i].y, rects[i].x, rects[i].y,
+				rects[i].width, rects[i].height, False);
+		} else {
+			wnd->img->data = (char*)fb->color;
+			XPutImage(wnd->dpy, wnd->wnd, wnd->gc, wnd->img,
+				rects[i].x, rects[i].y, rects[i].x, rects[i].y,
+				rects[i].width, rects[i].height);
+			wnd->img->data = NULL;
+		}
+	}
+
+	/* with MIT-SHM, wait for the server to finish reading, so the
+	   buffer can be reused once we return */
+	if (wnd->shm) {
+		XSync(wnd->dpy, False);
+	} else {
+		XFlush(wnd->dpy);
+	}
+
+	framebuffer_reset_dirty(fb);
+	pace_frame(wnd);
+}
+
+static void *present_thread(void *arg)
+{
+	window *wnd = arg;
+	unsigned int i;
+
+	pthread_mutex_lock(&wnd->lock);
+
+	for (;;) {
+		while (!wnd->queue_count && !wnd->quit)
+			pthread_cond_wait(&wnd->queued, &wnd->lock);
+
+		if (!wnd->queue_count)
+			break;
+
+		i = wnd->queue[wnd->queue_start];
+		pthread_mutex_unlock(&wnd->lock);
+
+		present(wnd, wnd->fb + i);
+
+		pthread_mutex_lock(&wnd->lock);
+		wnd->queue_start = (wnd->queue_start + 1) % wnd->buffers;
+		wnd->queue_count -= 1;
+		wnd->state[i] = BUFFER_FREE;
+		pthread_cond_broadcast(&wnd->released);
+	}
+
+	pthread_mutex_unlock(&wnd->lock);
+	return NULL;
+}
+
+static int create_swap_chain(window *wnd, size_t width, size_t height,
+				unsigned int buffers)
+{
+	unsigned int i, tiles;
+
+	wnd->buffers = buffers;
+	wnd->fb = calloc(buffers, sizeof(wnd->fb[0]));
+	wnd->state = calloc(buffers, sizeof(wnd->state[0]));
+	wnd->queue = calloc(buffers, sizeof(wnd->queue[0]));
+	wnd->damage = NULL;
+	wnd->owner = NULL;
+
+	if (!wnd->fb || !wnd->state || !wnd->queue)
+		goto fail;
+
+	for (i = 0; i < buffers; ++i) {
+		if (!framebuffer_init(wnd->fb + i, width, height))
+			goto fail_fb;
+	}
+
+	tiles = wnd->fb[0].tiles_x * wnd->fb[0].tiles_y;
+	wnd->damage = calloc(buffers, tiles);
+	wnd->owner = calloc(tiles, sizeof(wnd->owner[0]));
+	if (!wnd->damage || !wnd->owner)
+		goto fail_fb;
+
+	wnd->queue_start = 0;
+	wnd->queue_count = 0;
+	wnd->current = 0;
+	wnd->exposed = 0;
+	wnd->state[0] = BUFFER_ACQUIRED;
+	return 1;
+fail_fb:
+	while (i--)
+		framebuffer_cleanup(wnd->fb + i);
+fail:
+	free(wnd->owner);
+	free(wnd->damage);
+	free(wnd->queue);
+	free(wnd->state);
+	free(wnd->fb);
+	return 0;
+}
+
+static void destroy_swap_chain(window *wnd)
+{
+	unsigned int i;
+
+	for (i = 0; i < wnd->buffers; ++i)
+		framebuffer_cleanup(wnd->fb + i);
+
+	free(wnd->owner);
+	free(wnd->damage);
+	free(wnd->queue);
+	free(wnd->state);
+	free(wnd->fb);
+}
+
+static int start_present_thread(window *wnd)
+{
+	if (pthread_mutex_init(&wnd->lock, NULL))
+		return 0;
+	if (pthread_cond_init(&wnd->queued, NULL))
+		goto fail_mutex;
+	if (pthread_cond_init(&wnd->released, NULL))
+		goto fail_queued;
+
+	wnd->quit = 0;
+
+	/* a single buffer is presented synchronously */
+	if (wnd->buffers > 1 &&
+		pthread_create(&wnd->thread, NULL, present_thread, wnd)) {
+		goto fail_released;
+	}
+
+	return 1;
+fail_released:
+	pthread_cond_destroy(&wnd->released);
+fail_queued:
+	pthread_cond_destroy(&wnd->queued);
+fail_mutex:
+	pthread_mutex_destroy(&wnd->lock);
+	return 0;
+}
+
+static void stop_present_thread(window *wnd)
+{
+	if (wnd->buffers > 1) {
+		pthread_mutex_lock(&wnd->lock);
+		wnd->quit = 1;
+		pthread_cond_signal(&wnd->queued);
+		pthread_mutex_unlock(&wnd->lock);
+
+		pthread_join(wnd->thread, NULL);
+	}
+
+	pthread_cond_destroy(&wnd->released);
+	pthread_cond_destroy(&wnd->queued);
+	pthread_mutex_destroy(&wnd->lock);
+}
+
 window *window_create(size_t width, size_t height)
 {
-	window *wnd = malloc(sizeof(*wnd));
+	return window_create_swap_chain(width, height, 1);
+}
+
+window *window_create_swap_chain(size_t width, size_t height,
+				unsigned int buffers)
+{
+	window *wnd;
 	XSizeHints hints;
 
+	if (!buffers)
+		return NULL;
+
+	/* the present thread and the event loop share the display */
+	if (buffers > 1 && !XInitThreads())
+		return NULL;
+
+	wnd = malloc(sizeof(*wnd));
 	if (!wnd)
 		return NULL;
 
-	if (!framebuffer_init(&wnd->fb, width, height))
+	if (!create_swap_chain(wnd, width, height, buffers))
 		goto fail;
 
 	wnd->dpy = XOpenDisplay(0);
@@ -47,7 +560,8 @@ window *window_create(size_t width, size_t height)
 
 	wnd->atom_wm_delete = XInternAtom(wnd->dpy, "WM_DELETE_WINDOW", True);
 
-	XSelectInput(wnd->dpy, wnd->wnd, StructureNotifyMask | KeyReleaseMask);
+	XSelectInput(wnd->dpy, wnd->wnd,
+			StructureNotifyMask | KeyReleaseMask | ExposureMask);
 	XSetWMProtocols(wnd->dpy, wnd->wnd, &(wnd->atom_wm_delete), 1);
 	XFlush(wnd->dpy);
 
@@ -63,7 +577,20 @@ window *window_create(size_t width, size_t height)
 	if (!wnd->img)
 		goto fail_gc;
 
+	create_shm_buffers(wnd);
+
+	wnd->fps = 60;
+	wnd->have_last = 0;
+	wnd->sample_next = 0;
+	wnd->sample_count = 0;
+
+	if (!start_present_thread(wnd))
+		goto fail_img;
+
 	return wnd;
+fail_img:
+	destroy_shm_buffers(wnd);
+	XDestroyImage(wnd->img);
 fail_gc:
 	XFreeGC(wnd->dpy, wnd->gc);
 fail_wnd:
@@ -71,7 +598,7 @@ fail_wnd:
 fail_dpy:
 	XCloseDisplay(wnd->dpy);
 fail_fb:
-	framebuffer_cleanup(&wnd->fb);
+	destroy_swap_chain(wnd);
 fail:
 	free(wnd);
 	return NULL;
@@ -79,11 +606,14 @@ fail:
 
 void window_destroy(window *wnd)
 {
+	stop_present_thread(wnd);
+
+	destroy_shm_buffers(wnd);
 	XDestroyImage(wnd->img);
 	XFreeGC(wnd->dpy, wnd->gc);
 	XDestroyWindow(wnd->dpy, wnd->wnd);
 	XCloseDisplay(wnd->dpy);
-	framebuffer_cleanup(&wnd->fb);
+	destroy_swap_chain(wnd);
 	free(wnd);
 }
 
@@ -95,6 +625,13 @@ int window_handle_events(window *wnd)
 		XNextEvent(wnd->dpy, &e);
 
 		switch (e.type) {
+		case Expose:
+			/* only the modified regions are presented, so the
+			   next present has to redraw everything */
+			pthread_mutex_lock(&wnd->lock);
+			wnd->exposed = 1;
+			pthread_mutex_unlock(&wnd->lock);
+			break;
 		case ClientMessage:
 			if (e.xclient.data.l[0] == (long)wnd->atom_wm_delete) {
 				XUnmapWindow(wnd->dpy, wnd->wnd);
@@ -106,25 +643,134 @@ int window_handle_events(window *wnd)
 	return 1;
 }
 
+framebuffer *window_acquire_framebuffer(window *wnd)
+{
+	unsigned int i;
+
+	if (wnd->buffers == 1)
+		return wnd->fb;
+
+	pthread_mutex_lock(&wnd->lock);
+
+	if (wnd->state[wnd->current] != BUFFER_ACQUIRED) {
+		/* round robin, i.e. take the one presented the longest ago */
+		for (;;) {
+			i = (wnd->current + 1) % wnd->buffers;
+
+			for (; i != wnd->current; i = (i + 1) % wnd->buffers) {
+				if (wnd->state[i] == BUFFER_FREE)
+					break;
+			}
+
+			if (wnd->state[i] == BUFFER_FREE)
+				break;
+
+			pthread_cond_wait(&wnd->released, &wnd->lock);
+		}
+
+		wnd->state[i] = BUFFER_ACQUIRED;
+		wnd->current = i;
+		pthread_mutex_unlock(&wnd->lock);
+
+		/* damage and owners are only changed by the application */
+		take_damage(wnd, i);
+		return wnd->fb + i;
+	}
+
+	pthread_mutex_unlock(&wnd->lock);
+	return wnd->fb + wnd->current;
+}
+
+void window_present_framebuffer(window *wnd, framebuffer *fb)
+{
+	unsigned int i = fb - wnd->fb;
+
+	if (wnd->buffers == 1) {
+		present(wnd, fb);
+		return;
+	}
+
+	pthread_mutex_lock(&wnd->lock);
+
+	if (i < wnd->buffers && wnd->state[i] == BUFFER_ACQUIRED) {
+		propagate_damage(wnd, i);
+
+		wnd->state[i] = BUFFER_QUEUED;
+		wnd->queue[(wnd->queue_start + wnd->queue_count) %
+			wnd->buffers] = i;
+		wnd->queue_count += 1;
+		pthread_cond_signal(&wnd->queued);
+	}
+
+	pthread_mutex_unlock(&wnd->lock);
+}
+
 void window_display_framebuffer(window *wnd)
 {
-	struct timespec tim;
-	struct timespec tim2;
+	framebuffer *fb = window_acquire_framebuffer(wnd);
+	unsigned int i = fb - wnd->fb;
 
-	/* copy framebuffer data */
-	wnd->img->data = (char*)wnd->fb.color;
-	XPutImage(wnd->dpy, wnd->wnd, wnd->gc, wnd->img,
-		0, 0, 0, 0, wnd->fb.width, wnd->fb.height);
+	window_present_framebuffer(wnd, fb);
 
-	wnd->img->data = NULL;
+	if (wnd->buffers == 1)
+		return;
 
-	/* wait for ~16.666 ms -> ~60 fps */
-	tim.tv_sec = 0;
-	tim.tv_nsec = 16666666L;
-	nanosleep(&tim, &tim2);
+	/* wait until it is displayed and take it back for the next frame */
+	pthread_mutex_lock(&wnd->lock);
+
+	while (wnd->state[i] != BUFFER_FREE)
+		pthread_cond_wait(&wnd->released, &wnd->lock);
+
+	wnd->state[i] = BUFFER_ACQUIRED;
+	wnd->current = i;
+
+	pthread_mutex_unlock(&wnd->lock);
+
+	take_damage(wnd, i);
 }
 
 framebuffer *window_get_framebuffer(window *wnd)
 {
-	return &wnd->fb;
+	return wnd->fb + wnd->current;
+}
+
+void window_set_frame_rate(window *wnd, unsigned int fps)
+{
+	pthread_mutex_lock(&wnd->lock);
+	wnd->fps = fps;
+	wnd->have_last = 0;
+	pthread_mutex_unlock(&wnd->lock);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double lhs = *((const double *)a), rhs = *((const double *)b);
+
+	return lhs < rhs ? -1 : (lhs > rhs ? 1 : 0);
+}
+
+void window_get_frame_stats(window *wnd, frame_stats *stats)
+{
+	double samples[FRAME_SAMPLES];
+	unsigned int i, count;
+
+	pthread_mutex_lock(&wnd->lock);
+	count = wnd->sample_count;
+	memcpy(samples, wnd->samples, count * sizeof(samples[0]));
+	pthread_mutex_unlock(&wnd->lock);
+
+	memset(stats, 0, sizeof(*stats));
+	stats->frames = count;
+
+	if (!count)
+		return;
+
+	qsort(samples, count, sizeof(samples[0]), compare_double);
+
+	for (i = 0; i < count; ++i)
+		stats->avg += samples[i];
+
+	stats->min = samples[0];
+	stats->avg /= (double)count;
+	stats->p99 = samples[(count * 99 + 99) / 100 - 1];
 }
@@ -78,6 +78,32 @@ static void normalize_normals(mesh *this, int vs)
 	}
 }
 
+static void compute_bounds(mesh *this, int vs)
+{
+	unsigned int i;
+	const float *v;
+
+	this->bounds_min = vec4_set(0.0f, 0.0f, 0.0f, 1.0f);
+	this->bounds_max = vec4_set(0.0f, 0.0f, 0.0f, 1.0f);
+
+	for (i = 0; i < this->vertices; ++i) {
+		v = this->vertexbuffer + vs * i;
+
+		if (i == 0 || v[0] < this->bounds_min.x)
+			this->bounds_min.x = v[0];
+		if (i == 0 || v[1] < this->bounds_min.y)
+			this->bounds_min.y = v[1];
+		if (i == 0 || v[2] < this->bounds_min.z)
+			this->bounds_min.z = v[2];
+		if (i == 0 || v[0] > this->bounds_max.x)
+			this->bounds_max.x = v[0];
+		if (i == 0 || v[1] > this->bounds_max.y)
+			this->bounds_max.y = v[1];
+		if (i == 0 || v[2] > this->bounds_max.z)
+			this->bounds_max.z = v[2];
+	}
+}
+
 mesh *load_3ds(const char *filename)
 {
 	float *vertex_data = NULL, *texture_data = NULL;
@@ -227,8 +253,155 @@ mesh *load_3ds(const char *filename)
 
 	gen_average_normals(this, vs);
 	normalize_normals(this, vs);
+	compute_bounds(this, vs);
 
 	free(vertex_data);
 	free(texture_data);
 	return this;
 }
+
+/****************************************************************************/
+
+static unsigned short float_to_half(float f)
+{
+	unsigned int sign, e, m, shift;
+	union {
+		unsigned int ui;
+		float f;
+	} v;
+
+	v.f = f;
+	sign = (v.ui >> 16) & 0x8000;
+	e = (v.ui >> 23) & 0xFF;
+	m = v.ui & 0x7FFFFF;
+
+	if (e == 0xFF)
+		return sign | 0x7C00 | (m ? 0x0200 : 0);
+
+	if (e > 142)
+		return sign | 0x7C00;
+
+	if (e < 113) {
+		if (e < 103)
+			return sign;
+
+		shift = 126 - e;
+		m |= 0x800000;
+		return sign | ((m + (1 << (shift - 1))) >> shift);
+	}
+
+	/* round to nearest, a carry correctly bumps the exponent */
+	return sign | ((((e - 112) << 10) | (m >> 13)) + ((m >> 12) & 1));
+}
+
+static unsigned int pack_snorm10(float f)
+{
+	f = f < -1.0f ? -1.0f : (f > 1.0f ? 1.0f : f);
+	return (unsigned int)((int)floor(f * 511.0f + 0.5f)) & 0x3FF;
+}
+
+static unsigned short pack_unorm16(float f)
+{
+	f = f < 0.0f ? 0.0f : (f > 1.0f ? 1.0f : f);
+	return (unsigned short)(f * 65535.0f + 0.5f);
+}
+
+int mesh_quantize(mesh *m)
+{
+	int tex = (m->format & VF_TEX0) != 0, unorm = 1;
+	unsigned int i, vs = tex ? 8 : 6, stride = tex ? 16 : 12;
+	unsigned short half[4], tc[2];
+	unsigned char *out, *dst;
+	unsigned int n;
+	const float *v;
+
+	if (m->format & VF_LAYOUT)
+		return 1;
+
+	out = malloc(stride * m->vertices);
+	if (!out)
+		return 0;
+
+	/* 16 bit normalized texture coordinates only cover [0,1] */
+	for (i = 0; tex && i < m->vertices; ++i) {
+		v = m->vertexbuffer + vs * i;
+
+		if (v[6] < 0.0f || v[6] > 1.0f || v[7] < 0.0f || v[7] > 1.0f)
+			unorm = 0;
+	}
+
+	for (i = 0; i < m->vertices; ++i) {
+		v = m->vertexbuffer + vs * i;
+		dst = out + stride * i;
+
+		half[0] = float_to_half(v[0]);
+		half[1] = float_to_half(v[1]);
+		half[2] = float_to_half(v[2]);
+		half[3] = float_to_half(1.0f);
+		memcpy(dst, half, sizeof(half));
+
+		n = pack_snorm10(v[3]) | (pack_snorm10(v[4]) << 10) |
+			(pack_snorm10(v[5]) << 20);
+		memcpy(dst + 8, &n, sizeof(n));
+
+		if (tex && unorm) {
+			tc[0] = pack_unorm16(v[6]);
+			tc[1] = pack_unorm16(v[7]);
+			memcpy(dst + 12, tc, sizeof(tc));
+		} else if (tex) {
+			tc[0] = float_to_half(v[6]);
+			tc[1] = float_to_half(v[7]);
+			memcpy(dst + 12, tc, sizeof(tc));
+		}
+	}
+
+	memset(m->attrib_format, 0, sizeof(m->attrib_format));
+	memset(m->attrib_offset, 0, sizeof(m->attrib_offset));
+
+	m->attrib_format[ATTRIB_POS] = AF_HALF4;
+	m->attrib_format[ATTRIB_NORMAL] = AF_INT_10_10_10_2_NORM;
+	m->attrib_offset[ATTRIB_NORMAL] = 8;
+
+	if (tex) {
+		m->attrib_format[ATTRIB_TEX0] = unorm ? AF_USHORT2_NORM :
+							AF_HALF2;
+		m->attrib_offset[ATTRIB_TEX0] = 12;
+	}
+
+	/* rounding to half floats moves positions by at most 2^-11 */
+	m->bounds_min.x -= fabs(m->bounds_min.x) / 2048.0f;
+	m->bounds_min.y -= fabs(m->bounds_min.y) / 2048.0f;
+	m->bounds_min.z -= fabs(m->bounds_min.z) / 2048.0f;
+	m->bounds_max.x += fabs(m->bounds_max.x) / 2048.0f;
+	m->bounds_max.y += fabs(m->bounds_max.y) / 2048.0f;
+	m->bounds_max.z += fabs(m->bounds_max.z) / 2048.0f;
+
+	free(m->vertexbuffer);
+	m->vertexbuffer = (float *)out;
+	m->format = VF_LAYOUT;
+	m->stride = stride;
+	return 1;
+}
+
+void mesh_bind(const mesh *m, context *ctx)
+{
+	unsigned int i;
+
+	ctx->vertex_format = m->format;
+	ctx->vertexbuffer = m->vertexbuffer;
+	ctx->indexbuffer = m->indexbuffer;
+	ctx->bounds.min = m->bounds_min;
+	ctx->bounds.max = m->bounds_max;
+
+	if (!(m->format & VF_LAYOUT))
+		return;
+
+	ctx->vertex_layout.stream[0] = m->vertexbuffer;
+
+	for (i = 0; i < ATTRIB_COUNT; ++i) {
+		ctx->vertex_layout.attrib[i].format = m->attrib_format[i];
+		ctx->vertex_layout.attrib[i].stream = 0;
+		ctx->vertex_layout.attrib[i].offset = m->attrib_offset[i];
+		ctx->vertex_layout.attrib[i].stride = m->stride;
+	}
+}
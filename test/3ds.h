@@ -1,6 +1,7 @@
 #ifndef LOADER_3DS_H
 #define LOADER_3DS_H
 
+#include "context.h"
 
 typedef struct {
 	float *vertexbuffer;
@@ -8,6 +9,15 @@ typedef struct {
 	int format;
 	unsigned int vertices;
 	unsigned int indices;
+
+	/* ATTRIB_FORMAT and offset of each attribute if format is VF_LAYOUT */
+	int attrib_format[ATTRIB_COUNT];
+	unsigned int attrib_offset[ATTRIB_COUNT];
+	unsigned int stride;
+
+	/* object space bounding box of the vertex positions */
+	vec4 bounds_min;
+	vec4 bounds_max;
 } mesh;
 
 
@@ -17,6 +27,14 @@ extern "C" {
 
 mesh *load_3ds(const char *filename);
 
+/* convert the vertex buffer to half float positions, 10:10:10:2 normals
+   and 16 bit texture coordinates, non-zero on success */
+int mesh_quantize(mesh *m);
+
+/* set the vertex format and buffer or layout and the bounding box of a
+   mesh on a context */
+void mesh_bind(const mesh *m, context *ctx);
+
 #ifdef __cplusplus
 }
 #endif
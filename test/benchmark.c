@@ -1,6 +1,8 @@
 #include "inputassembler.h"
 #include "framebuffer.h"
 #include "context.h"
+#include "meshopt.h"
+#include "shadervm.h"
 #include "3ds.h"
 
 #include <stdlib.h>
@@ -9,6 +11,8 @@
 #include <time.h>
 
 static mesh* teapot;
+static mesh* optimized;
+static mesh* quantized;
 
 static double get_time(void)
 {
@@ -34,7 +38,7 @@ static void print_eng(double d)
 	}
 }
 
-static void run_fillrate_test(int shader)
+static void run_fillrate_test(const shader_program *shader, int flags)
 {
 	double t0, t1, dt;
 	framebuffer fb;
@@ -48,7 +52,8 @@ static void run_fillrate_test(int shader)
 	context_init(&ctx);
 
 	ctx.target = &fb;
-	ctx.shader = shader_internal(shader);
+	ctx.shader = shader;
+	ctx.flags |= IMMEDIATE_DEDUP | flags;
 
 	context_set_viewport(&ctx, 0, 0, 1024, 768);
 
@@ -84,6 +89,7 @@ static void run_fillrate_test(int shader)
 	t1 = get_time();
 
 	/* cleanup */
+	context_cleanup(&ctx);
 	framebuffer_cleanup(&fb);
 	dt = (t1 - t0) / 100.0;
 
@@ -92,10 +98,35 @@ static void run_fillrate_test(int shader)
 	puts(" pixels per second");
 }
 
-static void run_vertex_throughput_test(int shader)
+static void run_shadervm_fillrate_test(void)
 {
-	double t0, t1, dt;
+	static const char *source =
+		"load r0, color\n"
+		"uniform r1, u0\n"
+		"uniform r2, u1\n"
+		"mad r1, r1, r2, r2\n"
+		"mul r0, r0, r1\n"
+		"out r0\n";
+	static shadervm vm;
+
+	shadervm_init(&vm);
+	shadervm_set_uniform(&vm, 0, vec4_set(0.5f, 0.5f, 0.5f, 1.0f));
+	shadervm_set_uniform(&vm, 1, vec4_set(1.0f, 0.5f, 0.5f, 0.5f));
+
+	if (!shadervm_load(&vm, source)) {
+		puts("failed to load program");
+		return;
+	}
+
+	run_fillrate_test(&vm.program, 0);
+}
+
+static void run_vertex_throughput_test(const mesh *m, int shader,
+					int strategy)
+{
+	double t0, t1, dt, acmr;
 	framebuffer fb;
+	float m4[16];
 	context ctx;
 	int i, j;
 
@@ -105,15 +136,22 @@ static void run_vertex_throughput_test(int shader)
 	memset(&ctx, 0, sizeof(ctx));
 	context_init(&ctx);
 
-	ctx.flags = FRONT_CCW | CULL_BACK | CULL_FRONT;
+	ctx.flags = FRONT_CCW | CULL_BACK;
 	ctx.target = &fb;
-	ctx.vertex_format = teapot->format;
-	ctx.vertexbuffer = teapot->vertexbuffer;
-	ctx.indexbuffer = teapot->indexbuffer;
+	mesh_bind(m, &ctx);
 	ctx.shader = shader_internal(shader);
+	ctx.indexed_strategy = strategy;
 
 	context_set_viewport(&ctx, 0, 0, 320, 200);
 
+	/* scale the mesh into the view, so the triangles that are not back
+	   facing are rasterized */
+	memset(m4, 0, sizeof(m4));
+	m4[0] = m4[5] = m4[10] = 0.01f;
+	m4[13] = -0.1f;
+	m4[15] = 1.0f;
+	context_set_modelview_matrix(&ctx, m4);
+
 	ctx.light[0].diffuse = vec4_set(1.0f, 1.0f, 1.0f, 1.0f);
 	ctx.light[0].specular = vec4_set(1.0f, 1.0f, 1.0f, 1.0f);
 	ctx.light[0].enable = 1;
@@ -125,43 +163,217 @@ static void run_vertex_throughput_test(int shader)
 	ctx.material.emission = vec4_set(0.0f, 0.0f, 0.0f, 1.0f);
 	ctx.material.shininess = 127;
 
+	context_set_vertex_cache(&ctx, 32, 32);
+
 	/* drawing loop */
 	t0 = get_time();
 
 	for (i = 0; i < 100; ++i) {
 		for (j = 0; j < 20; ++j) {
-			ia_draw_triangles_indexed(&ctx, teapot->vertices,
-						  teapot->indices);
+			ia_draw_triangles_indexed(&ctx, m->vertices,
+						  m->indices);
 		}
 	}
 
 	t1 = get_time();
 
 	/* cleanup */
+	context_cleanup(&ctx);
 	framebuffer_cleanup(&fb);
 	dt = (t1 - t0) / 100.0;
 
-	print_eng((double)(20 * teapot->indices) / dt);
+	print_eng((double)(20 * m->indices) / dt);
+
+	if (strategy != INDEXED_DRAW_CACHE) {
+		puts(" vertices per second");
+		return;
+	}
+
+	/* average shaded vertices per triangle */
+	acmr = (double)ctx.vertex_cache.misses /
+		((double)(100 * 20) * (double)(m->indices / 3));
+
+	printf(" vertices per second, ACMR %.3f (%lu hits, %lu misses)\n",
+		acmr, ctx.vertex_cache.hits, ctx.vertex_cache.misses);
+}
+
+static void run_instancing_test(int instanced)
+{
+	rs_instance instances[500];
+	double t0, t1, dt;
+	framebuffer fb;
+	context ctx;
+	int i, j;
+
+	framebuffer_init(&fb, 320, 200);
+
+	/* initialize context */
+	memset(&ctx, 0, sizeof(ctx));
+	context_init(&ctx);
+
+	ctx.flags = FRONT_CCW | CULL_BACK;
+	ctx.target = &fb;
+	ctx.vertex_format = teapot->format;
+	ctx.vertexbuffer = teapot->vertexbuffer;
+	ctx.indexbuffer = teapot->indexbuffer;
+	ctx.shader = shader_internal(SHADER_PHONG);
+
+	context_set_viewport(&ctx, 0, 0, 320, 200);
+
+	ctx.light[0].enable = 1;
+	ctx.light[0].attenuation_constant = 1.0f;
+
+	for (i = 0; i < 500; ++i) {
+		memset(instances[i].modelview, 0, sizeof(float) * 16);
+		instances[i].modelview[0] = 0.05f;
+		instances[i].modelview[5] = 0.05f;
+		instances[i].modelview[10] = 0.05f;
+		instances[i].modelview[12] = (float)(i % 25) * 0.08f - 1.0f;
+		instances[i].modelview[13] = (float)(i / 25) * 0.1f - 1.0f;
+		instances[i].modelview[15] = 1.0f;
+		instances[i].color = vec4_set(1.0f, 1.0f, 1.0f, 1.0f);
+	}
+
+	/* drawing loop */
+	t0 = get_time();
+
+	for (i = 0; i < 10; ++i) {
+		if (instanced) {
+			ia_draw_triangles_indexed_instanced(&ctx,
+							teapot->vertices,
+							teapot->indices,
+							instances, 500);
+			continue;
+		}
+
+		for (j = 0; j < 500; ++j) {
+			context_set_modelview_matrix(&ctx,
+						instances[j].modelview);
+			ia_draw_triangles_indexed(&ctx, teapot->vertices,
+						teapot->indices);
+		}
+	}
+
+	t1 = get_time();
+
+	/* cleanup */
+	context_cleanup(&ctx);
+	framebuffer_cleanup(&fb);
+	dt = (t1 - t0) / 10.0;
+
+	print_eng((double)(500 * teapot->indices) / dt);
 	puts(" vertices per second");
 }
 
+static mesh *optimize_mesh(const mesh *m)
+{
+	unsigned int vsize = ia_vertex_size(m->format);
+	mesh *out = calloc(1, sizeof(*out));
+
+	if (!out)
+		return NULL;
+
+	*out = *m;
+	out->vertexbuffer = malloc(vsize * m->vertices);
+	out->indexbuffer = malloc(sizeof(unsigned short) * m->indices);
+
+	if (!out->vertexbuffer || !out->indexbuffer)
+		goto fail;
+
+	memcpy(out->vertexbuffer, m->vertexbuffer, vsize * m->vertices);
+	memcpy(out->indexbuffer, m->indexbuffer,
+		sizeof(unsigned short) * m->indices);
+
+	if (!meshopt_optimize_vertex_cache(out->indexbuffer, INDEX_U16,
+					out->indices, out->vertices, 32))
+		goto fail;
+
+	/* the benchmark only measures vertex throughput, so do not trade
+	   any vertex cache efficiency for less overdraw */
+	if (!meshopt_optimize_overdraw(out->indexbuffer, INDEX_U16,
+					out->indices, out->vertexbuffer,
+					out->format, out->vertices, 1.0f))
+		goto fail;
+
+	if (!meshopt_optimize_vertex_fetch(out->vertexbuffer, out->format,
+					out->vertices, out->indexbuffer,
+					INDEX_U16, out->indices))
+		goto fail;
+
+	return out;
+fail:
+	free(out->vertexbuffer);
+	free(out->indexbuffer);
+	free(out);
+	return NULL;
+}
 
 int main(void)
 {
 	teapot = load_3ds("teapot.3ds");
+	optimized = optimize_mesh(teapot);
+	quantized = load_3ds("teapot.3ds");
+	mesh_quantize(quantized);
+
+	puts("************* MESH OPTIMIZATION **************");
+	printf("ACMR (32 entry FIFO): %.3f -> %.3f\n",
+		meshopt_compute_acmr(teapot->indexbuffer, INDEX_U16,
+					teapot->indices, 32),
+		meshopt_compute_acmr(optimized->indexbuffer, INDEX_U16,
+					optimized->indices, 32));
 
 	puts("*********** VERTEX THROUGHPUT TEST ***********");
-	fputs("BUILT IN UNLIT SHADER: ", stdout);
-	run_vertex_throughput_test(SHADER_UNLIT);
-	fputs("BUILT IN PHONG SHADER: ", stdout);
-	run_vertex_throughput_test(SHADER_PHONG);
+	fputs("BUILT IN UNLIT SHADER, VERTEX CACHE: ", stdout);
+	run_vertex_throughput_test(teapot, SHADER_UNLIT, INDEXED_DRAW_CACHE);
+	fputs("BUILT IN UNLIT SHADER, PRETRANSFORM: ", stdout);
+	run_vertex_throughput_test(teapot, SHADER_UNLIT,
+					INDEXED_DRAW_PRETRANSFORM);
+	fputs("BUILT IN PHONG SHADER, VERTEX CACHE: ", stdout);
+	run_vertex_throughput_test(teapot, SHADER_PHONG, INDEXED_DRAW_CACHE);
+	fputs("BUILT IN PHONG SHADER, PRETRANSFORM: ", stdout);
+	run_vertex_throughput_test(teapot, SHADER_PHONG,
+					INDEXED_DRAW_PRETRANSFORM);
+	fputs("OPTIMIZED MESH, UNLIT SHADER, VERTEX CACHE: ", stdout);
+	run_vertex_throughput_test(optimized, SHADER_UNLIT,
+					INDEXED_DRAW_CACHE);
+	fputs("OPTIMIZED MESH, PHONG SHADER, VERTEX CACHE: ", stdout);
+	run_vertex_throughput_test(optimized, SHADER_PHONG,
+					INDEXED_DRAW_CACHE);
+
+	printf("QUANTIZED MESH: %u -> %u bytes of vertex data\n",
+		teapot->vertices * ia_vertex_size(teapot->format),
+		quantized->vertices * quantized->stride);
+	fputs("QUANTIZED MESH, UNLIT SHADER, VERTEX CACHE: ", stdout);
+	run_vertex_throughput_test(quantized, SHADER_UNLIT,
+					INDEXED_DRAW_CACHE);
+	fputs("QUANTIZED MESH, UNLIT SHADER, PRETRANSFORM: ", stdout);
+	run_vertex_throughput_test(quantized, SHADER_UNLIT,
+					INDEXED_DRAW_PRETRANSFORM);
+
+	puts("************* 500 INSTANCES TEST *************");
+	fputs("ONE DRAW CALL PER INSTANCE: ", stdout);
+	run_instancing_test(0);
+	fputs("INSTANCED DRAW CALL: ", stdout);
+	run_instancing_test(1);
 
 	puts("*************** FILL RATE TEST ***************" );
 	fputs("BUILT IN UNLIT SHADER: ", stdout);
-	run_fillrate_test(SHADER_UNLIT);
+	run_fillrate_test(shader_internal(SHADER_UNLIT), 0);
 	fputs("BUILT IN PHONG SHADER: ", stdout);
-	run_fillrate_test(SHADER_PHONG);
-
+	run_fillrate_test(shader_internal(SHADER_PHONG), 0);
+	fputs("BUILT IN PHONG SHADER, FAST LIGHTING: ", stdout);
+	run_fillrate_test(shader_internal(SHADER_PHONG), LIGHTING_FAST);
+	fputs("BUILT IN GOURAUD SHADER: ", stdout);
+	run_fillrate_test(shader_internal(SHADER_GOURAUD), 0);
+	fputs("SHADERVM PROGRAM: ", stdout);
+	run_shadervm_fillrate_test();
+
+	free(quantized->vertexbuffer);
+	free(quantized->indexbuffer);
+	free(quantized);
+	free(optimized->vertexbuffer);
+	free(optimized->indexbuffer);
+	free(optimized);
 	free(teapot->vertexbuffer);
 	free(teapot->indexbuffer);
 	free(teapot);
@@ -40,6 +40,7 @@ int main(void)
 		window_display_framebuffer(w);
 	}
 
+	context_cleanup(&ctx);
 	window_destroy(w);
 	return 0;
 }
@@ -2,6 +2,7 @@
 #include "framebuffer.h"
 #include "rasterizer.h"
 #include "texture.h"
+#include "headless.h"
 #include "context.h"
 #include "window.h"
 #include "vector.h"
@@ -15,6 +16,9 @@
 #define WIDTH 1024
 #define HEIGHT 768
 
+/* number of frames written if the output goes to a file */
+#define RECORD_FRAMES 300
+
 static context ctx;
 static float a = 0.0f;
 static texture* tex;
@@ -87,19 +91,64 @@ static void draw_scene(void)
 	ia_draw_triangles_indexed(&ctx, teapot->vertices, teapot->indices);
 }
 
-int main( void )
+static void draw_frame(framebuffer *fb)
+{
+	ctx.target = fb;
+
+	framebuffer_clear(fb, 0, 0, 0, 0xFF);
+	framebuffer_clear_depth(fb, 1.0);
+
+	draw_scene();
+
+	a += 0.02f;
+}
+
+/* write the animation as a YUV4MPEG2 stream instead of showing it,
+   e.g. "./a.out - | ffplay -" */
+static int record(const char *path)
+{
+	framebuffer fb;
+	headless *out;
+	int i, ret;
+
+	if (!framebuffer_init(&fb, WIDTH, HEIGHT))
+		return 0;
+
+	ctx.target = &fb;
+	context_set_viewport(&ctx, 0, 0, WIDTH, HEIGHT);
+
+	out = headless_create(path, HEADLESS_Y4M, WIDTH, HEIGHT, 60, 4);
+	if (!out) {
+		framebuffer_cleanup(&fb);
+		return 0;
+	}
+
+	for (i = 0, ret = 1; i < RECORD_FRAMES && ret; ++i) {
+		draw_frame(&fb);
+		ret = headless_submit_framebuffer(out, &fb);
+	}
+
+	headless_destroy(out);
+	framebuffer_cleanup(&fb);
+	return ret;
+}
+
+int main(int argc, char **argv)
 {
 	float far, near, aspect, f, iNF, m[16];
 	unsigned char* ptr;
 	unsigned int x, y;
 	framebuffer *fb;
-	window* w;
+	window* w = NULL;
+	int ret = 1;
 
 	/************* initalisation *************/
-	w = window_create(WIDTH, HEIGHT);
+	if (argc < 2) {
+		w = window_create_swap_chain(WIDTH, HEIGHT, 2);
 
-	if (w == NULL)
-		return EXIT_FAILURE;
+		if (w == NULL)
+			return EXIT_FAILURE;
+	}
 
 	teapot = load_3ds("teapot.3ds");
 
@@ -148,29 +197,28 @@ int main( void )
 	ctx.material.emission = vec4_set(0.0f, 0.0f, 0.0f, 1.0f);
 	ctx.material.shininess = 127;
 
-	fb = window_get_framebuffer(w);
-	ctx.target = fb;
-
-	context_set_viewport(&ctx, 0, 0, WIDTH, HEIGHT);
-
 	/************* drawing loop *************/
-	while (window_handle_events(w)) {
-		framebuffer_clear(fb, 0, 0, 0, 0xFF);
-		framebuffer_clear_depth(fb, 1.0);
-
-		draw_scene();
-
-		a += 0.02f;
-
-		window_display_framebuffer(w);
+	if (w) {
+		ctx.target = window_get_framebuffer(w);
+		context_set_viewport(&ctx, 0, 0, WIDTH, HEIGHT);
+
+		while (window_handle_events(w)) {
+			fb = window_acquire_framebuffer(w);
+			draw_frame(fb);
+			window_present_framebuffer(w, fb);
+		}
+	} else {
+		ret = record(argv[1]);
 	}
 
 	/************* cleanup *************/
+	context_cleanup(&ctx);
 	texture_destroy(tex);
-	window_destroy(w);
+	if (w)
+		window_destroy(w);
 	free(teapot->vertexbuffer);
 	free(teapot->indexbuffer);
 	free(teapot);
-	return EXIT_SUCCESS;
+	return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 